@@ -0,0 +1,155 @@
+#include "adler32.h"
+#include "cpu.h"
+
+#ifdef PNG_X86
+#include <immintrin.h>
+#endif
+
+namespace
+{
+	constexpr uint32_t base = 65521;
+	// largest n such that 255 * n * (n + 1) / 2 + (n + 1) * (base - 1)
+	// fits in 32 bits, sums are reduced only once per that many bytes
+	constexpr size_t nmax = 5552;
+
+	uint32_t updateScalar(uint32_t adler, const uint8_t* buf, size_t len)
+	{
+		uint32_t s1 = adler & 0xFFFF;
+		uint32_t s2 = adler >> 16;
+		while (len > 0)
+		{
+			size_t n = (len < nmax) ? len : nmax;
+			len -= n;
+			while (n >= 8)
+			{
+				s2 += (s1 += buf[0]);
+				s2 += (s1 += buf[1]);
+				s2 += (s1 += buf[2]);
+				s2 += (s1 += buf[3]);
+				s2 += (s1 += buf[4]);
+				s2 += (s1 += buf[5]);
+				s2 += (s1 += buf[6]);
+				s2 += (s1 += buf[7]);
+				buf += 8;
+				n -= 8;
+			}
+			while (n-- > 0)
+				s2 += (s1 += *(buf++));
+			s1 %= base;
+			s2 %= base;
+		}
+		return s1 | (s2 << 16);
+	}
+
+#ifdef PNG_X86
+	// Both kernels work on 32-byte blocks: s1 grows by the plain byte sum
+	// of a block, s2 by 32 * s1 before the block plus the byte sum weighted
+	// 32, 31, ..., 1. The 32 * s1 terms are collected in ps and added once
+	// per nmax bytes, so the modulo is taken only that often
+	constexpr size_t blockSize = 32;
+
+	PNG_TARGET("ssse3")
+	uint32_t updateSsse3(uint32_t adler, const uint8_t* buf, size_t len)
+	{
+		uint32_t s1 = adler & 0xFFFF;
+		uint32_t s2 = adler >> 16;
+		size_t blocks = len / blockSize;
+		len -= blocks * blockSize;
+
+		const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+		const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i ones = _mm_set1_epi16(1);
+		while (blocks > 0)
+		{
+			size_t n = (blocks < nmax / blockSize) ? blocks : nmax / blockSize;
+			blocks -= n;
+
+			__m128i ps = _mm_cvtsi32_si128(static_cast<int>(s1 * n));
+			__m128i vs2 = _mm_cvtsi32_si128(static_cast<int>(s2));
+			__m128i vs1 = _mm_setzero_si128();
+			do
+			{
+				const __m128i bytes1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf));
+				const __m128i bytes2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 16));
+				ps = _mm_add_epi32(ps, vs1);
+				vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(bytes1, zero));
+				vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+				vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(bytes2, zero));
+				vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+				buf += blockSize;
+			} while (--n > 0);
+			vs2 = _mm_add_epi32(vs2, _mm_slli_epi32(ps, 5));
+
+			// horizontal sums
+			vs1 = _mm_add_epi32(vs1, _mm_shuffle_epi32(vs1, _MM_SHUFFLE(2, 3, 0, 1)));
+			vs1 = _mm_add_epi32(vs1, _mm_shuffle_epi32(vs1, _MM_SHUFFLE(1, 0, 3, 2)));
+			s1 += static_cast<uint32_t>(_mm_cvtsi128_si32(vs1));
+			vs2 = _mm_add_epi32(vs2, _mm_shuffle_epi32(vs2, _MM_SHUFFLE(2, 3, 0, 1)));
+			vs2 = _mm_add_epi32(vs2, _mm_shuffle_epi32(vs2, _MM_SHUFFLE(1, 0, 3, 2)));
+			s2 = static_cast<uint32_t>(_mm_cvtsi128_si32(vs2));
+			s1 %= base;
+			s2 %= base;
+		}
+		return updateScalar(s1 | (s2 << 16), buf, len);
+	}
+
+	PNG_TARGET("avx2")
+	uint32_t updateAvx2(uint32_t adler, const uint8_t* buf, size_t len)
+	{
+		uint32_t s1 = adler & 0xFFFF;
+		uint32_t s2 = adler >> 16;
+		size_t blocks = len / blockSize;
+		len -= blocks * blockSize;
+
+		const __m256i tap = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+			16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i ones = _mm256_set1_epi16(1);
+		while (blocks > 0)
+		{
+			size_t n = (blocks < nmax / blockSize) ? blocks : nmax / blockSize;
+			blocks -= n;
+
+			__m256i ps = _mm256_zextsi128_si256(_mm_cvtsi32_si128(static_cast<int>(s1 * n)));
+			__m256i vs2 = _mm256_zextsi128_si256(_mm_cvtsi32_si128(static_cast<int>(s2)));
+			__m256i vs1 = _mm256_setzero_si256();
+			do
+			{
+				const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(buf));
+				ps = _mm256_add_epi32(ps, vs1);
+				vs1 = _mm256_add_epi32(vs1, _mm256_sad_epu8(bytes, zero));
+				vs2 = _mm256_add_epi32(vs2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes, tap), ones));
+				buf += blockSize;
+			} while (--n > 0);
+			vs2 = _mm256_add_epi32(vs2, _mm256_slli_epi32(ps, 5));
+
+			// horizontal sums
+			__m128i vs1x = _mm_add_epi32(_mm256_castsi256_si128(vs1), _mm256_extracti128_si256(vs1, 1));
+			vs1x = _mm_add_epi32(vs1x, _mm_shuffle_epi32(vs1x, _MM_SHUFFLE(2, 3, 0, 1)));
+			vs1x = _mm_add_epi32(vs1x, _mm_shuffle_epi32(vs1x, _MM_SHUFFLE(1, 0, 3, 2)));
+			s1 += static_cast<uint32_t>(_mm_cvtsi128_si32(vs1x));
+			__m128i vs2x = _mm_add_epi32(_mm256_castsi256_si128(vs2), _mm256_extracti128_si256(vs2, 1));
+			vs2x = _mm_add_epi32(vs2x, _mm_shuffle_epi32(vs2x, _MM_SHUFFLE(2, 3, 0, 1)));
+			vs2x = _mm_add_epi32(vs2x, _mm_shuffle_epi32(vs2x, _MM_SHUFFLE(1, 0, 3, 2)));
+			s2 = static_cast<uint32_t>(_mm_cvtsi128_si32(vs2x));
+			s1 %= base;
+			s2 %= base;
+		}
+		return updateScalar(s1 | (s2 << 16), buf, len);
+	}
+#endif
+}
+
+uint32_t Adler32::update(uint32_t adler, const uint8_t* buf, size_t len)
+{
+#ifdef PNG_X86
+	static const bool useAvx2 = Cpu::hasAvx2();
+	static const bool useSsse3 = Cpu::hasSsse3();
+	if (useAvx2)
+		return updateAvx2(adler, buf, len);
+	if (useSsse3)
+		return updateSsse3(adler, buf, len);
+#endif
+	return updateScalar(adler, buf, len);
+}
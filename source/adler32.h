@@ -0,0 +1,11 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// Adler-32 checksum of zlib streams, start with 1
+namespace Adler32
+{
+	// picks AVX2 or SSSE3 kernel when the cpu supports it
+	uint32_t update(uint32_t adler, const uint8_t* buf, size_t len);
+}
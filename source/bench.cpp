@@ -0,0 +1,660 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+
+#include "decoder.h"
+#include "deflater.h"
+#include "cpu.h"
+
+// png_bench [--size n] [--reps n] [--warmup n] [--seed n] [--write dir]
+//
+// generates a synthetic corpus with every colour type and bit depth,
+// interlaced and not, photo-like and flat content, each compressed with
+// stored, fixed code and dynamic code blocks. Then times the stages of
+// decoding separately over the whole corpus and prints throughput and
+// cycles per byte, followed by throughput of groups of images
+
+namespace
+{
+	// splitmix64, so that the corpus is the same everywhere for a seed
+	class Random
+	{
+	public:
+		Random(uint64_t seed) : state(seed) {}
+		uint64_t next()
+		{
+			uint64_t z = (state += 0x9E3779B97F4A7C15);
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+			return z ^ (z >> 31);
+		}
+		uint32_t below(uint32_t n)
+		{
+			return static_cast<uint32_t>(next() % n);
+		}
+	private:
+		uint64_t state;
+	};
+
+	enum class Content { Photo, Flat };
+	enum class Blocks { Stored, Static, Dynamic };
+
+	// starting column and row of Adam7 passes and steps between them
+	struct Pass
+	{
+		uint32_t xStart, yStart, xStep, yStep;
+	};
+
+	constexpr std::array<Pass, 7> adam7Passes = { {
+		{ 0, 0, 8, 8 }, { 4, 0, 8, 8 }, { 0, 4, 4, 8 }, { 2, 0, 4, 4 }, { 0, 2, 2, 4 }, { 1, 0, 2, 2 }, { 0, 1, 1, 2 } } };
+	constexpr Pass wholeImagePass = { 0, 0, 1, 1 };
+
+	std::vector<Pass> getPasses(uint32_t width, uint32_t height, uint8_t interlaceMethod)
+	{
+		if (interlaceMethod == 0)
+			return { wholeImagePass };
+		std::vector<Pass> res;
+		for (const Pass& pass : adam7Passes)
+		{
+			if (width > pass.xStart && height > pass.yStart)
+				res.push_back(pass);
+		}
+		return res;
+	}
+
+	uint32_t getPassWidth(uint32_t width, const Pass& pass)
+	{
+		return (width - pass.xStart + pass.xStep - 1) / pass.xStep;
+	}
+
+	uint32_t getPassHeight(uint32_t height, const Pass& pass)
+	{
+		return (height - pass.yStart + pass.yStep - 1) / pass.yStep;
+	}
+
+	size_t getChannelCount(uint8_t colourType)
+	{
+		switch (colourType)
+		{
+		case 2:
+			return 3;
+		case 4:
+			return 2;
+		case 6:
+			return 4;
+		default:
+			return 1;
+		}
+	}
+
+	struct CorpusImage
+	{
+		std::string name;
+		uint8_t colourType;
+		uint8_t bitDepth;
+		uint8_t interlaceMethod;
+		Content content;
+		Blocks blocks;
+		uint32_t width;
+		uint32_t height;
+		std::vector<uint8_t> palette;
+		std::vector<uint8_t> file;
+		// inflated size, including filter type bytes
+		size_t filteredSize = 0;
+	};
+
+	// samples of every pixel, channels of a pixel follow each other
+	std::vector<uint16_t> generateSamples(uint32_t width, uint32_t height, uint8_t colourType, uint8_t bitDepth,
+		Content content, Random& random)
+	{
+		size_t channels = getChannelCount(colourType);
+		bool hasAlpha = colourType == 4 || colourType == 6;
+		uint32_t maxValue = (1u << bitDepth) - 1;
+		std::vector<uint16_t> samples(static_cast<size_t>(width) * height * channels);
+		if (content == Content::Photo)
+		{
+			// smooth gradients with noise
+			for (uint32_t y = 0; y < height; y++)
+			{
+				for (uint32_t x = 0; x < width; x++)
+				{
+					for (size_t c = 0; c < channels; c++)
+					{
+						int32_t v;
+						if (hasAlpha && c + 1 == channels)
+							v = 255 - static_cast<int32_t>(x * 128 / width);
+						else
+						{
+							v = static_cast<int32_t>((x * 255 / width * (c + 1) + y * 255 / height * (4 - c)) / 5);
+							v += static_cast<int32_t>(random.below(13)) - 6;
+						}
+						v = std::clamp(v, 0, 255);
+						uint32_t sample = bitDepth == 16 ? v * 257 + random.below(256) - (v == 255 ? 255 : 0)
+							: static_cast<uint32_t>(v) >> (8 - std::min<uint8_t>(bitDepth, 8));
+						samples[(static_cast<size_t>(y) * width + x) * channels + c] = static_cast<uint16_t>(std::min(sample, maxValue));
+					}
+				}
+			}
+		}
+		else
+		{
+			// tiles of a few colours
+			constexpr uint32_t tileSize = 32;
+			std::array<std::array<uint16_t, 4>, 4> colours;
+			for (std::array<uint16_t, 4>& colour : colours)
+			{
+				for (size_t c = 0; c < channels; c++)
+					colour[c] = (hasAlpha && c + 1 == channels) ? static_cast<uint16_t>(maxValue) : static_cast<uint16_t>(random.below(maxValue + 1));
+			}
+			uint32_t tilesPerRow = (width + tileSize - 1) / tileSize;
+			uint32_t tileRows = (height + tileSize - 1) / tileSize;
+			std::vector<uint8_t> tiles(static_cast<size_t>(tilesPerRow) * tileRows);
+			for (uint8_t& tile : tiles)
+				tile = static_cast<uint8_t>(random.below(4));
+			for (uint32_t y = 0; y < height; y++)
+			{
+				for (uint32_t x = 0; x < width; x++)
+				{
+					const std::array<uint16_t, 4>& colour = colours[tiles[(y / tileSize) * tilesPerRow + x / tileSize]];
+					std::copy(colour.begin(), colour.begin() + channels, samples.begin() + (static_cast<size_t>(y) * width + x) * channels);
+				}
+			}
+		}
+		return samples;
+	}
+
+	// packs samples of count pixels, step pixels apart, into a scanline
+	void packScanline(const uint16_t* samples, size_t channels, uint8_t bitDepth, uint32_t count, uint32_t step,
+		uint8_t* dest)
+	{
+		size_t bitPos = 0;
+		for (uint32_t i = 0; i < count; i++)
+		{
+			const uint16_t* pixel = samples + static_cast<size_t>(i) * step * channels;
+			for (size_t c = 0; c < channels; c++)
+			{
+				if (bitDepth == 16)
+				{
+					dest[bitPos / 8] = static_cast<uint8_t>(pixel[c] >> 8);
+					dest[bitPos / 8 + 1] = static_cast<uint8_t>(pixel[c]);
+				}
+				else if (bitDepth == 8)
+					dest[bitPos / 8] = static_cast<uint8_t>(pixel[c]);
+				else
+				{
+					// the first pixel takes the most significant bits
+					if (bitPos % 8 == 0)
+						dest[bitPos / 8] = 0;
+					dest[bitPos / 8] |= static_cast<uint8_t>(pixel[c] << (8 - bitDepth - bitPos % 8));
+				}
+				bitPos += bitDepth;
+			}
+		}
+	}
+
+	CorpusImage generateImage(uint32_t width, uint32_t height, uint8_t colourType, uint8_t bitDepth,
+		uint8_t interlaceMethod, Content content, Blocks blocks, Random& random)
+	{
+		CorpusImage image;
+		std::ostringstream name;
+		name << "ct" << int(colourType) << "_bd" << int(bitDepth) << (interlaceMethod ? "_adam7" : "")
+			<< (content == Content::Photo ? "_photo" : "_flat")
+			<< (blocks == Blocks::Stored ? "_stored" : blocks == Blocks::Static ? "_static" : "_dynamic");
+		image.name = name.str();
+		image.colourType = colourType;
+		image.bitDepth = bitDepth;
+		image.interlaceMethod = interlaceMethod;
+		image.content = content;
+		image.blocks = blocks;
+		image.width = width;
+		image.height = height;
+
+		size_t channels = getChannelCount(colourType);
+		std::vector<uint16_t> samples = generateSamples(width, height, colourType, bitDepth, content, random);
+		if (colourType == 3)
+		{
+			for (size_t i = 0; i < (size_t(3) << bitDepth); i++)
+				image.palette.push_back(static_cast<uint8_t>(random.below(256)));
+		}
+
+		std::vector<uint8_t> filtered;
+		for (const Pass& pass : getPasses(width, height, interlaceMethod))
+		{
+			uint32_t passWidth = getPassWidth(width, pass);
+			uint32_t byteLineLength, bytesPerPixel;
+			getScanlineLayout(passWidth, bitDepth, colourType, byteLineLength, bytesPerPixel);
+			// filters read bytesPerPixel zeros in front of the lines
+			std::vector<uint8_t> line1(bytesPerPixel + byteLineLength, 0);
+			std::vector<uint8_t> line2(bytesPerPixel + byteLineLength, 0);
+			uint8_t* line = line1.data() + bytesPerPixel;
+			uint8_t* prevLine = line2.data() + bytesPerPixel;
+			for (uint32_t y = pass.yStart; y < height; y += pass.yStep)
+			{
+				packScanline(samples.data() + (static_cast<size_t>(y) * width + pass.xStart) * channels, channels, bitDepth,
+					passWidth, pass.xStep, line);
+				uint8_t type = Filters::chooseFilter(line, prevLine, byteLineLength, bytesPerPixel);
+				size_t pos = filtered.size();
+				filtered.resize(pos + 1 + byteLineLength);
+				filtered[pos] = type;
+				Filters::filterLine(type, line, prevLine, filtered.data() + pos + 1, byteLineLength, bytesPerPixel);
+				std::swap(line, prevLine);
+			}
+		}
+		image.filteredSize = filtered.size();
+
+		std::vector<uint8_t> zlibData = FlateEncode(filtered, blocks == Blocks::Stored ? 0 : 6, blocks == Blocks::Static);
+		PngChunkWriter out(image.file);
+		out.writeSignature();
+		std::vector<uint8_t> header;
+		PngChunkWriter::writeU32(header, width);
+		PngChunkWriter::writeU32(header, height);
+		header.insert(header.end(), { bitDepth, colourType, 0, 0, interlaceMethod });
+		out.writeChunk("IHDR", header);
+		if (colourType == 3)
+			out.writeChunk("PLTE", image.palette);
+		// small IDAT chunks, so that reading crosses chunk boundaries
+		constexpr size_t chunkLength = 1 << 16;
+		for (size_t pos = 0; pos < zlibData.size(); pos += chunkLength)
+		{
+			out.writeChunk("IDAT", std::span<const uint8_t>(zlibData).subspan(pos,
+				std::min(chunkLength, zlibData.size() - pos)));
+		}
+		out.writeChunk("IEND", {});
+		return image;
+	}
+
+	std::vector<CorpusImage> generateCorpus(uint32_t size, uint64_t seed)
+	{
+		// odd height leaves Adam7 blocks and bytes of low bit depths partly filled
+		uint32_t width = size;
+		uint32_t height = size * 3 / 4 + 5;
+		constexpr std::array<std::pair<uint8_t, std::array<uint8_t, 5>>, 5> bitDepths = { {
+			{ 0, { 1, 2, 4, 8, 16 } }, { 2, { 8, 16 } }, { 3, { 1, 2, 4, 8 } }, { 4, { 8, 16 } }, { 6, { 8, 16 } } } };
+		Random random(seed);
+		std::vector<CorpusImage> corpus;
+		for (const auto& [colourType, depths] : bitDepths)
+		{
+			for (uint8_t bitDepth : depths)
+			{
+				if (bitDepth == 0)
+					continue;
+				for (uint8_t interlaceMethod : { 0, 1 })
+				{
+					for (Content content : { Content::Photo, Content::Flat })
+					{
+						for (Blocks blocks : { Blocks::Stored, Blocks::Static, Blocks::Dynamic })
+							corpus.push_back(generateImage(width, height, colourType, bitDepth, interlaceMethod, content, blocks, random));
+					}
+				}
+			}
+		}
+		return corpus;
+	}
+
+	enum Stage { ChunksStage, InflateStage, UnfilterStage, ConvertStage, DecodeStage, stageCount };
+	constexpr std::array<const char*, stageCount> stageNames = {
+		"chunks + crc", "inflate", "unfilter", "convert", "full decode" };
+
+	// buffers passed between stages
+	struct StageData
+	{
+		std::vector<uint8_t> zlibData;
+		std::vector<uint8_t> filtered;
+		// reconstructed scanlines of all passes
+		std::vector<uint8_t> reconstructed;
+		std::vector<uint8_t> zeroLine;
+		std::vector<uint8_t> pixels;
+		PngDecoder decoder;
+		std::vector<uint8_t> image;
+	};
+
+	// reads all chunks checking their crc and gathers IDAT data
+	void readChunks(std::span<const uint8_t> file, std::vector<uint8_t>& zlibData)
+	{
+		readSignature(file);
+		PngChunkStream in(file, 8);
+		zlibData.clear();
+		uint32_t length;
+		std::string type;
+		do
+		{
+			in.readChunkHeader(length, type);
+			if (type == "IDAT")
+				in.readAllIDATData(zlibData);
+			in.finishCrcAndChunk();
+		} while (type != "IEND");
+	}
+
+	void inflate(const CorpusImage& image, StageData& data)
+	{
+		data.filtered.resize(image.filteredSize);
+		Inflater inflater(std::span<const uint8_t>(data.zlibData));
+		inflater.readAll(data.filtered.data(), data.filtered.size());
+		inflater.finish();
+	}
+
+	void unfilter(const CorpusImage& image, StageData& data)
+	{
+		data.reconstructed.resize(image.filteredSize);
+		const uint8_t* filtered = data.filtered.data();
+		uint8_t* line = data.reconstructed.data();
+		for (const Pass& pass : getPasses(image.width, image.height, image.interlaceMethod))
+		{
+			uint32_t byteLineLength, bytesPerPixel;
+			getScanlineLayout(getPassWidth(image.width, pass), image.bitDepth, image.colourType, byteLineLength, bytesPerPixel);
+			const std::array<Filters::Kernel, 5>& kernels = Filters::getKernels(bytesPerPixel);
+			data.zeroLine.assign(byteLineLength, 0);
+			const uint8_t* prevLine = data.zeroLine.data();
+			for (uint32_t i = 0; i < getPassHeight(image.height, pass); i++)
+			{
+				if (*filtered > 4)
+					throwPngError(PngErrorCode::Filter, "invalid filter method");
+				kernels[*filtered](filtered + 1, line, prevLine, byteLineLength);
+				filtered += byteLineLength + 1;
+				prevLine = line;
+				line += byteLineLength;
+			}
+		}
+	}
+
+	// converts scanlines of passes to RGBA, pixels of a pass follow each other
+	void convert(const CorpusImage& image, StageData& data)
+	{
+		data.pixels.resize(static_cast<size_t>(image.width) * image.height * 4);
+		Pixels::ColourInfo colourInfo;
+		colourInfo.palette = image.palette;
+		Pixels::Tables tables;
+		Pixels::buildTables(colourInfo, image.colourType, image.bitDepth, Pixels::Format::Rgba8, {}, tables);
+		Pixels::Converter converter = Pixels::getConverter(image.colourType, image.bitDepth, Pixels::Format::Rgba8, tables);
+		const uint8_t* line = data.reconstructed.data();
+		uint8_t* dest = data.pixels.data();
+		for (const Pass& pass : getPasses(image.width, image.height, image.interlaceMethod))
+		{
+			uint32_t passWidth = getPassWidth(image.width, pass);
+			uint32_t byteLineLength, bytesPerPixel;
+			getScanlineLayout(passWidth, image.bitDepth, image.colourType, byteLineLength, bytesPerPixel);
+			for (uint32_t i = 0; i < getPassHeight(image.height, pass); i++)
+			{
+				converter(line, dest, passWidth, tables);
+				line += byteLineLength;
+				dest += static_cast<size_t>(passWidth) * 4;
+			}
+		}
+	}
+
+	void decode(const CorpusImage& image, StageData& data)
+	{
+		uint32_t width, height;
+		data.decoder.decode(image.file, data.image, width, height);
+	}
+
+	// bytes a stage is measured against: the file for chunk reading,
+	// inflated data for inflating and unfiltering and RGBA output for the rest
+	size_t getStageBytes(const CorpusImage& image, Stage stage)
+	{
+		switch (stage)
+		{
+		case ChunksStage:
+			return image.file.size();
+		case InflateStage:
+		case UnfilterStage:
+			return image.filteredSize;
+		default:
+			return static_cast<size_t>(image.width) * image.height * 4;
+		}
+	}
+
+	struct Measurement
+	{
+		double seconds = 0;
+		uint64_t cycles = 0;
+	};
+
+	template<typename Function>
+	Measurement measure(Function function)
+	{
+		auto start = std::chrono::steady_clock::now();
+		uint64_t startCycles = Cpu::readCycleCounter();
+		function();
+		uint64_t cycles = Cpu::readCycleCounter() - startCycles;
+		return { std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), cycles };
+	}
+
+	// runs all stages on every image once, times[image][stage]
+	std::vector<std::array<Measurement, stageCount>> runStages(const std::vector<CorpusImage>& corpus, StageData& data)
+	{
+		std::vector<std::array<Measurement, stageCount>> times(corpus.size());
+		for (size_t i = 0; i < corpus.size(); i++)
+		{
+			const CorpusImage& image = corpus[i];
+			times[i][ChunksStage] = measure([&]() { readChunks(image.file, data.zlibData); });
+			times[i][InflateStage] = measure([&]() { inflate(image, data); });
+			times[i][UnfilterStage] = measure([&]() { unfilter(image, data); });
+			times[i][ConvertStage] = measure([&]() { convert(image, data); });
+			times[i][DecodeStage] = measure([&]() { decode(image, data); });
+		}
+		return times;
+	}
+
+	// compares output of the stages with the decoder, which scatters
+	// pixels of interlaced images, so only non-interlaced ones can be
+	// compared. Returns number of mismatches
+	size_t verify(const std::vector<CorpusImage>& corpus, StageData& data)
+	{
+		size_t mismatches = 0;
+		for (const CorpusImage& image : corpus)
+		{
+			readChunks(image.file, data.zlibData);
+			inflate(image, data);
+			unfilter(image, data);
+			convert(image, data);
+			decode(image, data);
+			if (image.interlaceMethod == 0 && data.pixels != data.image)
+			{
+				std::cout << "mismatch: " << image.name << std::endl;
+				mismatches++;
+			}
+		}
+		return mismatches;
+	}
+
+	double median(std::vector<double> values)
+	{
+		std::sort(values.begin(), values.end());
+		size_t n = values.size();
+		return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+	}
+
+	// prints a statistics line per stage, totals over images of each repetition
+	void printStages(const std::vector<CorpusImage>& corpus,
+		const std::vector<std::vector<std::array<Measurement, stageCount>>>& reps)
+	{
+		std::cout << std::left << std::setw(14) << "stage" << std::right << std::setw(12) << "MB"
+			<< std::setw(11) << "min ms" << std::setw(11) << "median ms" << std::setw(11) << "max ms"
+			<< std::setw(9) << "stddev" << std::setw(10) << "MB/s" << std::setw(12) << "cycles/B" << "\n";
+		for (size_t stage = 0; stage < stageCount; stage++)
+		{
+			size_t bytes = 0;
+			for (const CorpusImage& image : corpus)
+				bytes += getStageBytes(image, static_cast<Stage>(stage));
+			std::vector<double> seconds;
+			std::vector<double> cycles;
+			for (const std::vector<std::array<Measurement, stageCount>>& times : reps)
+			{
+				Measurement total;
+				for (const std::array<Measurement, stageCount>& imageTimes : times)
+				{
+					total.seconds += imageTimes[stage].seconds;
+					total.cycles += imageTimes[stage].cycles;
+				}
+				seconds.push_back(total.seconds);
+				cycles.push_back(static_cast<double>(total.cycles));
+			}
+			double mean = 0;
+			for (double s : seconds)
+				mean += s / seconds.size();
+			double variance = 0;
+			for (double s : seconds)
+				variance += (s - mean) * (s - mean) / seconds.size();
+			double medianSeconds = median(seconds);
+
+			std::cout << std::left << std::setw(14) << stageNames[stage] << std::right << std::fixed
+				<< std::setprecision(2) << std::setw(12) << bytes / 1e6
+				<< std::setprecision(3) << std::setw(11) << *std::min_element(seconds.begin(), seconds.end()) * 1e3
+				<< std::setw(11) << medianSeconds * 1e3
+				<< std::setw(11) << *std::max_element(seconds.begin(), seconds.end()) * 1e3
+				<< std::setprecision(1) << std::setw(8) << std::sqrt(variance) / mean * 100 << "%"
+				<< std::setw(10) << bytes / medianSeconds / 1e6;
+			if (cycles[0] != 0)
+				std::cout << std::setprecision(2) << std::setw(12) << median(cycles) / bytes;
+			else
+				std::cout << std::setw(12) << "-";
+			std::cout << "\n";
+		}
+	}
+
+	// prints median throughput of each stage for groups of images
+	void printGroups(const std::vector<CorpusImage>& corpus,
+		const std::vector<std::vector<std::array<Measurement, stageCount>>>& reps)
+	{
+		using Filter = bool (*)(const CorpusImage&);
+		const std::array<std::pair<const char*, Filter>, 9> groups = { {
+			{ "stored", [](const CorpusImage& image) { return image.blocks == Blocks::Stored; } },
+			{ "static", [](const CorpusImage& image) { return image.blocks == Blocks::Static; } },
+			{ "dynamic", [](const CorpusImage& image) { return image.blocks == Blocks::Dynamic; } },
+			{ "photo", [](const CorpusImage& image) { return image.content == Content::Photo; } },
+			{ "flat", [](const CorpusImage& image) { return image.content == Content::Flat; } },
+			{ "interlaced", [](const CorpusImage& image) { return image.interlaceMethod != 0; } },
+			{ "not interlaced", [](const CorpusImage& image) { return image.interlaceMethod == 0; } },
+			{ "bit depth < 8", [](const CorpusImage& image) { return image.bitDepth < 8; } },
+			{ "bit depth 16", [](const CorpusImage& image) { return image.bitDepth == 16; } } } };
+
+		std::cout << std::left << std::setw(16) << "MB/s" << std::right;
+		for (const char* name : stageNames)
+			std::cout << std::setw(14) << name;
+		std::cout << "\n";
+		for (const auto& [groupName, inGroup] : groups)
+		{
+			std::cout << std::left << std::setw(16) << groupName << std::right << std::fixed << std::setprecision(1);
+			for (size_t stage = 0; stage < stageCount; stage++)
+			{
+				size_t bytes = 0;
+				for (const CorpusImage& image : corpus)
+				{
+					if (inGroup(image))
+						bytes += getStageBytes(image, static_cast<Stage>(stage));
+				}
+				std::vector<double> seconds;
+				for (const std::vector<std::array<Measurement, stageCount>>& times : reps)
+				{
+					double total = 0;
+					for (size_t i = 0; i < corpus.size(); i++)
+					{
+						if (inGroup(corpus[i]))
+							total += times[i][stage].seconds;
+					}
+					seconds.push_back(total);
+				}
+				std::cout << std::setw(14) << bytes / median(seconds) / 1e6;
+			}
+			std::cout << "\n";
+		}
+	}
+}
+
+int main(int argc, char** argv)
+{
+	uint32_t size = 256;
+	size_t reps = 5;
+	size_t warmup = 1;
+	uint64_t seed = 1;
+	std::string writeDir;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (i + 1 >= argc)
+		{
+			std::clog << "usage: png_bench [--size n] [--reps n] [--warmup n] [--seed n] [--write dir]" << std::endl;
+			return 1;
+		}
+		if (arg == "--size")
+			size = std::max(std::stoul(argv[++i]), 1ul);
+		else if (arg == "--reps")
+			reps = std::max(std::stoul(argv[++i]), 1ul);
+		else if (arg == "--warmup")
+			warmup = std::stoul(argv[++i]);
+		else if (arg == "--seed")
+			seed = std::stoull(argv[++i]);
+		else if (arg == "--write")
+			writeDir = argv[++i];
+		else
+		{
+			std::clog << "unknown option " << arg << std::endl;
+			return 1;
+		}
+	}
+
+	// the decoder logs every chunk, which is part of its cost but not
+	// worth printing
+	std::streambuf* logBuffer = std::clog.rdbuf(nullptr);
+	try
+	{
+		auto start = std::chrono::steady_clock::now();
+		std::vector<CorpusImage> corpus = generateCorpus(size, seed);
+		size_t fileBytes = 0;
+		for (const CorpusImage& image : corpus)
+			fileBytes += image.file.size();
+		std::cout << corpus.size() << " images of " << size << "x" << size * 3 / 4 + 5 << ", "
+			<< std::fixed << std::setprecision(2) << fileBytes / 1e6 << " MB, generated in "
+			<< std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s\n";
+
+		if (!writeDir.empty())
+		{
+			std::filesystem::create_directories(writeDir);
+			for (const CorpusImage& image : corpus)
+			{
+				std::ofstream out(std::filesystem::path(writeDir) / (image.name + ".png"), std::ios_base::binary);
+				out.write(reinterpret_cast<const char*>(image.file.data()), image.file.size());
+				if (!out)
+					throwPngError(PngErrorCode::Io, "cannot write corpus file");
+			}
+		}
+
+		StageData data;
+		size_t mismatches = verify(corpus, data);
+		for (size_t i = 0; i < warmup; i++)
+			runStages(corpus, data);
+		std::vector<std::vector<std::array<Measurement, stageCount>>> results;
+		for (size_t i = 0; i < reps; i++)
+			results.push_back(runStages(corpus, data));
+
+		std::cout << warmup << " warm-up and " << reps << " timed runs, cycles are time stamp counter ticks\n\n";
+		printStages(corpus, results);
+		std::cout << "\n";
+		printGroups(corpus, results);
+		std::cout << std::flush;
+		std::clog.rdbuf(logBuffer);
+		if (mismatches != 0)
+		{
+			std::clog << mismatches << " images decoded differently by the stages and the decoder" << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+	catch (const std::exception& e)
+	{
+		std::clog.rdbuf(logBuffer);
+		std::clog << e.what() << std::endl;
+		return 1;
+	}
+}
@@ -0,0 +1,76 @@
+#include "cpu.h"
+
+#if defined(PNG_X86) && defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(PNG_X86)
+#include <x86intrin.h>
+#endif
+
+namespace
+{
+	struct Features
+	{
+		bool ssse3 = false;
+		bool sse41 = false;
+		bool pclmul = false;
+		bool avx2 = false;
+	};
+
+	Features detect()
+	{
+		Features f;
+#if defined(PNG_X86) && defined(_MSC_VER)
+		int regs[4];
+		__cpuid(regs, 1);
+		f.ssse3 = (regs[2] >> 9) & 1;
+		f.sse41 = (regs[2] >> 19) & 1;
+		f.pclmul = (regs[2] >> 1) & 1;
+		// avx registers must also be enabled by the os
+		bool osAvx = ((regs[2] >> 27) & 1) && (_xgetbv(0) & 6) == 6;
+		__cpuidex(regs, 7, 0);
+		f.avx2 = osAvx && ((regs[1] >> 5) & 1);
+#elif defined(PNG_X86)
+		__builtin_cpu_init();
+		f.ssse3 = __builtin_cpu_supports("ssse3");
+		f.sse41 = __builtin_cpu_supports("sse4.1");
+		f.pclmul = __builtin_cpu_supports("pclmul");
+		f.avx2 = __builtin_cpu_supports("avx2");
+#endif
+		return f;
+	}
+
+	const Features& features()
+	{
+		static const Features f = detect();
+		return f;
+	}
+}
+
+bool Cpu::hasSsse3()
+{
+	return features().ssse3;
+}
+
+bool Cpu::hasSse41()
+{
+	return features().sse41;
+}
+
+bool Cpu::hasPclmul()
+{
+	return features().pclmul;
+}
+
+bool Cpu::hasAvx2()
+{
+	return features().avx2;
+}
+
+uint64_t Cpu::readCycleCounter()
+{
+#if defined(PNG_X86)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define PNG_X86 1
+#endif
+
+// SSE2 is always available on x86-64, so code using it needs no runtime check
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PNG_SSE2 1
+#endif
+
+// enables instruction set extensions for a single function, so that
+// the rest of the program doesn't require them
+#if defined(__GNUC__) || defined(__clang__)
+#define PNG_TARGET(features) __attribute__((target(features)))
+#else
+#define PNG_TARGET(features)
+#endif
+
+// runtime detection of instruction set extensions, always false on
+// platforms other than x86
+namespace Cpu
+{
+	bool hasSsse3();
+	bool hasSse41();
+	bool hasPclmul();
+	bool hasAvx2();
+	// time stamp counter, which ticks at a constant rate close to the
+	// nominal clock on current x86 cpus. Always 0 on other platforms
+	uint64_t readCycleCounter();
+}
@@ -0,0 +1,147 @@
+#include "crc.h"
+#include "cpu.h"
+
+#ifdef PNG_X86
+#include <immintrin.h>
+#endif
+
+namespace
+{
+	uint32_t loadU32(const uint8_t* buf)
+	{
+		return buf[0] | (buf[1] << 8) | (buf[2] << 16) | (static_cast<uint32_t>(buf[3]) << 24);
+	}
+
+	uint32_t updateSlice8(uint32_t crc, const uint8_t* buf, size_t len)
+	{
+		const Crc32::Tables& t = Crc32::tables;
+		while (len >= 8)
+		{
+			uint32_t lo = crc ^ loadU32(buf);
+			uint32_t hi = loadU32(buf + 4);
+			crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF]
+				^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24]
+				^ t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF]
+				^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+			buf += 8;
+			len -= 8;
+		}
+		while (len-- > 0)
+			crc = Crc32::update(crc, *(buf++));
+		return crc;
+	}
+
+#ifdef PNG_X86
+	// folds 64-byte blocks with carry-less multiplication and reduces the
+	// remainder with Barrett reduction, see Intel's "Fast CRC Computation
+	// for Generic Polynomials Using PCLMULQDQ Instruction".
+	// len must be at least 64 and a multiple of 16
+	PNG_TARGET("pclmul,sse4.1")
+	uint32_t updatePclmulBlocks(uint32_t crc, const uint8_t* buf, size_t len)
+	{
+		alignas(16) static constexpr uint64_t k1k2[2] = { 0x0154442bd4, 0x01c6e41596 };
+		alignas(16) static constexpr uint64_t k3k4[2] = { 0x01751997d0, 0x00ccaa009e };
+		alignas(16) static constexpr uint64_t k5k0[2] = { 0x0163cd6124, 0x0000000000 };
+		alignas(16) static constexpr uint64_t poly[2] = { 0x01db710641, 0x01f7011641 };
+
+		__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+		x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 0x00));
+		x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 0x10));
+		x3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 0x20));
+		x4 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 0x30));
+		x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+		x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(k1k2));
+		buf += 64;
+		len -= 64;
+
+		// fold by 4 parallel streams
+		while (len >= 64)
+		{
+			x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+			x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+			x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+			x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+			x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+			x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+			x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+			x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+			y5 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 0x00));
+			y6 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 0x10));
+			y7 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 0x20));
+			y8 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 0x30));
+			x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+			x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+			x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+			x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+			buf += 64;
+			len -= 64;
+		}
+
+		// fold the 4 streams into one
+		x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(k3k4));
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+		// remaining 16-byte blocks
+		while (len >= 16)
+		{
+			x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf));
+			x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+			x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+			x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+			buf += 16;
+			len -= 16;
+		}
+
+		// fold 128 bits to 64 bits
+		x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+		x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+		x1 = _mm_srli_si128(x1, 8);
+		x1 = _mm_xor_si128(x1, x2);
+		x0 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(k5k0));
+		x2 = _mm_srli_si128(x1, 4);
+		x1 = _mm_and_si128(x1, x3);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_xor_si128(x1, x2);
+
+		// Barrett reduction to 32 bits
+		x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(poly));
+		x2 = _mm_and_si128(x1, x3);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+		x2 = _mm_and_si128(x2, x3);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x1 = _mm_xor_si128(x1, x2);
+		return static_cast<uint32_t>(_mm_extract_epi32(x1, 1));
+	}
+
+	uint32_t updatePclmul(uint32_t crc, const uint8_t* buf, size_t len)
+	{
+		if (len >= 64)
+		{
+			size_t blocksLen = len & ~static_cast<size_t>(15);
+			crc = updatePclmulBlocks(crc, buf, blocksLen);
+			buf += blocksLen;
+			len -= blocksLen;
+		}
+		return updateSlice8(crc, buf, len);
+	}
+#endif
+}
+
+uint32_t Crc32::update(uint32_t crc, const uint8_t* buf, size_t len)
+{
+#ifdef PNG_X86
+	static const bool usePclmul = Cpu::hasPclmul() && Cpu::hasSse41();
+	if (usePclmul)
+		return updatePclmul(crc, buf, len);
+#endif
+	return updateSlice8(crc, buf, len);
+}
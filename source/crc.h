@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+
+// CRC-32 as used by PNG chunks. The running value is kept inverted:
+// start with 0xFFFFFFFF and invert the final value
+namespace Crc32
+{
+	using Tables = std::array<std::array<uint32_t, 256>, 8>;
+
+	// tables[0] is the classic byte-at-a-time table, tables[k][i] is the
+	// crc of byte i followed by k zero bytes, which allows to process
+	// 8 bytes per step
+	constexpr Tables computeTables()
+	{
+		Tables tables{};
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			uint32_t c = i;
+			for (uint32_t k = 0; k < 8; k++)
+			{
+				if (c & 1)
+					c = 0xEDB88320 ^ (c >> 1);
+				else
+					c = c >> 1;
+			}
+			tables[0][i] = c;
+		}
+		for (size_t k = 1; k < tables.size(); k++)
+		{
+			for (uint32_t i = 0; i < 256; i++)
+				tables[k][i] = (tables[k - 1][i] >> 8) ^ tables[0][tables[k - 1][i] & 0xFF];
+		}
+		return tables;
+	}
+
+	inline constexpr Tables tables = computeTables();
+
+	inline uint32_t update(uint32_t crc, uint8_t val)
+	{
+		return tables[0][(crc ^ val) & 0xFF] ^ (crc >> 8);
+	}
+
+	// picks carry-less multiplication when the cpu supports it,
+	// slice-by-8 otherwise
+	uint32_t update(uint32_t crc, const uint8_t* buf, size_t len);
+}
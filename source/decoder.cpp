@@ -0,0 +1,847 @@
+#include "decoder.h"
+#include "log.h"
+
+#include <iostream>
+#include <string>
+#include <array>
+#include <map>
+#include <algorithm>
+#include <cstring>
+#include <chrono>
+#include <type_traits>
+
+void readSignature(std::span<const uint8_t> in)
+{
+	static constexpr std::array<uint8_t, 8> signature = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	if (in.size() < signature.size() || !std::equal(signature.begin(), signature.end(), in.begin()))
+		throwPngError(PngErrorCode::Signature, "file signature is incorrect", 0);
+}
+
+void readChunkIHDR(PngChunkStream& in, uint32_t& width, uint32_t& height,
+	uint8_t& bitDepth, uint8_t& colourType, uint8_t& interlaceMethod)
+{
+	uint32_t length;
+	std::string type;
+	in.readChunkHeader(length, type);
+	if (length != 13 || type != "IHDR")
+		throwPngError(PngErrorCode::Header, "error reading IHDR");
+
+	width = in.readU32();
+	height = in.readU32();
+	if (width == 0 || height == 0)
+		throwPngError(PngErrorCode::Header, "zero image dimension");
+	PNG_LOG("Dimensions: " << height << " x " << width);
+
+	bitDepth = in.readU8();
+	colourType = in.readU8();
+	uint8_t compressionMethod = in.readU8();
+	uint8_t filterMethod = in.readU8();
+	interlaceMethod = in.readU8();
+
+	static constexpr std::array<uint8_t, 5> allowedColourTypes = { 0, 2, 3, 4, 6 };
+	if (std::find(allowedColourTypes.begin(), allowedColourTypes.end(), colourType)
+		== allowedColourTypes.end())
+		throwPngError(PngErrorCode::Header, "invalid colour type");
+	static const std::map<uint8_t, std::vector<uint8_t>> allowedBitDepths =
+	{
+		{0, std::vector<uint8_t>{1, 2, 4, 8, 16}},
+		{2, std::vector<uint8_t>{8, 16}},
+		{3, std::vector<uint8_t>{1, 2, 4, 8}},
+		{4, std::vector<uint8_t>{8, 16}},
+		{6, std::vector<uint8_t>{8, 16}}
+	};
+	if (std::find(allowedBitDepths.at(colourType).begin(), allowedBitDepths.at(colourType).end(), bitDepth)
+		== allowedBitDepths.at(colourType).end())
+		throwPngError(PngErrorCode::Header, "invalid bit depth");
+	if (compressionMethod != 0)
+		throwPngError(PngErrorCode::Header, "invalid compression method");
+	if (filterMethod != 0)
+		throwPngError(PngErrorCode::Header, "invalid filter method");
+	if (interlaceMethod > 1)
+		throwPngError(PngErrorCode::Header, "invalid interlace method");
+#ifdef PNG_LOGGING
+	static const std::map<uint8_t, std::string> colourTypesNames =
+		{ {0, "greyscale"}, {2, "truecolour"}, {3, "indexed-colour"},
+		{4, "greyscale with alpha"}, {6, "truecolour with alpha"} };
+	PNG_LOG("Colour type: " << colourTypesNames.at(colourType)
+		<< ", bit depth: " << static_cast<int>(bitDepth)
+		<< ", interlace used: " << (interlaceMethod ? "yes" : "no") << std::endl);
+#endif
+	in.finishCrcAndChunk();
+}
+
+PngHeader readPngHeader(std::span<const uint8_t> in)
+{
+	readSignature(in);
+	PngChunkStream chunkIn(in, 8);
+	PngHeader header;
+	readChunkIHDR(chunkIn, header.width, header.height, header.bitDepth, header.colourType,
+		header.interlaceMethod);
+	return header;
+}
+
+PngInfo probePng(std::span<const uint8_t> in, bool skipCrc)
+{
+	readSignature(in);
+	PngChunkStream chunkIn(in, 8);
+	PngInfo info;
+	PngHeader& header = info.header;
+	// signature, length and type of IHDR precede its data
+	info.chunks.push_back({ { 'I', 'H', 'D', 'R' }, 13, 16 });
+	readChunkIHDR(chunkIn, header.width, header.height, header.bitDepth, header.colourType,
+		header.interlaceMethod);
+
+	uint32_t length;
+	std::string type;
+	do
+	{
+		chunkIn.readChunkHeader(length, type);
+		ChunkInfo& chunk = info.chunks.emplace_back();
+		std::copy(type.begin(), type.end(), chunk.type.begin());
+		chunk.length = length;
+		chunk.offset = chunkIn.position();
+		if (skipCrc)
+			chunkIn.skipChunk();
+		else
+			chunkIn.finishCrcAndChunk();
+	} while (type != "IEND");
+	return info;
+}
+
+Result<PngInfo> tryProbePng(std::span<const uint8_t> in, bool skipCrc) noexcept
+{
+	return catchPngError([&]() { return probePng(in, skipCrc); });
+}
+
+void getScanlineLayout(uint32_t width, uint8_t bitDepth, uint8_t colourType,
+	uint32_t& byteLineLength, uint32_t& distBetweenCorrBytes)
+{
+	uint32_t samplesPerPixel;
+	if (colourType == 0 || colourType == 3) // greyscale or palette
+		samplesPerPixel = 1;
+	else if (colourType == 4) // greyscale with alpha
+		samplesPerPixel = 2;
+	else if (colourType == 2) // truecolour
+		samplesPerPixel = 3;
+	else // truecolour with alpha
+		samplesPerPixel = 4;
+	uint64_t bitsPerLine = static_cast<uint64_t>(width) * samplesPerPixel * bitDepth;
+	byteLineLength = static_cast<uint32_t>((bitsPerLine + 7) / 8);
+	distBetweenCorrBytes = 1;
+	if (bitDepth >= 8)
+		distBetweenCorrBytes = samplesPerPixel * bitDepth / 8;
+}
+
+// Adam7 passes: starting column and row, column and row increment, size
+// of block covered by a pixel in progressive preview
+struct Adam7Pass
+{
+	uint32_t xStart, yStart, xStep, yStep;
+	uint32_t blockWidth, blockHeight;
+};
+
+namespace
+{
+	// adds the time until it's destroyed to a field of stats, does nothing
+	// without stats
+	class StageTimer
+	{
+	public:
+		StageTimer(DecodeStats* pStats, double DecodeStats::* pSeconds) : stats(pStats), seconds(pSeconds)
+		{
+			if (stats)
+				start = std::chrono::steady_clock::now();
+		}
+		~StageTimer()
+		{
+			if (stats)
+				stats->*seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		}
+		StageTimer(const StageTimer&) = delete;
+		StageTimer& operator=(const StageTimer&) = delete;
+	private:
+		DecodeStats* stats;
+		double DecodeStats::* seconds;
+		std::chrono::steady_clock::time_point start;
+	};
+
+	// removes filter from a single scanline
+	void reconstructScanline(std::vector<uint8_t>::iterator& filteredData, const std::array<Filters::Kernel, 5>& kernels,
+		std::vector<uint8_t>& byteLine, const std::vector<uint8_t>& prevByteLine, DecodeStats* stats)
+	{
+		const uint8_t filterMethod = (*filteredData++);
+		if (filterMethod > 4)
+			throwPngError(PngErrorCode::Filter, "invalid filter method");
+
+		StageTimer timer(stats, &DecodeStats::unfilterSeconds);
+		if (stats)
+			stats->filterTypes[filterMethod]++;
+		kernels[filterMethod](&*filteredData, byteLine.data(), prevByteLine.data(), byteLine.size());
+		filteredData += byteLine.size();
+	}
+
+	// the same, but takes scanline from inflater as soon as it's inflated,
+	// so whole filtered image is never kept in memory
+	void reconstructScanline(Inflater& inflater, const std::array<Filters::Kernel, 5>& kernels,
+		std::vector<uint8_t>& byteLine, const std::vector<uint8_t>& prevByteLine, DecodeStats* stats)
+	{
+		uint8_t filterMethod;
+		{
+			StageTimer timer(stats, &DecodeStats::inflateSeconds);
+			inflater.read(&filterMethod, 1);
+			if (filterMethod > 4)
+				throwPngError(PngErrorCode::Filter, "invalid filter method");
+			inflater.read(byteLine.data(), byteLine.size());
+		}
+
+		StageTimer timer(stats, &DecodeStats::unfilterSeconds);
+		if (stats)
+			stats->filterTypes[filterMethod]++;
+		kernels[filterMethod](byteLine.data(), byteLine.data(), prevByteLine.data(), byteLine.size());
+	}
+
+	// lengths of the IDAT chunks starting with the one whose data begins at
+	// offset, for a file already checked by decoding it
+	std::vector<uint32_t> listIDATLengths(std::span<const uint8_t> in, size_t offset)
+	{
+		std::vector<uint32_t> lengths;
+		while (offset >= 8 && offset <= in.size() && std::memcmp(&in[offset - 4], "IDAT", 4) == 0)
+		{
+			const uint8_t* header = &in[offset - 8];
+			uint32_t length = static_cast<uint32_t>(header[0]) << 24 | header[1] << 16 | header[2] << 8 | header[3];
+			lengths.push_back(length);
+			// the crc and the header of the next chunk
+			offset += static_cast<size_t>(length) + 12;
+		}
+		return lengths;
+	}
+
+	uint16_t readU16(PngChunkStream& in)
+	{
+		uint16_t high = in.readU8();
+		return static_cast<uint16_t>((high << 8) | in.readU8());
+	}
+
+	// reads tRNS into info, ignoring it if it doesn't fit the colour type.
+	// The rest of the chunk is left for finishCrcAndChunk
+	void readTransparency(PngChunkStream& in, uint32_t length, uint8_t bitDepth, uint8_t colourType,
+		Pixels::ColourInfo& info)
+	{
+		if (colourType == 3)
+		{
+			info.paletteAlpha.resize(std::min<uint32_t>(length, 256));
+			for (uint8_t& alpha : info.paletteAlpha)
+				alpha = in.readU8();
+		}
+		else if ((colourType == 0 && length == 2) || (colourType == 2 && length == 6))
+		{
+			for (uint32_t i = 0; i < length / 2; i++)
+				info.colourKey[i] = readU16(in);
+			// samples of other bit depths never match
+			info.hasColourKey = bitDepth == 16 || std::all_of(info.colourKey.begin(), info.colourKey.begin() + length / 2,
+				[&](uint16_t sample) { return sample < (1u << bitDepth); });
+		}
+	}
+
+	// reads sBIT into info, ignoring it if it doesn't fit the colour type
+	// and the bit depth
+	void readSignificantBits(PngChunkStream& in, uint32_t length, uint8_t bitDepth, uint8_t colourType,
+		Pixels::ColourInfo& info)
+	{
+		static constexpr std::array<uint32_t, 7> lengths = { 1, 0, 3, 3, 2, 0, 4 };
+		if (length != lengths[colourType])
+			return;
+		std::array<uint8_t, 4> bits{};
+		for (uint32_t i = 0; i < length; i++)
+		{
+			bits[i] = in.readU8();
+			// palette entries have 8-bit samples
+			if (bits[i] == 0 || bits[i] > (colourType == 3 ? 8 : bitDepth))
+				return;
+		}
+		// grey goes to all colours, followed by its alpha
+		if (colourType == 0 || colourType == 4)
+			bits = { bits[0], bits[0], bits[0], bits[1] };
+		info.significantBits = bits;
+	}
+
+	constexpr std::array<Adam7Pass, 7> adam7Passes = { {
+		{ 0, 0, 8, 8, 8, 8 }, { 4, 0, 8, 8, 4, 8 }, { 0, 4, 4, 8, 4, 4 }, { 2, 0, 4, 4, 2, 4 },
+		{ 0, 2, 2, 4, 2, 2 }, { 1, 0, 2, 2, 1, 2 }, { 0, 1, 1, 2, 1, 1 } } };
+	// non-interlaced image as a single pass
+	constexpr Adam7Pass wholeImagePass = { 0, 0, 1, 1, 1, 1 };
+
+	// copies converted pixels of a pass scanline to their columns of the
+	// image rows starting at dest, filling blocks of blockHeight rows
+	template<size_t pixelSize>
+	void scatterPixels(const uint8_t* pixelLine, uint8_t* dest, size_t stride, uint32_t width,
+		uint32_t passWidth, const Adam7Pass& pass, uint32_t blockHeight, bool fillBlocks)
+	{
+		for (uint32_t j = 0; j < passWidth; j++)
+		{
+			uint32_t x = pass.xStart + j * pass.xStep;
+			uint32_t blockWidth = fillBlocks ? std::min(pass.blockWidth, width - x) : 1;
+			for (uint32_t by = 0; by < blockHeight; by++)
+			{
+				uint8_t* blockRow = dest + by * stride + static_cast<size_t>(x) * pixelSize;
+				for (uint32_t bx = 0; bx < blockWidth; bx++)
+					std::memcpy(blockRow + bx * pixelSize, pixelLine + j * pixelSize, pixelSize);
+			}
+		}
+	}
+
+	// number of Adam7 passes whose pixels together cover every scale-th
+	// pixel of every scale-th row
+	uint32_t getScaledPassCount(uint32_t scale)
+	{
+		switch (scale)
+		{
+		case 1:
+			return 7;
+		case 2:
+			return 5;
+		case 4:
+			return 3;
+		default:
+			return 1;
+		}
+	}
+
+	// the pass in coordinates of an image reduced scale times. Pixels of
+	// the first getScaledPassCount(scale) passes all fall on the reduced grid
+	Adam7Pass scalePass(const Adam7Pass& pass, uint32_t scale)
+	{
+		return { pass.xStart / scale, pass.yStart / scale, pass.xStep / scale, pass.yStep / scale,
+			std::max(pass.blockWidth / scale, 1u), std::max(pass.blockHeight / scale, 1u) };
+	}
+
+	// adds samples of a row of pixels to sums of the blocks of scale
+	// pixels they fall in, channels samples per pixel
+	template<typename Sample>
+	void addBlockSums(const uint8_t* row, uint32_t* sums, uint32_t width, size_t channels, uint32_t scale)
+	{
+		for (uint32_t x = 0; x < width; x++)
+		{
+			uint32_t* blockSums = sums + (x / scale) * channels;
+			for (size_t c = 0; c < channels; c++)
+			{
+				Sample sample;
+				std::memcpy(&sample, row + (x * channels + c) * sizeof(Sample), sizeof(Sample));
+				blockSums[c] += sample;
+			}
+		}
+	}
+
+	// writes averages of blocks spanning rows rows to dest and clears sums
+	template<typename Sample>
+	void writeBlockAverages(uint32_t* sums, uint8_t* dest, uint32_t width, size_t channels,
+		uint32_t scale, uint32_t rows)
+	{
+		uint32_t outWidth = (width + scale - 1) / scale;
+		for (uint32_t x = 0; x < outWidth; x++)
+		{
+			// the last block may be narrower
+			uint32_t count = std::min(scale, width - x * scale) * rows;
+			for (size_t c = 0; c < channels; c++)
+			{
+				uint32_t& sum = sums[x * channels + c];
+				Sample average = static_cast<Sample>((sum + count / 2) / count);
+				std::memcpy(dest + (x * channels + c) * sizeof(Sample), &average, sizeof(Sample));
+				sum = 0;
+			}
+		}
+	}
+
+	// computes size of inflated image data: scanlines with their filter type
+	// bytes, for interlaced images - of all non-empty passes
+	size_t getFilteredImageSize(uint32_t width, uint32_t height, uint8_t bitDepth,
+		uint8_t colourType, uint8_t interlaceMethod)
+	{
+		uint64_t size = 0;
+		uint32_t byteLineLength, distBetweenCorrBytes;
+		if (interlaceMethod == 0)
+		{
+			getScanlineLayout(width, bitDepth, colourType, byteLineLength, distBetweenCorrBytes);
+			size = static_cast<uint64_t>(height) * (byteLineLength + 1);
+		}
+		else
+		{
+			for (const Adam7Pass& pass : adam7Passes)
+			{
+				if (width <= pass.xStart || height <= pass.yStart)
+					continue;
+				uint32_t passWidth = (width - pass.xStart + pass.xStep - 1) / pass.xStep;
+				uint32_t passHeight = (height - pass.yStart + pass.yStep - 1) / pass.yStep;
+				getScanlineLayout(passWidth, bitDepth, colourType, byteLineLength, distBetweenCorrBytes);
+				size += static_cast<uint64_t>(passHeight) * (byteLineLength + 1);
+			}
+		}
+		if (size > SIZE_MAX)
+			throwPngError(PngErrorCode::Limit, "image too large");
+		return static_cast<size_t>(size);
+	}
+
+	// throws if the image exceeds limits or its output wouldn't fit in memory
+	void checkLimits(const DecodeLimits& limits, uint32_t width, uint32_t height, uint8_t bitDepth,
+		uint8_t colourType, uint8_t interlaceMethod, size_t pixelSize)
+	{
+		uint64_t pixels = static_cast<uint64_t>(width) * height;
+		if (pixels > limits.maxPixels)
+			throwPngError(PngErrorCode::Limit, "image has too many pixels");
+		if (pixels > SIZE_MAX / pixelSize)
+			throwPngError(PngErrorCode::Limit, "image too large");
+		if (getFilteredImageSize(width, height, bitDepth, colourType, interlaceMethod) > limits.maxInflatedBytes)
+			throwPngError(PngErrorCode::Limit, "too much image data to inflate");
+	}
+}
+
+// Adam7 pass images are stored with their own scanline layout, each pass
+// has filter reconstruction started anew. Pixels of a pass are scattered
+// into the final image, optionally filling the whole block a pixel stands
+// for until the following passes refine it
+template<typename FilteredData>
+void PngDecoder::removeFilterPass(FilteredData& filteredData, const std::array<Filters::Kernel, 5>& kernels,
+	Pixels::Converter convert, const Pixels::Tables& tables, const Output& output,
+	uint32_t width, uint32_t height, uint8_t bitDepth, uint8_t colourType, const Adam7Pass& pass,
+	bool fillBlocks, RowIndex* rowIndex)
+{
+	if (width <= pass.xStart || height <= pass.yStart)
+		return;
+	uint32_t passWidth = (width - pass.xStart + pass.xStep - 1) / pass.xStep;
+	uint32_t passHeight = (height - pass.yStart + pass.yStep - 1) / pass.yStep;
+	uint32_t byteLineLength, distBetweenCorrBytes;
+	getScanlineLayout(passWidth, bitDepth, colourType, byteLineLength, distBetweenCorrBytes);
+
+	byteLine1.assign(byteLineLength, 0);
+	byteLine2.assign(byteLineLength, 0);
+	size_t pixelSize = Pixels::getPixelSize(output.format);
+	if (pass.xStep != 1)
+		pixelLine.resize(passWidth * pixelSize);
+
+	for (uint32_t i = 0; i < passHeight; i++)
+	{
+		std::vector<uint8_t>& byteLine = (i % 2 == 0) ? byteLine1 : byteLine2;
+		const std::vector<uint8_t>& prevByteLine = (i % 2 == 0) ? byteLine2 : byteLine1;
+		if constexpr (std::is_same_v<FilteredData, Inflater>)
+		{
+			if (rowIndex && i % rowIndex->rowInterval == 0)
+				rowIndex->checkpoints.push_back({ i, filteredData.checkpoint(), prevByteLine });
+		}
+		reconstructScanline(filteredData, kernels, byteLine, prevByteLine, stats);
+
+		StageTimer timer(stats, &DecodeStats::convertSeconds);
+		uint32_t y = pass.yStart + i * pass.yStep;
+		uint8_t* dest = output.data + y * output.stride;
+		// passes covering whole rows have single-pixel blocks
+		if (pass.xStep == 1)
+		{
+			convert(byteLine.data(), dest, width, tables);
+			continue;
+		}
+		convert(byteLine.data(), pixelLine.data(), passWidth, tables);
+		uint32_t blockHeight = fillBlocks ? std::min(pass.blockHeight, height - y) : 1;
+		switch (pixelSize)
+		{
+		case 1:
+			scatterPixels<1>(pixelLine.data(), dest, output.stride, width, passWidth, pass, blockHeight, fillBlocks);
+			break;
+		case 3:
+			scatterPixels<3>(pixelLine.data(), dest, output.stride, width, passWidth, pass, blockHeight, fillBlocks);
+			break;
+		case 4:
+			scatterPixels<4>(pixelLine.data(), dest, output.stride, width, passWidth, pass, blockHeight, fillBlocks);
+			break;
+		default:
+			scatterPixels<8>(pixelLine.data(), dest, output.stride, width, passWidth, pass, blockHeight, fillBlocks);
+		}
+	}
+}
+
+// every scanline is reconstructed and converted at full width, then its
+// pixels are added to sums of blocks, which become an output row after
+// the last row of the blocks. Palette indices can't be averaged, they are
+// taken from the top left pixel of each block
+template<typename FilteredData>
+void PngDecoder::removeFilterScaled(FilteredData& filteredData, const std::array<Filters::Kernel, 5>& kernels,
+	Pixels::Converter convert, const Pixels::Tables& tables, const Output& output,
+	uint32_t width, uint32_t height, uint8_t bitDepth, uint8_t colourType)
+{
+	uint32_t byteLineLength, distBetweenCorrBytes;
+	getScanlineLayout(width, bitDepth, colourType, byteLineLength, distBetweenCorrBytes);
+	byteLine1.assign(byteLineLength, 0);
+	byteLine2.assign(byteLineLength, 0);
+	const uint32_t scale = output.scale;
+	const size_t pixelSize = Pixels::getPixelSize(output.format);
+	const size_t sampleSize = output.format == Pixels::Format::Rgba16 ? 2 : 1;
+	const size_t channels = pixelSize / sampleSize;
+	const uint32_t outWidth = (width + scale - 1) / scale;
+	pixelLine.resize(static_cast<size_t>(width) * pixelSize);
+	blockSums.assign(static_cast<size_t>(outWidth) * channels, 0);
+
+	for (uint32_t y = 0; y < height; y++)
+	{
+		std::vector<uint8_t>& byteLine = (y % 2 == 0) ? byteLine1 : byteLine2;
+		const std::vector<uint8_t>& prevByteLine = (y % 2 == 0) ? byteLine2 : byteLine1;
+		reconstructScanline(filteredData, kernels, byteLine, prevByteLine, stats);
+
+		StageTimer timer(stats, &DecodeStats::convertSeconds);
+		uint8_t* dest = output.data + (y / scale) * output.stride;
+		if (output.format == Pixels::Format::PaletteIndex)
+		{
+			if (y % scale != 0)
+				continue;
+			convert(byteLine.data(), pixelLine.data(), width, tables);
+			for (uint32_t x = 0; x < outWidth; x++)
+				dest[x] = pixelLine[x * scale];
+			continue;
+		}
+		convert(byteLine.data(), pixelLine.data(), width, tables);
+		if (sampleSize == 2)
+			addBlockSums<uint16_t>(pixelLine.data(), blockSums.data(), width, channels, scale);
+		else
+			addBlockSums<uint8_t>(pixelLine.data(), blockSums.data(), width, channels, scale);
+		if (y % scale != scale - 1 && y != height - 1)
+			continue;
+		if (sampleSize == 2)
+			writeBlockAverages<uint16_t>(blockSums.data(), dest, width, channels, scale, y % scale + 1);
+		else
+			writeBlockAverages<uint8_t>(blockSums.data(), dest, width, channels, scale, y % scale + 1);
+	}
+}
+
+// reconstructs scanlines taken from filteredData (inflated image data or
+// inflater itself) and converts them to pixels of output
+template<typename FilteredData>
+void PngDecoder::removeFilter(FilteredData& filteredData, const Pixels::Tables& tables, const Output& output,
+	uint32_t width, uint32_t height, uint8_t bitDepth, uint8_t colourType,
+	uint8_t interlaceMethod, const ProgressCallback& progress, RowIndex* rowIndex)
+{
+	uint32_t byteLineLength, distBetweenCorrBytes;
+	getScanlineLayout(width, bitDepth, colourType, byteLineLength, distBetweenCorrBytes);
+	const std::array<Filters::Kernel, 5>& kernels = Filters::getKernels(distBetweenCorrBytes);
+	Pixels::Converter convert = Pixels::getConverter(colourType, bitDepth, output.format, tables);
+	std::span<const uint8_t> image(output.data, output.size);
+
+	if (interlaceMethod == 0)
+	{
+		if (output.scale == 1)
+			removeFilterPass(filteredData, kernels, convert, tables, output,
+				width, height, bitDepth, colourType, wholeImagePass, false, rowIndex);
+		else
+			removeFilterScaled(filteredData, kernels, convert, tables, output,
+				width, height, bitDepth, colourType);
+		if (progress)
+			progress(image, static_cast<uint32_t>(adam7Passes.size() - 1));
+		return;
+	}
+
+	// a reduced image takes its pixels from the first passes only, with
+	// the same pass sizes in its own coordinates
+	const uint32_t scale = output.scale;
+	const uint32_t outWidth = (width + scale - 1) / scale;
+	const uint32_t outHeight = (height + scale - 1) / scale;
+	for (uint32_t i = 0; i < getScaledPassCount(scale); i++)
+	{
+		// without previews pixels of later passes are left unset until
+		// they are decoded
+		removeFilterPass(filteredData, kernels, convert, tables, output,
+			outWidth, outHeight, bitDepth, colourType, scalePass(adam7Passes[i], scale),
+			static_cast<bool>(progress), nullptr);
+		if (progress)
+			progress(image, i);
+	}
+}
+
+void PngDecoder::readChunksBeforeIDAT(PngChunkStream& chunkIn, uint8_t bitDepth, uint8_t colourType)
+{
+	static constexpr std::array<const char*, 3> usedAncillaryTypes = { "tRNS", "gAMA", "sBIT" };
+	colourInfo.palette.clear();
+	colourInfo.paletteAlpha.clear();
+	colourInfo.hasColourKey = false;
+	colourInfo.gamma = 0;
+	colourInfo.significantBits = {};
+	bool paletteFound = false;
+	uint32_t length;
+	std::string type;
+	while (true)
+	{
+		chunkIn.readNextChunkHeader(length, type, usedAncillaryTypes);
+		if (type == "IDAT")
+			break;
+		if (type == "IEND")
+			throwPngError(PngErrorCode::ChunkOrder, "image data not present");
+		else if (type == "PLTE")
+		{
+			if (paletteFound)
+				throwPngError(PngErrorCode::ChunkOrder, "two palettes encountered");
+			if (length % 3 != 0 || length > (3u << bitDepth))
+				throwPngError(PngErrorCode::Palette, "invalid palette size");
+			colourInfo.palette.resize(length);
+			chunkIn.read(colourInfo.palette.data(), length);
+			paletteFound = true;
+		}
+		else if (type == "tRNS")
+			readTransparency(chunkIn, length, bitDepth, colourType, colourInfo);
+		else if (type == "gAMA")
+		{
+			if (length == 4)
+				colourInfo.gamma = chunkIn.readU32();
+		}
+		else if (type == "sBIT")
+			readSignificantBits(chunkIn, length, bitDepth, colourType, colourInfo);
+		else
+			throwPngError(PngErrorCode::ChunkOrder, "unknown critical chunk");
+		chunkIn.finishCrcAndChunk();
+	}
+
+	if (colourType == 3 && colourInfo.palette.empty())
+		throwPngError(PngErrorCode::Palette, "no palette found");
+}
+
+void PngDecoder::decode(std::span<const uint8_t> in, std::vector<uint8_t>& image,
+	uint32_t& width, uint32_t& height, const DecodeOptions& options)
+{
+	decode(in, &image, {}, 0, width, height, options);
+}
+
+void PngDecoder::decode(std::span<const uint8_t> in, std::span<uint8_t> dest, size_t stride,
+	uint32_t& width, uint32_t& height, const DecodeOptions& options)
+{
+	decode(in, nullptr, dest, stride, width, height, options);
+}
+
+void PngDecoder::decode(std::span<const uint8_t> in, std::vector<uint8_t>* image,
+	std::span<uint8_t> dest, size_t stride, uint32_t& width, uint32_t& height, const DecodeOptions& options)
+{
+	stats = options.stats;
+	if (stats)
+		*stats = DecodeStats();
+	StageTimer totalTimer(stats, &DecodeStats::totalSeconds);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	readSignature(in);
+	PngChunkStream chunkIn(in, 8);
+	chunkIn.setLimits(options.limits.maxChunkCount, options.limits.maxAncillaryBytes);
+	try
+	{
+		uint8_t bitDepth;
+		uint8_t colourType;
+		uint8_t interlaceMethod;
+		readChunkIHDR(chunkIn, width, height, bitDepth, colourType, interlaceMethod);
+		checkLimits(options.limits, width, height, bitDepth, colourType, interlaceMethod,
+			Pixels::getPixelSize(options.format));
+
+		const uint32_t scale = options.scale;
+		if (scale != 1 && scale != 2 && scale != 4 && scale != 8)
+			throwPngError(PngErrorCode::InvalidArgument, "invalid scale");
+		if (scale != 1 && options.rowIndex)
+			throwPngError(PngErrorCode::InvalidArgument, "row index needs full scale");
+		const uint32_t outWidth = (width + scale - 1) / scale;
+		const uint32_t outHeight = (height + scale - 1) / scale;
+
+		size_t rowSize = outWidth * Pixels::getPixelSize(options.format);
+		if (image)
+		{
+			// every pixel gets overwritten, so contents of a reused buffer don't matter
+			image->resize(rowSize * outHeight);
+			dest = *image;
+			stride = rowSize;
+		}
+		if (stride < rowSize || dest.size() < rowSize || (dest.size() - rowSize) / stride < outHeight - 1)
+			throwPngError(PngErrorCode::InvalidArgument, "output buffer too small");
+		Output output = { dest.data(), stride, (outHeight - 1) * stride + rowSize, options.format, scale };
+
+		readChunksBeforeIDAT(chunkIn, bitDepth, colourType);
+		Pixels::buildTables(colourInfo, colourType, bitDepth, options.format, options.colour, pixelTables);
+		size_t idatOffset = chunkIn.position();
+		if (stats)
+			stats->headerSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		uint32_t length;
+		std::string type;
+		if (options.rowIndex)
+		{
+			if (interlaceMethod != 0)
+				throwPngError(PngErrorCode::InvalidArgument, "row index needs non-interlaced image");
+			if (options.rowIndex->rowInterval == 0)
+				throwPngError(PngErrorCode::InvalidArgument, "invalid row interval");
+			options.rowIndex->width = width;
+			options.rowIndex->height = height;
+			options.rowIndex->bitDepth = bitDepth;
+			options.rowIndex->colourType = colourType;
+			options.rowIndex->checkpoints.clear();
+		}
+		if (options.streaming || options.rowIndex || scale != 1)
+		{
+			Inflater inflater(chunkIn, !options.skipAdler32, &inflaterWorkspace);
+			if (stats)
+				inflater.collectStats(&stats->inflate);
+			removeFilter(inflater, pixelTables, output, width, height, bitDepth, colourType,
+				interlaceMethod, options.progress, options.rowIndex);
+			StageTimer timer(stats, &DecodeStats::inflateSeconds);
+			// later passes of a reduced interlaced image aren't needed
+			if (interlaceMethod == 0 || scale == 1)
+			{
+				inflater.finish();
+				chunkIn.finishCrcAndChunk();
+			}
+			else
+				chunkIn.finishIDATChunks();
+		}
+		else
+		{
+			size_t filteredImageSize = getFilteredImageSize(width, height, bitDepth, colourType, interlaceMethod);
+			{
+				StageTimer timer(stats, &DecodeStats::inflateSeconds);
+				if (options.threadPool)
+				{
+					if (stats)
+						stats->parallelInflate = true;
+					zlibData.clear();
+					chunkIn.readAllIDATData(zlibData);
+					filteredImageData = ParallelFlateDecode(zlibData, filteredImageSize,
+						*options.threadPool, !options.skipAdler32);
+				}
+				else
+				{
+					filteredImageData.resize(filteredImageSize);
+					Inflater inflater(chunkIn, !options.skipAdler32, &inflaterWorkspace);
+					if (stats)
+						inflater.collectStats(&stats->inflate);
+					inflater.readAll(filteredImageData.data(), filteredImageData.size());
+					inflater.finish();
+				}
+				chunkIn.finishCrcAndChunk();
+			}
+			std::vector<uint8_t>::iterator it = filteredImageData.begin();
+			removeFilter(it, pixelTables, output, width, height, bitDepth, colourType,
+				interlaceMethod, options.progress, nullptr);
+		}
+
+		chunkIn.readNextCriticalChunkHeader(length, type);
+		if (type != "IEND")
+			throwPngError(PngErrorCode::ChunkOrder, "end chunk not found");
+		chunkIn.finishCrcAndChunk();
+		if (stats)
+			stats->idatChunkLengths = listIDATLengths(in, idatOffset);
+		width = outWidth;
+		height = outHeight;
+
+		PNG_LOG("Image decoding finished successfully");
+	}
+	catch (PngError& e)
+	{
+		// errors found by the inflater and the filters get the position
+		// of the input reached so far
+		if (!e.hasOffset())
+			e.setOffset(chunkIn.position());
+		throw;
+	}
+}
+
+void PngDecoder::decodeRows(std::span<const uint8_t> in, const RowIndex& index,
+	uint32_t first, uint32_t count, std::vector<uint8_t>& rows)
+{
+	readSignature(in);
+	PngChunkStream chunkIn(in, 8);
+	try
+	{
+		uint32_t width, height;
+		uint8_t bitDepth;
+		uint8_t colourType;
+		uint8_t interlaceMethod;
+		readChunkIHDR(chunkIn, width, height, bitDepth, colourType, interlaceMethod);
+		if (width != index.width || height != index.height || bitDepth != index.bitDepth
+			|| colourType != index.colourType || interlaceMethod != 0)
+			throwPngError(PngErrorCode::InvalidArgument, "row index doesn't match image");
+		if (first > height || count > height - first)
+			throwPngError(PngErrorCode::InvalidArgument, "rows out of image");
+
+		readChunksBeforeIDAT(chunkIn, bitDepth, colourType);
+		// the checkpoint repositions the stream itself, it just can't be inside a chunk
+		chunkIn.finishCrcAndChunk();
+		Pixels::buildTables(colourInfo, colourType, bitDepth, Pixels::Format::Rgba8, {}, pixelTables);
+
+		uint32_t byteLineLength, distBetweenCorrBytes;
+		getScanlineLayout(width, bitDepth, colourType, byteLineLength, distBetweenCorrBytes);
+		const std::array<Filters::Kernel, 5>& kernels = Filters::getKernels(distBetweenCorrBytes);
+		Pixels::Converter convert = Pixels::getConverter(colourType, bitDepth, Pixels::Format::Rgba8, pixelTables);
+
+		rows.resize(static_cast<size_t>(count) * width * 4);
+		if (count == 0)
+			return;
+		const RowIndex::Checkpoint& checkpoint = index.findCheckpoint(first);
+		if (checkpoint.prevByteLine.size() != byteLineLength)
+			throwPngError(PngErrorCode::InvalidArgument, "row index doesn't match image");
+		Inflater inflater(chunkIn, checkpoint.inflater, &inflaterWorkspace);
+		byteLine1.assign(byteLineLength, 0);
+		byteLine2.assign(checkpoint.prevByteLine.begin(), checkpoint.prevByteLine.end());
+		for (uint32_t i = checkpoint.row; i < first + count; i++)
+		{
+			std::vector<uint8_t>& byteLine = ((i - checkpoint.row) % 2 == 0) ? byteLine1 : byteLine2;
+			const std::vector<uint8_t>& prevByteLine = ((i - checkpoint.row) % 2 == 0) ? byteLine2 : byteLine1;
+			reconstructScanline(inflater, kernels, byteLine, prevByteLine, nullptr);
+			if (i >= first)
+				convert(byteLine.data(), &rows[static_cast<size_t>(i - first) * width * 4], width, pixelTables);
+		}
+	}
+	catch (PngError& e)
+	{
+		// errors found by the inflater and the filters get the position
+		// of the input reached so far
+		if (!e.hasOffset())
+			e.setOffset(chunkIn.position());
+		throw;
+	}
+}
+
+Result<void> PngDecoder::tryDecode(std::span<const uint8_t> in, std::vector<uint8_t>& image,
+	uint32_t& width, uint32_t& height, const DecodeOptions& options) noexcept
+{
+	return catchPngError([&]() { decode(in, &image, {}, 0, width, height, options); });
+}
+
+Result<void> PngDecoder::tryDecode(std::span<const uint8_t> in, std::span<uint8_t> dest, size_t stride,
+	uint32_t& width, uint32_t& height, const DecodeOptions& options) noexcept
+{
+	return catchPngError([&]() { decode(in, nullptr, dest, stride, width, height, options); });
+}
+
+std::vector<uint8_t> decodePng(std::span<const uint8_t> in, uint32_t& width, uint32_t& height,
+	const DecodeOptions& options)
+{
+	PngDecoder decoder;
+	std::vector<uint8_t> res;
+	decoder.decode(in, res, width, height, options);
+	return res;
+}
+
+Result<std::vector<uint8_t>> tryDecodePng(std::span<const uint8_t> in, uint32_t& width, uint32_t& height,
+	const DecodeOptions& options) noexcept
+{
+	return catchPngError([&]() { return decodePng(in, width, height, options); });
+}
+
+std::vector<uint8_t> decodePng(std::istream& in, uint32_t& width, uint32_t& height,
+	const DecodeOptions& options)
+{
+	std::vector<uint8_t> buffer;
+	constexpr size_t blockSize = 1 << 20;
+	while (in)
+	{
+		size_t oldSize = buffer.size();
+		buffer.resize(oldSize + blockSize);
+		in.read(reinterpret_cast<char*>(buffer.data() + oldSize), blockSize);
+		buffer.resize(oldSize + in.gcount());
+	}
+	return decodePng(std::span<const uint8_t>(buffer), width, height, options);
+}
+
+std::vector<uint8_t> decodeRows(std::span<const uint8_t> in, const RowIndex& index,
+	uint32_t first, uint32_t count)
+{
+	PngDecoder decoder;
+	std::vector<uint8_t> res;
+	decoder.decodeRows(in, index, first, count, res);
+	return res;
+}
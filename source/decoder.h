@@ -0,0 +1,219 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <array>
+#include <span>
+#include <functional>
+#include <istream>
+
+#include "deflate.h"
+#include "error.h"
+#include "filters.h"
+#include "pixels.h"
+#include "rowindex.h"
+#include "stats.h"
+#include "threadpool.h"
+
+// checks file signature. If it's corrupted, throws PngError
+void readSignature(std::span<const uint8_t> in);
+
+// reads IHDR chunk. If it's not present, throws an error.
+// Checks if all fields have valid values
+void readChunkIHDR(PngChunkStream& in, uint32_t& width, uint32_t& height,
+	uint8_t& bitDepth, uint8_t& colourType, uint8_t& interlaceMethod);
+
+// computes length of scanline in bytes (without filter type byte) and
+// distance between current byte and corresponding byte in previous pixel
+// (1 if bitDepth is less than 8)
+void getScanlineLayout(uint32_t width, uint8_t bitDepth, uint8_t colourType,
+	uint32_t& byteLineLength, uint32_t& distBetweenCorrBytes);
+
+// fields of IHDR
+struct PngHeader
+{
+	uint32_t width;
+	uint32_t height;
+	uint8_t bitDepth;
+	uint8_t colourType;
+	uint8_t interlaceMethod;
+};
+
+// reads only the signature and IHDR, e.g. to size an output buffer
+PngHeader readPngHeader(std::span<const uint8_t> in);
+
+// entry of the chunk table of a png
+struct ChunkInfo
+{
+	std::array<char, 4> type;
+	uint32_t length;
+	// offset of chunk data from the start of the file
+	uint64_t offset;
+};
+
+struct PngInfo
+{
+	PngHeader header;
+	// all chunks from IHDR to IEND in file order
+	std::vector<ChunkInfo> chunks;
+};
+
+// reads IHDR and lists chunks, stepping over their data by length without
+// inflating anything. Unless skipCrc is set, crc of every chunk is checked,
+// which makes the cost grow with file size. IHDR's is checked either way
+PngInfo probePng(std::span<const uint8_t> in, bool skipCrc = false);
+// probePng returning errors instead of throwing them
+Result<PngInfo> tryProbePng(std::span<const uint8_t> in, bool skipCrc = false) noexcept;
+
+// scanline positions of an Adam7 pass
+struct Adam7Pass;
+
+// called with the image decoded so far after each Adam7 pass (0 to 6) is
+// finished, its rows are the output rows with the output stride;
+// non-interlaced images are reported once as finished pass 6
+using ProgressCallback = std::function<void(std::span<const uint8_t> image, uint32_t pass)>;
+
+// bounds on what a decode may allocate and read, checked before the
+// output and the image data buffer are allocated, so that a hostile file
+// costs bounded memory and time. Exceeding them throws PngErrorCode::Limit
+struct DecodeLimits
+{
+	// width * height from IHDR
+	uint64_t maxPixels = static_cast<uint64_t>(1) << 30;
+	// size of inflated image data, scanlines with their filter type bytes
+	uint64_t maxInflatedBytes = static_cast<uint64_t>(1) << 33;
+	// all chunks read, IHDR and IEND included
+	uint32_t maxChunkCount = 1 << 20;
+	// total data length of skipped ancillary chunks
+	uint64_t maxAncillaryBytes = static_cast<uint64_t>(1) << 28;
+};
+
+struct DecodeOptions
+{
+	// skips Adler-32 check of inflated data, for trusted inputs
+	bool skipAdler32 = false;
+	Pixels::Format format = Pixels::Format::Rgba8;
+	// removes filter from each scanline as soon as it's inflated instead
+	// of inflating the whole image first, needs memory only for a few
+	// scanlines besides the result
+	bool streaming = false;
+	// if set, interlaced images are reported after each pass with pixels
+	// of the following passes filled in from the nearest decoded ones
+	ProgressCallback progress;
+	// if set and not streaming, large images are inflated in parallel
+	// on threads of the pool
+	ThreadPool* threadPool = nullptr;
+	// if set, a checkpoint is added to it every rowIndex->rowInterval rows
+	// of a non-interlaced image, so that decodeRows can start from them.
+	// Implies streaming
+	RowIndex* rowIndex = nullptr;
+	// if set, it's overwritten with timings of decode stages and counts of
+	// the image data. Costs a few clock reads per scanline, nothing if unset
+	DecodeStats* stats = nullptr;
+	DecodeLimits limits;
+	// gamma correction and sBIT rescaling, off by default. tRNS is always
+	// applied to formats with alpha
+	Pixels::ColourOptions colour;
+	// 1, 2, 4 or 8. Decodes the image at 1/scale of its size, e.g. for
+	// thumbnails, and sets width and height to the reduced size. Pixels are
+	// averages of scale x scale blocks, except that interlaced images are
+	// decoded only up to the Adam7 pass giving this resolution, whose
+	// pixels are the top left ones of the blocks, and their Adler-32
+	// isn't checked. Implies streaming, can't be used with rowIndex
+	uint32_t scale = 1;
+};
+
+// decodes images keeping its buffers between them, so that once it has
+// decoded an image as large as the following ones, decoding them doesn't
+// allocate memory besides growing the output. Huffman tables of static
+// blocks are built once and shared by all decoders. A decoder may be
+// used by one thread at a time
+class PngDecoder
+{
+public:
+	// decodes png stored in memory, e.g. a memory-mapped file, into image
+	// as pixels of options.format, rows follow each other without gaps.
+	// Capacity of image is reused
+	void decode(std::span<const uint8_t> in, std::vector<uint8_t>& image,
+		uint32_t& width, uint32_t& height, const DecodeOptions& options = DecodeOptions());
+	// the same, but writes row y at dest + y * stride, e.g. into a mapped
+	// texture. Throws before decoding pixels if dest is too small for the
+	// image, readPngHeader gives its size beforehand
+	void decode(std::span<const uint8_t> in, std::span<uint8_t> dest, size_t stride,
+		uint32_t& width, uint32_t& height, const DecodeOptions& options = DecodeOptions());
+	// decodes count rows starting from first using checkpoints of index built
+	// for the same image, inflates only from the nearest checkpoint before first
+	void decodeRows(std::span<const uint8_t> in, const RowIndex& index,
+		uint32_t first, uint32_t count, std::vector<uint8_t>& rows);
+	// the same as decode, but returns errors instead of throwing them, e.g.
+	// for untrusted inputs that often fail. The decoder stays usable
+	Result<void> tryDecode(std::span<const uint8_t> in, std::vector<uint8_t>& image,
+		uint32_t& width, uint32_t& height, const DecodeOptions& options = DecodeOptions()) noexcept;
+	Result<void> tryDecode(std::span<const uint8_t> in, std::span<uint8_t> dest, size_t stride,
+		uint32_t& width, uint32_t& height, const DecodeOptions& options = DecodeOptions()) noexcept;
+private:
+	// rows of the image being decoded
+	struct Output
+	{
+		uint8_t* data;
+		size_t stride;
+		// from the start of the first row to the end of the last one
+		size_t size;
+		Pixels::Format format;
+		// each output pixel stands for scale x scale pixels of the image
+		uint32_t scale;
+	};
+
+	Inflater::Workspace inflaterWorkspace;
+	Pixels::ColourInfo colourInfo;
+	Pixels::Tables pixelTables;
+	// concatenated IDAT data for parallel inflating
+	std::vector<uint8_t> zlibData;
+	std::vector<uint8_t> filteredImageData;
+	// reconstructed byte lines
+	std::vector<uint8_t> byteLine1;
+	std::vector<uint8_t> byteLine2;
+	// pixels of an Adam7 pass scanline before they are scattered
+	std::vector<uint8_t> pixelLine;
+	// sums of samples of the blocks of the output row being reduced
+	std::vector<uint32_t> blockSums;
+	// DecodeOptions::stats of the current decode
+	DecodeStats* stats = nullptr;
+
+	// decodes into image resized to fit if it's set, into dest otherwise
+	void decode(std::span<const uint8_t> in, std::vector<uint8_t>* image, std::span<uint8_t> dest,
+		size_t stride, uint32_t& width, uint32_t& height, const DecodeOptions& options);
+	// reads chunks following IHDR up to the header of the first IDAT
+	// chunk, filling colourInfo from PLTE, tRNS, gAMA and sBIT
+	void readChunksBeforeIDAT(PngChunkStream& chunkIn, uint8_t bitDepth, uint8_t colourType);
+	template<typename FilteredData>
+	void removeFilterPass(FilteredData& filteredData, const std::array<Filters::Kernel, 5>& kernels,
+		Pixels::Converter convert, const Pixels::Tables& tables, const Output& output,
+		uint32_t width, uint32_t height, uint8_t bitDepth, uint8_t colourType, const Adam7Pass& pass,
+		bool fillBlocks, RowIndex* rowIndex);
+	// removeFilterPass for non-interlaced images decoded at a reduced scale
+	template<typename FilteredData>
+	void removeFilterScaled(FilteredData& filteredData, const std::array<Filters::Kernel, 5>& kernels,
+		Pixels::Converter convert, const Pixels::Tables& tables, const Output& output,
+		uint32_t width, uint32_t height, uint8_t bitDepth, uint8_t colourType);
+	template<typename FilteredData>
+	void removeFilter(FilteredData& filteredData, const Pixels::Tables& tables, const Output& output,
+		uint32_t width, uint32_t height, uint8_t bitDepth, uint8_t colourType,
+		uint8_t interlaceMethod, const ProgressCallback& progress, RowIndex* rowIndex);
+};
+
+// decodes png stored in memory with a decoder used only for this image
+std::vector<uint8_t> decodePng(std::span<const uint8_t> in, uint32_t& width, uint32_t& height,
+	const DecodeOptions& options = DecodeOptions());
+
+// decodePng returning errors instead of throwing them
+Result<std::vector<uint8_t>> tryDecodePng(std::span<const uint8_t> in, uint32_t& width, uint32_t& height,
+	const DecodeOptions& options = DecodeOptions()) noexcept;
+
+// reads the whole stream into a buffer and decodes it from there
+std::vector<uint8_t> decodePng(std::istream& in, uint32_t& width, uint32_t& height,
+	const DecodeOptions& options = DecodeOptions());
+
+// PngDecoder::decodeRows with a decoder used only for this call
+std::vector<uint8_t> decodeRows(std::span<const uint8_t> in, const RowIndex& index,
+	uint32_t first, uint32_t count);
@@ -0,0 +1,1155 @@
+#include "deflate.h"
+#include "adler32.h"
+
+#include <algorithm>
+#include <cstring>
+#include <bit>
+
+namespace Huffman
+{
+	void createTable(std::span<const size_t> codeLengths, Table& table)
+	{
+		if (codeLengths.size() > maxCodeCount)
+			throwPngError(PngErrorCode::Deflate, "too many codes");
+		std::array<uint16_t, maxCodeLength + 1> bl_count{};
+		for (size_t codeLength : codeLengths)
+		{
+			if (codeLength > maxCodeLength)
+				throwPngError(PngErrorCode::Deflate, "invalid code length");
+			bl_count[codeLength]++;
+		}
+		bl_count[0] = 0;
+
+		int32_t left = 1;
+		for (size_t bits = 1; bits <= maxCodeLength; bits++)
+		{
+			left = (left << 1) - bl_count[bits];
+			if (left < 0)
+				throwPngError(PngErrorCode::Deflate, "over-subscribed code lengths");
+		}
+
+		std::array<uint16_t, maxCodeLength + 1> next_code{};
+		uint16_t code = 0;
+		for (size_t bits = 1; bits <= maxCodeLength; bits++)
+		{
+			code = (code + bl_count[bits - 1]) << 1;
+			next_code[bits] = code;
+		}
+
+		// codes longer than primaryBits share primary entries by their first
+		// primaryBits bits, each such entry gets a sub-table wide enough
+		// for the longest of them
+		constexpr uint16_t primaryMask = (1 << primaryBits) - 1;
+		std::array<uint16_t, maxCodeCount> codes;
+		std::array<uint8_t, 1 << primaryBits> subTableBits{};
+		for (uint16_t n = 0; n < codeLengths.size(); n++)
+		{
+			size_t len = codeLengths[n];
+			if (len == 0)
+				continue;
+			codes[n] = Deflate::reverseBits(next_code[len]++, len);
+			if (len > primaryBits)
+			{
+				uint8_t& bits = subTableBits[codes[n] & primaryMask];
+				bits = std::max(bits, static_cast<uint8_t>(len - primaryBits));
+			}
+		}
+
+		table.entries.assign(1 << primaryBits, invalidFlag);
+		for (uint32_t i = 0; i < subTableBits.size(); i++)
+		{
+			if (subTableBits[i] == 0)
+				continue;
+			table.entries[i] = (static_cast<uint32_t>(table.entries.size()) << 16) | linkFlag | subTableBits[i];
+			table.entries.insert(table.entries.end(), 1 << subTableBits[i], invalidFlag);
+		}
+
+		for (uint16_t n = 0; n < codeLengths.size(); n++)
+		{
+			size_t len = codeLengths[n];
+			if (len == 0)
+				continue;
+			if (len <= primaryBits)
+			{
+				// every index whose lowest len bits match the code
+				for (uint32_t i = codes[n]; i < (1 << primaryBits); i += 1 << len)
+					table.entries[i] = (static_cast<uint32_t>(n) << 16) | len;
+			}
+			else
+			{
+				uint32_t link = table.entries[codes[n] & primaryMask];
+				uint32_t offset = link >> 16;
+				size_t subLen = len - primaryBits;
+				for (uint32_t i = codes[n] >> primaryBits; i < (1u << (link & 0xF)); i += 1 << subLen)
+					table.entries[offset + i] = (static_cast<uint32_t>(n) << 16) | subLen;
+			}
+		}
+	}
+
+	Table createStaticLiteralTable()
+	{
+		std::vector<size_t> codeLengths;
+		codeLengths.insert(codeLengths.end(), 144, 8); // 0-143
+		codeLengths.insert(codeLengths.end(), 112, 9); // 144-255
+		codeLengths.insert(codeLengths.end(), 24, 7); // 256-279
+		codeLengths.insert(codeLengths.end(), 8, 8); // 280-287
+		Table table;
+		createTable(codeLengths, table);
+		return table;
+	}
+
+	Table createStaticDistanceTable()
+	{
+		// distance codes 30 and 31 never occur, but take part in code construction
+		std::vector<size_t> codeLengths(32, 5);
+		Table table;
+		createTable(codeLengths, table);
+		return table;
+	}
+
+	uint16_t decode(DeflateBitStream& r, const Table& table)
+	{
+		uint32_t entry = table.entries[r.peek(primaryBits)];
+		if (entry & linkFlag)
+		{
+			r.consume(primaryBits);
+			entry = table.entries[(entry >> 16) + r.peek(entry & 0xF)];
+		}
+		if (entry & invalidFlag)
+			throwPngError(PngErrorCode::Deflate, "invalid huffman code");
+		r.consume(entry & 0xF);
+		return entry >> 16;
+	}
+}
+
+namespace
+{
+	int16_t decodeLength(DeflateBitStream& r, int16_t code)
+	{
+		if (code < 257 || code > 285)
+			throwPngError(PngErrorCode::Deflate, "invalid length code");
+		size_t i = code - 257;
+		return static_cast<int16_t>(Deflate::lengthBase[i] + r.read(Deflate::lengthExtraBits[i]));
+	}
+
+	int32_t decodeDistance(DeflateBitStream& r, int16_t code)
+	{
+		if (code < 0 || code > 29)
+			throwPngError(PngErrorCode::Deflate, "invalid distance code");
+		return Deflate::distanceBase[code] + r.read(Deflate::distanceExtraBits[code]);
+	}
+
+	void decodeCodeLength(DeflateBitStream& r, int16_t code, std::vector<size_t>& codeLengths)
+	{
+		if (code >= 0 && code <= 15)
+			codeLengths.push_back(code);
+		else if (code == 16)
+		{
+			if (codeLengths.empty())
+				throwPngError(PngErrorCode::Deflate, "no code length to repeat");
+			size_t repeat = 3 + r.read(2);
+			size_t copiedValue = codeLengths.back();
+			codeLengths.insert(codeLengths.end(), repeat, copiedValue);
+		}
+		else if (code == 17)
+		{
+			size_t repeat = 3 + r.read(3);
+			codeLengths.insert(codeLengths.end(), repeat, 0);
+		}
+		else
+		{
+			size_t repeat = 11 + r.read(7);
+			codeLengths.insert(codeLengths.end(), repeat, 0);
+		}
+	}
+
+	// checks compression method, window size and check bits of zlib header
+	void checkZlibHeader(uint8_t CMF, uint8_t FLG)
+	{
+		if ((CMF & 15) != 8 || (CMF >> 4) > 7 || (CMF * 256 + FLG) % 31 != 0)
+			throwPngError(PngErrorCode::Deflate, "invalid zlib header");
+		if (GET_BIT(FLG, 5) == 1)
+			throwPngError(PngErrorCode::Deflate, "zlib preset dictionary not supported");
+	}
+
+	// copies length bytes starting distance bytes back, the source may
+	// overlap the destination. Copies in wide unaligned chunks, so up to
+	// Inflater::copySlack bytes after the match get overwritten, unless
+	// outEnd is close enough to require a byte by byte copy
+	void copyMatch(uint8_t* out, size_t distance, size_t length, const uint8_t* outEnd)
+	{
+		const uint8_t* src = out - distance;
+		const uint8_t* end = out + length;
+		if (static_cast<size_t>(outEnd - end) < Inflater::copySlack)
+		{
+			while (out < end)
+				*(out++) = *(src++);
+			return;
+		}
+
+		if (distance >= 32)
+		{
+			do
+			{
+				std::memcpy(out, src, 32);
+				out += 32;
+				src += 32;
+			} while (out < end);
+		}
+		else if (distance >= 16)
+		{
+			do
+			{
+				std::memcpy(out, src, 16);
+				out += 16;
+				src += 16;
+			} while (out < end);
+		}
+		else if (distance >= 8)
+		{
+			do
+			{
+				std::memcpy(out, src, 8);
+				out += 8;
+				src += 8;
+			} while (out < end);
+		}
+		else if (distance == 1) // run of a single byte
+			std::memset(out, *src, length);
+		else
+		{
+			// broadcast the repeating pattern to 16 bytes and store it,
+			// advancing by the largest multiple of distance that fits
+			uint8_t pattern[16];
+			std::memcpy(pattern, src, distance);
+			for (size_t i = distance; i < 16; i++)
+				pattern[i] = pattern[i - distance];
+			size_t stride = 16 - 16 % distance;
+			do
+			{
+				std::memcpy(out, pattern, 16);
+				out += stride;
+			} while (out < end);
+		}
+	}
+
+	// entry of the tables for blocks with fixed codes
+	struct FixedEntry
+	{
+		enum Kind : uint8_t { Literal, EndOfBlock, LengthOrDistance, Invalid };
+
+		// literal byte or base of length or distance
+		uint16_t value;
+		uint8_t codeBits;
+		// number of extra bits following the code
+		uint8_t extraBits;
+		Kind kind;
+	};
+
+	// the literal/length table is indexed by the next 9 bits, which hold
+	// the longest fixed code, so there are no sub-tables. Length and
+	// distance entries also give base and extra bits, which saves the
+	// separate lookups of dynamic blocks
+	struct FixedTables
+	{
+		std::array<FixedEntry, 1 << 9> literals;
+		std::array<FixedEntry, 1 << 5> distances;
+	};
+
+	constexpr FixedTables createFixedTables()
+	{
+		FixedTables tables{};
+		for (uint16_t n = 0; n < 288; n++)
+		{
+			// canonical codes of the fixed code lengths
+			FixedEntry entry{};
+			uint16_t code;
+			if (n < 144)
+			{
+				entry.codeBits = 8;
+				code = 0x30 + n;
+			}
+			else if (n < 256)
+			{
+				entry.codeBits = 9;
+				code = 0x190 + (n - 144);
+			}
+			else if (n < 280)
+			{
+				entry.codeBits = 7;
+				code = n - 256;
+			}
+			else
+			{
+				entry.codeBits = 8;
+				code = 0xC0 + (n - 280);
+			}
+
+			if (n < 256)
+			{
+				entry.kind = FixedEntry::Literal;
+				entry.value = n;
+			}
+			else if (n == 256)
+				entry.kind = FixedEntry::EndOfBlock;
+			else if (n <= 285)
+			{
+				entry.kind = FixedEntry::LengthOrDistance;
+				entry.value = Deflate::lengthBase[n - 257];
+				entry.extraBits = Deflate::lengthExtraBits[n - 257];
+			}
+			else
+				entry.kind = FixedEntry::Invalid;
+			for (uint32_t i = Deflate::reverseBits(code, entry.codeBits); i < tables.literals.size(); i += 1 << entry.codeBits)
+				tables.literals[i] = entry;
+		}
+		for (uint16_t n = 0; n < tables.distances.size(); n++)
+		{
+			// distance codes 30 and 31 never occur
+			FixedEntry entry{};
+			entry.codeBits = 5;
+			entry.kind = FixedEntry::Invalid;
+			if (n < Deflate::distanceBase.size())
+			{
+				entry.kind = FixedEntry::LengthOrDistance;
+				entry.value = Deflate::distanceBase[n];
+				entry.extraBits = Deflate::distanceExtraBits[n];
+			}
+			tables.distances[Deflate::reverseBits(n, 5)] = entry;
+		}
+		return tables;
+	}
+
+	constexpr FixedTables fixedTables = createFixedTables();
+
+	// counts a match, codes are found from the base values of the fixed tables
+	void countFixedMatch(InflateStats& stats, uint16_t lengthBase, uint16_t distanceBase)
+	{
+		stats.matches++;
+		stats.lengthCodes[std::upper_bound(std::begin(Deflate::lengthBase), std::end(Deflate::lengthBase),
+			lengthBase) - std::begin(Deflate::lengthBase) - 1]++;
+		stats.distanceCodes[std::upper_bound(std::begin(Deflate::distanceBase), std::end(Deflate::distanceBase),
+			distanceBase) - std::begin(Deflate::distanceBase) - 1]++;
+	}
+
+	// inflates a block with fixed codes like Inflater::inflate, sets
+	// blockEnded if the end of block was reached
+	template<bool collectStats>
+	uint8_t* inflateStatic(DeflateBitStream& r, uint8_t* outStart, uint8_t* out, uint8_t* outLimit,
+		uint8_t* outEnd, bool& blockEnded, InflateStats* stats)
+	{
+		while (out < outLimit)
+		{
+			const FixedEntry& entry = fixedTables.literals[r.peek(9)];
+			if (entry.kind == FixedEntry::Literal)
+			{
+				r.consume(entry.codeBits);
+				*(out++) = static_cast<uint8_t>(entry.value);
+				if constexpr (collectStats)
+					stats->literals++;
+				continue;
+			}
+			if (entry.kind == FixedEntry::EndOfBlock)
+			{
+				r.consume(entry.codeBits);
+				blockEnded = true;
+				break;
+			}
+			if (entry.kind == FixedEntry::Invalid)
+				throwPngError(PngErrorCode::Deflate, "invalid length code");
+
+			// codes are followed by their extra bits, both are read at once
+			size_t length = entry.value + (r.read(entry.codeBits + entry.extraBits) >> entry.codeBits);
+			const FixedEntry& distanceEntry = fixedTables.distances[r.peek(5)];
+			if (distanceEntry.kind == FixedEntry::Invalid)
+				throwPngError(PngErrorCode::Deflate, "invalid distance code");
+			size_t distance = distanceEntry.value + (r.read(5 + distanceEntry.extraBits) >> 5);
+			if (distance > static_cast<size_t>(out - outStart))
+				throwPngError(PngErrorCode::Deflate, "distance too far back");
+			if (length > static_cast<size_t>(outEnd - out))
+				throwPngError(PngErrorCode::ImageDataSize, "too much image data");
+			if constexpr (collectStats)
+				countFixedMatch(*stats, entry.value, distanceEntry.value);
+
+			copyMatch(out, distance, length, outEnd);
+			out += length;
+		}
+		return out;
+	}
+
+	const Huffman::Table& getStaticLiteralTable()
+	{
+		static const Huffman::Table table = Huffman::createStaticLiteralTable();
+		return table;
+	}
+
+	const Huffman::Table& getStaticDistanceTable()
+	{
+		static const Huffman::Table table = Huffman::createStaticDistanceTable();
+		return table;
+	}
+
+	// reads code lengths of a dynamic block, literal and distance ones
+	// form a single sequence
+	// codeLengthTable is only scratch space
+	void readCodeLengths(DeflateBitStream& r, std::vector<size_t>& lengths, size_t& literalCount,
+		Huffman::Table& codeLengthTable)
+	{
+		size_t HLIT = 257 + r.read(5);
+		size_t HDIST = 1 + r.read(5);
+		size_t HCLEN = 4 + r.read(4);
+
+		std::array<size_t, 19> codeLengths{};
+		for (size_t i = 0; i < HCLEN; i++)
+		{
+			size_t codeLength = r.read(3);
+			codeLengths[Deflate::codeLengthOrder[i]] = codeLength;
+		}
+
+		Huffman::createTable(codeLengths, codeLengthTable);
+
+		// repeat codes may cross the boundary between literal and
+		// distance code lengths
+		lengths.clear();
+		while (lengths.size() < HLIT + HDIST)
+			decodeCodeLength(r, Huffman::decode(r, codeLengthTable), lengths);
+		if (lengths.size() != HLIT + HDIST)
+			throwPngError(PngErrorCode::Deflate, "code lengths exceed declared count");
+		literalCount = HLIT;
+	}
+
+	void createDynamicTables(std::span<const size_t> lengths, size_t literalCount,
+		Huffman::Table& literalTable, Huffman::Table& distanceTable)
+	{
+		Huffman::createTable(lengths.first(literalCount), literalTable);
+		Huffman::createTable(lengths.subspan(literalCount), distanceTable);
+	}
+
+	void readDynamicTables(DeflateBitStream& r, Huffman::Table& literalTable, Huffman::Table& distanceTable)
+	{
+		std::vector<size_t> lengths;
+		size_t literalCount;
+		Huffman::Table codeLengthTable;
+		readCodeLengths(r, lengths, literalCount, codeLengthTable);
+		createDynamicTables(lengths, literalCount, literalTable, distanceTable);
+	}
+}
+
+Inflater::Inflater(PngChunkStream& pIn, bool pVerifyAdler32, Workspace* pWorkspace)
+	: r(pIn), verifyAdler32(pVerifyAdler32)
+{
+	borrowWorkspace(pWorkspace);
+	readHeader();
+}
+
+Inflater::Inflater(std::span<const uint8_t> zlibData, bool pVerifyAdler32)
+	: r(zlibData), verifyAdler32(pVerifyAdler32)
+{
+	readHeader();
+}
+
+Inflater::Inflater(PngChunkStream& pIn, const Checkpoint& checkpoint, Workspace* pWorkspace)
+	: r(pIn, checkpoint.input), verifyAdler32(false)
+{
+	borrowWorkspace(pWorkspace);
+	if (checkpoint.block > static_cast<uint8_t>(Block::Static) || checkpoint.window.size() > windowAllocationSize
+		|| checkpoint.unreadSize > checkpoint.window.size())
+		throwPngError(PngErrorCode::InvalidArgument, "invalid checkpoint");
+	block = static_cast<Block>(checkpoint.block);
+	lastBlock = checkpoint.lastBlock;
+	streamEnded = checkpoint.streamEnded;
+	storedRemaining = checkpoint.storedRemaining;
+	if (block == Block::Huffman)
+	{
+		// literal code lengths followed by at least one distance code length
+		if (checkpoint.codeLengths.size() <= checkpoint.literalCodeCount)
+			throwPngError(PngErrorCode::InvalidArgument, "invalid checkpoint");
+		dynamicCodeLengths.assign(checkpoint.codeLengths.begin(), checkpoint.codeLengths.end());
+		literalCodeCount = checkpoint.literalCodeCount;
+		createDynamicTables(dynamicCodeLengths, literalCodeCount, dynamicLiteralTable, dynamicDistanceTable);
+		literalTable = &dynamicLiteralTable;
+		distanceTable = &dynamicDistanceTable;
+	}
+
+	window.resize(windowAllocationSize);
+	std::copy(checkpoint.window.begin(), checkpoint.window.end(), window.begin());
+	windowPos = checkpoint.window.size();
+	readPos = windowPos - checkpoint.unreadSize;
+}
+
+Inflater::~Inflater()
+{
+	if (workspace)
+		swapWorkspace();
+}
+
+void Inflater::borrowWorkspace(Workspace* pWorkspace)
+{
+	workspace = pWorkspace;
+	if (workspace)
+		swapWorkspace();
+}
+
+void Inflater::swapWorkspace()
+{
+	window.swap(workspace->window);
+	dynamicLiteralTable.entries.swap(workspace->literalTable.entries);
+	dynamicDistanceTable.entries.swap(workspace->distanceTable.entries);
+	codeLengthTable.entries.swap(workspace->codeLengthTable.entries);
+	dynamicCodeLengths.swap(workspace->codeLengths);
+}
+
+void Inflater::readHeader()
+{
+	//zlib
+	uint8_t CMF = r.read(8);
+	uint8_t FLG = r.read(8);
+	checkZlibHeader(CMF, FLG);
+}
+
+void Inflater::startBlock()
+{
+	lastBlock = r.read(1); //BFINAL
+	uint32_t BTYPE = r.read(2);
+	if (BTYPE == 0) // no compression
+	{
+		r.finishByte();
+		uint16_t LEN = r.read(16);
+		uint16_t NLEN = r.read(16);
+		if (LEN != static_cast<uint16_t>(~NLEN))
+			throwPngError(PngErrorCode::Deflate, "stored block length mismatch");
+		storedRemaining = LEN;
+		block = Block::Stored;
+		if (stats)
+		{
+			stats->storedBlocks++;
+			stats->storedBytes += LEN;
+		}
+	}
+	else if (BTYPE == 1) // static
+	{
+		block = Block::Static;
+		if (stats)
+			stats->staticBlocks++;
+	}
+	else if (BTYPE == 2) // dynamic
+	{
+		// code lengths are kept for checkpoints
+		readCodeLengths(r, dynamicCodeLengths, literalCodeCount, codeLengthTable);
+		createDynamicTables(dynamicCodeLengths, literalCodeCount, dynamicLiteralTable, dynamicDistanceTable);
+		literalTable = &dynamicLiteralTable;
+		distanceTable = &dynamicDistanceTable;
+		block = Block::Huffman;
+		if (stats)
+			stats->dynamicBlocks++;
+	}
+	else
+		throwPngError(PngErrorCode::Deflate, "invalid block type");
+}
+
+uint8_t* Inflater::inflate(uint8_t* outStart, uint8_t* out, uint8_t* outLimit, uint8_t* outEnd)
+{
+	if (stats)
+		return inflateBlocks<true>(outStart, out, outLimit, outEnd);
+	return inflateBlocks<false>(outStart, out, outLimit, outEnd);
+}
+
+template<bool collectStats>
+uint8_t* Inflater::inflateBlocks(uint8_t* outStart, uint8_t* out, uint8_t* outLimit, uint8_t* outEnd)
+{
+	while (out < outLimit)
+	{
+		if (block == Block::None)
+		{
+			if (lastBlock)
+			{
+				streamEnded = true;
+				break;
+			}
+			startBlock();
+		}
+		else if (block == Block::Stored)
+		{
+			size_t n = std::min<size_t>(storedRemaining, outEnd - out);
+			r.readBytes(out, static_cast<uint16_t>(n));
+			out += n;
+			storedRemaining -= static_cast<uint16_t>(n);
+			if (storedRemaining == 0)
+				block = Block::None;
+		}
+		else if (block == Block::Static)
+		{
+			bool blockEnded = false;
+			out = inflateStatic<collectStats>(r, outStart, out, outLimit, outEnd, blockEnded, stats);
+			if (blockEnded)
+				block = Block::None;
+		}
+		else // iteration over codes
+		{
+			uint16_t code = Huffman::decode(r, *literalTable);
+			if (code < 256) // literal byte
+			{
+				if (out == outEnd)
+					throwPngError(PngErrorCode::ImageDataSize, "too much image data");
+				*(out++) = static_cast<uint8_t>(code);
+				if constexpr (collectStats)
+					stats->literals++;
+			}
+			else if (code == 256) // end of block
+				block = Block::None;
+			else // length value
+			{
+				int16_t length = decodeLength(r, code);
+				uint16_t distanceCode = Huffman::decode(r, *distanceTable);
+				int32_t distance = decodeDistance(r, distanceCode);
+				if (distance > out - outStart)
+					throwPngError(PngErrorCode::Deflate, "distance too far back");
+				if (length > outEnd - out)
+					throwPngError(PngErrorCode::ImageDataSize, "too much image data");
+				if constexpr (collectStats)
+				{
+					stats->matches++;
+					stats->lengthCodes[code - 257]++;
+					stats->distanceCodes[distanceCode]++;
+				}
+
+				copyMatch(out, distance, length, outEnd);
+				out += length;
+			}
+		}
+	}
+	return out;
+}
+
+void Inflater::fillWindow()
+{
+	if (window.empty())
+		window.resize(windowAllocationSize);
+	if (windowPos >= windowBufferSize)
+	{
+		// keep only the data back-references may need
+		std::copy(window.begin() + windowPos - historySize, window.begin() + windowPos, window.begin());
+		windowPos = historySize;
+		readPos = std::min(readPos, windowPos);
+	}
+	uint8_t* start = window.data();
+	uint8_t* out = inflate(start, start + windowPos, start + windowBufferSize, start + window.size());
+	windowPos = out - start;
+}
+
+void Inflater::read(uint8_t* dest, size_t len)
+{
+	while (len > 0)
+	{
+		if (readPos == windowPos)
+		{
+			if (streamEnded)
+				throwPngError(PngErrorCode::ImageDataSize, "not enough image data");
+			fillWindow();
+			continue;
+		}
+		size_t n = std::min(len, windowPos - readPos);
+		std::copy(window.begin() + readPos, window.begin() + readPos + n, dest);
+		if (verifyAdler32)
+			adler = Adler32::update(adler, dest, n);
+		readPos += n;
+		dest += n;
+		len -= n;
+	}
+}
+
+void Inflater::readAll(uint8_t* dest, size_t size)
+{
+	uint8_t* out = inflate(dest, dest, dest + size, dest + size);
+	if (out != dest + size)
+		throwPngError(PngErrorCode::ImageDataSize, "not enough image data");
+	if (verifyAdler32)
+		adler = Adler32::update(adler, dest, size);
+}
+
+void Inflater::expectEnd()
+{
+	while (!streamEnded)
+	{
+		if (block == Block::None)
+		{
+			if (lastBlock)
+				streamEnded = true;
+			else
+				startBlock();
+		}
+		else if (block == Block::Stored)
+		{
+			if (storedRemaining != 0)
+				throwPngError(PngErrorCode::ImageDataSize, "too much image data");
+			block = Block::None;
+		}
+		else if (block == Block::Static)
+		{
+			const FixedEntry& entry = fixedTables.literals[r.peek(9)];
+			if (entry.kind != FixedEntry::EndOfBlock)
+				throwPngError(PngErrorCode::ImageDataSize, "too much image data");
+			r.consume(entry.codeBits);
+			block = Block::None;
+		}
+		else if (Huffman::decode(r, *literalTable) == 256)
+			block = Block::None;
+		else
+			throwPngError(PngErrorCode::ImageDataSize, "too much image data");
+	}
+}
+
+void Inflater::finish()
+{
+	if (readPos < windowPos)
+		throwPngError(PngErrorCode::ImageDataSize, "too much image data");
+	expectEnd();
+
+	// zlib ADLER-32
+	r.finishByte();
+	uint8_t temp[4];
+	r.readBytes(temp, 4);
+	if (verifyAdler32)
+	{
+		uint32_t expected = (temp[0] << 24) | (temp[1] << 16) | (temp[2] << 8) | temp[3];
+		if (adler != expected)
+			throwPngError(PngErrorCode::Adler32, "adler-32 mismatch");
+	}
+}
+
+void Inflater::collectStats(InflateStats* pStats)
+{
+	stats = pStats;
+}
+
+Inflater::Checkpoint Inflater::checkpoint() const
+{
+	Checkpoint res;
+	res.input = r.getState();
+	res.block = static_cast<uint8_t>(block);
+	res.lastBlock = lastBlock;
+	res.streamEnded = streamEnded;
+	res.storedRemaining = storedRemaining;
+	if (block == Block::Huffman && literalTable == &dynamicLiteralTable)
+	{
+		res.codeLengths.assign(dynamicCodeLengths.begin(), dynamicCodeLengths.end());
+		res.literalCodeCount = static_cast<uint16_t>(literalCodeCount);
+	}
+	// unread data and the history preceding the end of inflated data
+	size_t start = std::min(readPos, windowPos - std::min(windowPos, historySize));
+	res.window.assign(window.begin() + start, window.begin() + windowPos);
+	res.unreadSize = static_cast<uint32_t>(windowPos - readPos);
+	return res;
+}
+
+std::vector<uint8_t> FlateDecode(PngChunkStream& in, size_t expectedSize, bool verifyAdler32)
+{
+	Inflater inflater(in, verifyAdler32);
+	std::vector<uint8_t> res(expectedSize);
+	inflater.readAll(res.data(), res.size());
+	inflater.finish();
+	return res;
+}
+
+namespace
+{
+	// parts of compressed data smaller than this aren't worth inflating
+	// on their own thread
+	constexpr size_t minParallelPartSize = 1 << 20;
+
+	constexpr size_t historySize = Inflater::historySize;
+	constexpr size_t maxMatchLength = Inflater::maxMatchLength;
+	// values of inflated symbols starting from this one stand for bytes of
+	// the window preceding the part, which is unknown while it's inflated
+	constexpr uint16_t windowMarker = 256;
+
+	struct SpeculativePart
+	{
+		// deflate data is split at these bits, inflating starts at the
+		// first block header found after searchStart
+		size_t searchStart = 0;
+		size_t searchEnd = 0;
+
+		size_t startBit = 0;
+		// header of the block following inflated ones or end of the stream
+		size_t endBit = 0;
+		bool streamEnded = false;
+		bool failed = false;
+		// the unknown window as markers, followed by inflated symbols
+		std::vector<uint16_t> symbols;
+	};
+
+	// returns free code space left by given code lengths: 0 for a complete
+	// prefix code, negative if over-subscribed
+	int32_t codeSpaceLeft(const size_t* lengths, size_t count)
+	{
+		std::array<uint16_t, Huffman::maxCodeLength + 1> bl_count{};
+		for (size_t i = 0; i < count; i++)
+			bl_count[lengths[i]]++;
+		int32_t left = 1;
+		for (size_t bits = 1; bits <= Huffman::maxCodeLength; bits++)
+		{
+			left = (left << 1) - bl_count[bits];
+			if (left < 0)
+				return left;
+		}
+		return left;
+	}
+
+	// the same restrictions zlib puts on codes: complete, except for
+	// a single code of length 1 or, for distances, no codes at all
+	bool isUsableCode(const size_t* lengths, size_t count, bool emptyAllowed)
+	{
+		int32_t left = codeSpaceLeft(lengths, count);
+		if (left == 0)
+			return true;
+		size_t used = count - std::count(lengths, lengths + count, 0);
+		if (used == 0)
+			return emptyAllowed;
+		return used == 1 && left == (1 << (Huffman::maxCodeLength - 1));
+	}
+
+	// checks whether a plausible dynamic block header starts at given bit,
+	// most random positions fail after a few reads
+	bool isDynamicBlockHeader(std::span<const uint8_t> in, size_t bit)
+	{
+		DeflateBitStream r(in, bit);
+		if ((r.read(3) >> 1) != 2)
+			return false;
+		size_t HLIT = 257 + r.read(5);
+		size_t HDIST = 1 + r.read(5);
+		size_t HCLEN = 4 + r.read(4);
+		if (HLIT > 286 || HDIST > 30)
+			return false;
+
+		std::array<size_t, 19> codeLengths{};
+		for (size_t i = 0; i < HCLEN; i++)
+			codeLengths[Deflate::codeLengthOrder[i]] = r.read(3);
+		if (codeSpaceLeft(codeLengths.data(), codeLengths.size()) != 0)
+			return false;
+		Huffman::Table codeLengthTable;
+		Huffman::createTable(codeLengths, codeLengthTable);
+
+		std::vector<size_t> lengths;
+		while (lengths.size() < HLIT + HDIST)
+		{
+			uint16_t code = Huffman::decode(r, codeLengthTable);
+			if (code == 16 && lengths.empty())
+				return false;
+			decodeCodeLength(r, code, lengths);
+		}
+		if (lengths.size() != HLIT + HDIST || lengths[256] == 0)
+			return false;
+		return isUsableCode(lengths.data(), HLIT, false)
+			&& isUsableCode(lengths.data() + HLIT, HDIST, true);
+	}
+
+	// returns 64 bits starting at given bit, the first one in bit 0
+	uint64_t loadBits(const uint8_t* data, size_t bit)
+	{
+		uint64_t lo = 0;
+		uint64_t hi = 0;
+		if constexpr (std::endian::native == std::endian::little)
+		{
+			std::memcpy(&lo, data + bit / 8, 8);
+			std::memcpy(&hi, data + bit / 8 + 8, 8);
+		}
+		else
+		{
+			for (size_t i = 0; i < 8; i++)
+			{
+				lo |= static_cast<uint64_t>(data[bit / 8 + i]) << (i * 8);
+				hi |= static_cast<uint64_t>(data[bit / 8 + 8 + i]) << (i * 8);
+			}
+		}
+		size_t shift = bit % 8;
+		return shift == 0 ? lo : (lo >> shift) | (hi << (64 - shift));
+	}
+
+	// finds the first bit of [from, to) where a dynamic block header seems
+	// to start, false positives are possible
+	bool findDynamicBlock(std::span<const uint8_t> in, size_t from, size_t to, size_t& found)
+	{
+		// share of code space taken by a code of given length, out of 128
+		constexpr uint32_t codeSpace[8] = { 0, 64, 32, 16, 8, 4, 2, 1 };
+		// loadBits reads 16 bytes at most 8 bytes back from its bit
+		if (in.size() < 24)
+			return false;
+		to = std::min(to, (in.size() - 24) * 8);
+		for (size_t bit = from; bit < to; bit++)
+		{
+			// block type, counts of codes and completeness of the code
+			// length code are checked first without DeflateBitStream
+			uint64_t header = loadBits(in.data(), bit);
+			if (((header >> 1) & 3) != 2 || ((header >> 3) & 31) > 29 || ((header >> 8) & 31) > 29)
+				continue;
+			size_t HCLEN = 4 + ((header >> 13) & 15);
+			uint64_t lengthBits = loadBits(in.data(), bit + 17);
+			uint32_t usedSpace = 0;
+			for (size_t i = 0; i < HCLEN; i++)
+				usedSpace += codeSpace[(lengthBits >> (i * 3)) & 7];
+			if (usedSpace != 128)
+				continue;
+			try
+			{
+				if (isDynamicBlockHeader(in, bit))
+				{
+					found = bit;
+					return true;
+				}
+			}
+			catch (const PngError&)
+			{
+				// ran out of data
+				return false;
+			}
+		}
+		return false;
+	}
+
+	// inflates blocks starting at part.startBit until a dynamic block
+	// header at or after stopBit or the end of the stream. Back-references
+	// beyond the start produce window markers
+	void inflatePart(std::span<const uint8_t> in, SpeculativePart& part, size_t stopBit, size_t maxSize)
+	{
+		DeflateBitStream r(in, part.startBit);
+		Huffman::Table dynamicLiteralTable;
+		Huffman::Table dynamicDistanceTable;
+
+		std::vector<uint16_t>& symbols = part.symbols;
+		symbols.resize(historySize + 4 * minParallelPartSize);
+		for (size_t i = 0; i < historySize; i++)
+			symbols[i] = windowMarker + static_cast<uint16_t>(i);
+		size_t pos = historySize;
+		// makes room for len more symbols, output longer than maxSize
+		// is caught when growing and at the end
+		auto reserve = [&](size_t len)
+		{
+			if (symbols.size() - pos < len)
+			{
+				if (pos - historySize > maxSize)
+					throwPngError(PngErrorCode::ImageDataSize, "too much image data");
+				symbols.resize(std::max(symbols.size() * 2, pos + len));
+			}
+		};
+
+		while (true)
+		{
+			size_t blockStart = r.bitPosition();
+			if (blockStart >= stopBit && (r.peek(3) >> 1) == 2)
+			{
+				part.endBit = blockStart;
+				break;
+			}
+			bool lastBlock = r.read(1); //BFINAL
+			uint32_t BTYPE = r.read(2);
+			if (BTYPE == 0) // no compression
+			{
+				r.finishByte();
+				uint16_t LEN = r.read(16);
+				uint16_t NLEN = r.read(16);
+				if (LEN != static_cast<uint16_t>(~NLEN))
+					throwPngError(PngErrorCode::Deflate, "stored block length mismatch");
+				// copied straight from the input, reading continues after it
+				size_t dataStart = r.bitPosition() / 8;
+				if (in.size() - dataStart < LEN)
+					throwPngError(PngErrorCode::UnexpectedEnd, "unexpected end of image data");
+				reserve(LEN);
+				std::copy(in.begin() + dataStart, in.begin() + dataStart + LEN, symbols.begin() + pos);
+				pos += LEN;
+				r = DeflateBitStream(in, (dataStart + LEN) * 8);
+			}
+			else if (BTYPE == 1 || BTYPE == 2)
+			{
+				const Huffman::Table* literalTable = &getStaticLiteralTable();
+				const Huffman::Table* distanceTable = &getStaticDistanceTable();
+				if (BTYPE == 2)
+				{
+					readDynamicTables(r, dynamicLiteralTable, dynamicDistanceTable);
+					literalTable = &dynamicLiteralTable;
+					distanceTable = &dynamicDistanceTable;
+				}
+				while (true)
+				{
+					reserve(maxMatchLength);
+					uint16_t code = Huffman::decode(r, *literalTable);
+					if (code < 256) // literal byte
+						symbols[pos++] = code;
+					else if (code == 256) // end of block
+						break;
+					else // length value
+					{
+						int16_t length = decodeLength(r, code);
+						int32_t distance = decodeDistance(r, Huffman::decode(r, *distanceTable));
+						if (static_cast<size_t>(distance) > pos)
+							throwPngError(PngErrorCode::Deflate, "distance too far back");
+						uint16_t* out = symbols.data() + pos;
+						const uint16_t* src = out - distance;
+						if (distance >= length)
+							std::memcpy(out, src, length * sizeof(uint16_t));
+						else
+						{
+							for (int16_t i = 0; i < length; i++)
+								out[i] = src[i];
+						}
+						pos += length;
+					}
+				}
+			}
+			else
+				throwPngError(PngErrorCode::Deflate, "invalid block type");
+
+			if (lastBlock)
+			{
+				part.endBit = r.bitPosition();
+				part.streamEnded = true;
+				break;
+			}
+		}
+		if (pos - historySize > maxSize)
+			throwPngError(PngErrorCode::ImageDataSize, "too much image data");
+		symbols.resize(pos);
+	}
+
+	// replaces window markers with bytes of window, whose last windowSize
+	// bytes are known, and stores the result. Throws for markers referring
+	// to the rest
+	void resolveSymbols(const uint16_t* symbols, size_t count, const std::vector<uint8_t>& window,
+		size_t windowSize, uint8_t* dest)
+	{
+		const uint16_t firstKnownMarker = static_cast<uint16_t>(windowMarker + historySize - windowSize);
+		for (size_t i = 0; i < count; i++)
+		{
+			uint16_t symbol = symbols[i];
+			if (symbol < windowMarker)
+				dest[i] = static_cast<uint8_t>(symbol);
+			else if (symbol >= firstKnownMarker)
+				dest[i] = window[symbol - windowMarker];
+			else
+				throwPngError(PngErrorCode::Deflate, "distance too far back");
+		}
+	}
+}
+
+std::vector<uint8_t> ParallelFlateDecode(std::span<const uint8_t> zlibData, size_t expectedSize,
+	ThreadPool& pool, bool verifyAdler32)
+{
+	size_t partCount = std::min(pool.size(), zlibData.size() / minParallelPartSize);
+	if (partCount <= 1)
+	{
+		Inflater inflater(zlibData, verifyAdler32);
+		std::vector<uint8_t> res(expectedSize);
+		inflater.readAll(res.data(), res.size());
+		inflater.finish();
+		return res;
+	}
+
+	checkZlibHeader(zlibData[0], zlibData[1]);
+	std::span<const uint8_t> in = zlibData.subspan(2);
+
+	std::vector<SpeculativePart> parts(partCount);
+	std::vector<uint8_t> res(expectedSize);
+	// known bytes preceding each part
+	std::vector<std::vector<uint8_t>> windows(partCount, std::vector<uint8_t>(historySize));
+	std::vector<std::future<void>> inflated(partCount);
+	std::vector<std::future<void>> resolved;
+	// tasks refer to the vectors above and must finish before they are gone,
+	// also when joining parts throws
+	struct Waiter
+	{
+		std::vector<std::future<void>>& inflated;
+		std::vector<std::future<void>>& resolved;
+		~Waiter()
+		{
+			for (std::future<void>& f : inflated)
+			{
+				if (f.valid())
+					f.wait();
+			}
+			for (std::future<void>& f : resolved)
+			{
+				if (f.valid())
+					f.wait();
+			}
+		}
+	} waiter{ inflated, resolved };
+
+	size_t partSize = in.size() / partCount;
+	for (size_t i = 0; i < partCount; i++)
+	{
+		SpeculativePart& part = parts[i];
+		part.searchStart = i * partSize * 8;
+		part.searchEnd = (i + 1 == partCount) ? SIZE_MAX : (i + 1) * partSize * 8;
+		inflated[i] = pool.submit([&part, in, expectedSize]()
+		{
+			try
+			{
+				if (part.searchStart != 0 && !findDynamicBlock(in, part.searchStart, part.searchEnd, part.startBit))
+					part.failed = true;
+				else
+					inflatePart(in, part, part.searchEnd, expectedSize);
+			}
+			catch (const PngError&)
+			{
+				part.failed = true;
+			}
+		});
+	}
+
+	// parts are joined in order: each must start where the previous one
+	// ended, then the end of its output becomes the known window for the next
+	size_t resSize = 0;
+	size_t nextBit = 0;
+	bool streamEnded = false;
+	for (size_t i = 0; i < partCount && !streamEnded; i++)
+	{
+		SpeculativePart& part = parts[i];
+		inflated[i].wait();
+		if (part.failed || part.startBit != nextBit)
+		{
+			// inflating from the right place with markers for the window
+			// still works and throws on actual errors
+			part.startBit = nextBit;
+			part.streamEnded = false;
+			inflatePart(in, part, part.searchEnd, expectedSize);
+		}
+
+		size_t windowSize = std::min(resSize, historySize);
+		size_t count = part.symbols.size() - historySize;
+		if (count > expectedSize - resSize)
+			throwPngError(PngErrorCode::ImageDataSize, "too much image data");
+		if (i + 1 < partCount)
+		{
+			// bytes before the start of the stream stay unset, resolving
+			// fails for markers referring to them
+			const uint16_t* tail = part.symbols.data() + part.symbols.size() - historySize;
+			for (size_t j = 0; j < historySize; j++)
+				windows[i + 1][j] = (tail[j] < windowMarker) ? static_cast<uint8_t>(tail[j]) : windows[i][tail[j] - windowMarker];
+		}
+		resolved.push_back(pool.submit([&part, &window = windows[i], windowSize, count, dest = res.data() + resSize]()
+		{
+			resolveSymbols(part.symbols.data() + historySize, count, window, windowSize, dest);
+			std::vector<uint16_t>().swap(part.symbols);
+		}));
+		resSize += count;
+		nextBit = part.endBit;
+		streamEnded = part.streamEnded;
+	}
+	for (std::future<void>& f : resolved)
+		f.get();
+	if (!streamEnded || resSize != expectedSize)
+		throwPngError(PngErrorCode::ImageDataSize, "not enough image data");
+
+	// zlib ADLER-32
+	size_t trailerPos = (nextBit + 7) / 8;
+	if (in.size() < trailerPos + 4)
+		throwPngError(PngErrorCode::UnexpectedEnd, "unexpected end of image data");
+	if (verifyAdler32)
+	{
+		const uint8_t* temp = in.data() + trailerPos;
+		uint32_t expected = (temp[0] << 24) | (temp[1] << 16) | (temp[2] << 8) | temp[3];
+		if (Adler32::update(1, res.data(), res.size()) != expected)
+			throwPngError(PngErrorCode::Adler32, "adler-32 mismatch");
+	}
+	return res;
+}
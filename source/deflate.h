@@ -2,291 +2,221 @@
 
 #include <cstdint>
 #include <vector>
-#include <istream>
+#include <array>
+#include <span>
 
 #include "streams.h"
+#include "threadpool.h"
 
-namespace Huffman
+// parts of the deflate format shared by the inflater and the deflater
+namespace Deflate
 {
-	struct Node
-	{
-		Node* leftChild = nullptr;
-		Node* rightChild = nullptr;
-		int16_t value = -1;
-
-		Node() {};
-		Node(int16_t v) : value(v) {};
-		~Node()
-		{
-			if (leftChild != nullptr)
-				delete leftChild;
-			if (rightChild != nullptr)
-				delete rightChild;
-		}
-	};
-
-	void addNode(Node* root, int16_t path, size_t codeLength, int16_t value)
-	{
-		Node* current = root;
-		for (int i = codeLength - 1; i >= 0; i--)
-		{
-			int16_t direction = (path >> i) & 1;
-			if (direction == 0) // 0 - left
-			{
-				if (current->leftChild == nullptr)
-					current->leftChild = new Node();
-				current = current->leftChild;
-			}
-			else // 1 - right
-			{
-				if (current->rightChild == nullptr)
-					current->rightChild = new Node();
-				current = current->rightChild;
-			}
-		}
-		current->value = value;
-	}
-
-	Node* createTree(const std::vector<size_t>& codeLengths)
+	// base values and numbers of extra bits of length codes 257-285 and
+	// distance codes 0-29
+	constexpr std::array<uint16_t, 29> lengthBase = {
+		3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+		35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+	constexpr std::array<uint8_t, 29> lengthExtraBits = {
+		0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+		3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+	constexpr std::array<uint16_t, 30> distanceBase = {
+		1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+		257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+	constexpr std::array<uint8_t, 30> distanceExtraBits = {
+		0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+		7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+	// order of code length code lengths in a dynamic block header
+	constexpr std::array<uint8_t, 19> codeLengthOrder = {
+		16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+	// deflate stores huffman codes starting from the most significant bit,
+	// while bits are read and written starting from the least significant one
+	constexpr uint16_t reverseBits(uint16_t code, size_t codeLength)
 	{
-		Node* tree = new Node;
-
-		std::vector<size_t> bl_count;
-		for (size_t codeLength : codeLengths)
-		{
-			if (bl_count.size() < codeLength + 1)
-				bl_count.insert(bl_count.end(), codeLength - bl_count.size() + 1, 0);
-			bl_count[codeLength]++;
-		}
-
-		int16_t code = 0;
-		bl_count[0] = 0;
-		std::vector<int16_t> next_code(1, 0);
-		for (size_t bits = 1; bits <= bl_count.size() - 1; bits++)
+		uint16_t res = 0;
+		for (size_t i = 0; i < codeLength; i++)
 		{
-			code = (code + bl_count[bits - 1]) << 1;
-			next_code.push_back(code);
+			res = (res << 1) | (code & 1);
+			code >>= 1;
 		}
-
-		for (uint16_t n = 0; n < codeLengths.size(); n++)
-		{
-			size_t len = codeLengths[n];
-			if (len != 0)
-			{
-				addNode(tree, next_code[len], len, n);
-				next_code[len]++;
-			}
-		}
-
-		return tree;
-	}
-
-	Node* createStaticTree()
-	{
-		std::vector<size_t> codeLengths;
-		codeLengths.insert(codeLengths.end(), 144, 8); // 0-143
-		codeLengths.insert(codeLengths.end(), 112, 9); // 144-255
-		codeLengths.insert(codeLengths.end(), 24, 7); // 256-279
-		codeLengths.insert(codeLengths.end(), 8, 8); // 280-287
-		return createTree(codeLengths);
+		return res;
 	}
 }
 
-namespace
+namespace Huffman
 {
-	int16_t readCode(DeflateBitStream& r, Huffman::Node* tree)
-	{
-		Huffman::Node* current = tree;
-		while (current->value == -1)
-		{
-			if (r.readBit() == false) // 0 - left
-				current = current->leftChild;
-			else // 1 - right
-				current = current->rightChild;
-		}
-		return current->value;
-	}
-
-	int16_t decodeLength(DeflateBitStream& r, int16_t code)
+	constexpr size_t maxCodeLength = 15;
+	// largest alphabet, that of literal/length codes
+	constexpr size_t maxCodeCount = 288;
+	// number of bits used to index the primary table, longer codes
+	// continue in sub-tables
+	constexpr size_t primaryBits = 9;
+
+	// table entry layout: bits 0-3 - number of bits to consume (for a link
+	// entry - number of bits indexing the sub-table), bit 4 - entry links to
+	// a sub-table, bit 5 - no code maps to this entry, bits 16-31 - decoded
+	// value or sub-table offset
+	constexpr uint32_t linkFlag = 0x10;
+	constexpr uint32_t invalidFlag = 0x20;
+
+	struct Table
 	{
-		if (code >= 257 && code <= 264)
-			return code - 254;
-		if (code >= 265 && code <= 268)
-			return 11 + (code - 265) * 2 + r.read(1);
-		if (code >= 269 && code <= 272)
-			return 19 + (code - 269) * 4 + r.read(2);
-		if (code >= 273 && code <= 276)
-			return 35 + (code - 273) * 8 + r.read(3);
-		if (code >= 277 && code <= 280)
-			return 67 + (code - 277) * 16 + r.read(4);
-		if (code >= 281 && code <= 284)
-			return 131 + (code - 281) * 32 + r.read(5);
-		if (code == 285)
-			return 258;
-	}
-
-	int16_t decodeDistance(DeflateBitStream& r, int16_t code)
-	{
-		if (code >= 0 && code <= 3)
-			return 1 + code;
-		if (code >= 4 && code <= 29)
-		{
-			int16_t extraBits = code / 2 - 1;
-			return (1 << extraBits) * (code - extraBits * 2) + 1
-				+ r.read(extraBits);
-		}
-	}
-
-	// returns number of codes read
-	size_t decodeCodeLength(DeflateBitStream& r, int16_t code, std::vector<size_t>& codeLengths)
-	{
-		if (code >= 0 && code <= 15)
-		{
-			codeLengths.push_back(code);
-			return 1;
-		}
-		else if (code == 16)
-		{
-			size_t repeat = 3 + r.read(2);
-			size_t copiedValue = codeLengths.back();
-			codeLengths.insert(codeLengths.end(), repeat, copiedValue);
-			return repeat;
-		}
-		else if (code == 17)
-		{
-			size_t repeat = 3 + r.read(3);
-			codeLengths.insert(codeLengths.end(), repeat, 0);
-			return repeat;
-		}
-		else if (code == 18)
-		{
-			size_t repeat = 11 + r.read(7);
-			codeLengths.insert(codeLengths.end(), repeat, 0);
-			return repeat;
-		}
-	}
-
-	void readDynamicTrees(DeflateBitStream& r, Huffman::Node*& literalTree, Huffman::Node*& distanceTree)
-	{
-		size_t HLIT = 257 + r.read(5);
-		size_t HDIST = 1 + r.read(5);
-		size_t HCLEN = 4 + r.read(4);
-
-		int indices[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
-		std::vector<size_t> codeLengths(19, 0);
-		for (size_t i = 0; i < HCLEN; i++)
-		{
-			size_t codeLength = r.read(3);
-			codeLengths[indices[i]] = codeLength;
-		}
-
-		Huffman::Node* tempTree = Huffman::createTree(codeLengths);
-
-		std::vector<size_t> literalLengths;
-		for (size_t i = 0; i < HLIT; i++)
-		{
-			int16_t code = readCode(r, tempTree);
-			size_t codesRead = decodeCodeLength(r, code, literalLengths);
-			i += codesRead - 1;
-		}
-
-		std::vector<size_t> distanceLengts;
-		for (size_t i = 0; i < HDIST; i++)
-		{
-			int16_t code = readCode(r, tempTree);
-			size_t codesRead = decodeCodeLength(r, code, distanceLengts);
-			i += codesRead - 1;
-		}
-
-		delete tempTree;
+		std::vector<uint32_t> entries;
+	};
 
-		literalTree = Huffman::createTree(literalLengths);
-		distanceTree = Huffman::createTree(distanceLengts);
-	}
+	void createTable(std::span<const size_t> codeLengths, Table& table);
+	Table createStaticLiteralTable();
+	Table createStaticDistanceTable();
+	// decodes next value using the table, reading up to primaryBits bits
+	// at once instead of walking a tree bit by bit
+	uint16_t decode(DeflateBitStream& r, const Table& table);
 }
 
-std::vector<uint8_t> FlateDecode(PngChunkStream& in)
+// counts of what an Inflater decoded, collected only on request
+struct InflateStats
 {
-	DeflateBitStream r(in);
-	std::vector<uint8_t> res;
-
-	//zlib
-	uint8_t c;
-	in.get(c); // CMF
-	in.get(c); // FLG
-	if (GET_BIT(c, 5) == 1)
-		throw "zlib preset dictionary not supported";
-
-	static Huffman::Node* staticTree = nullptr;
-	bool lastBlock = false;
-	while (!lastBlock) // iteration over blocks
+	uint64_t storedBlocks = 0;
+	uint64_t staticBlocks = 0;
+	uint64_t dynamicBlocks = 0;
+	uint64_t storedBytes = 0;
+	uint64_t literals = 0;
+	uint64_t matches = 0;
+	// matches by length code minus 257 and by distance code, see
+	// Deflate::lengthBase and Deflate::distanceBase for their ranges
+	std::array<uint64_t, 29> lengthCodes{};
+	std::array<uint64_t, 30> distanceCodes{};
+};
+
+// inflates zlib stream stored in IDAT chunks
+class Inflater
+{
+public:
+	// state needed to continue inflating later from the same point
+	struct Checkpoint
 	{
-		lastBlock = r.readBit(); //BFINAL
-		int16_t BTYPE = r.read(2);
-		if (BTYPE == 0) // no compression
-		{
-			r.finishByte();
-			uint16_t LEN = r.read(16);
-			r.read(16); // NLEN
-			res.resize(res.size() + LEN);
-			in.read(res.data() + res.size() - LEN, LEN);
-		}
-		else // compressed
-		{
-			Huffman::Node* literalTree;
-			Huffman::Node* distanceTree;
-			if (BTYPE == 1) // static
-			{
-				if (staticTree == nullptr)
-					staticTree = Huffman::createStaticTree();
-				literalTree = staticTree;
-				distanceTree = nullptr;
-			}
-			else // dynamic
-				readDynamicTrees(r, literalTree, distanceTree);
-
-			while (true) // iteration over codes
-			{
-				int16_t code = readCode(r, literalTree);
-				if (code < 256) // literal byte
-					res.push_back((uint8_t)code);
-				else if (code == 256) // end of block
-					break;
-				else // length value
-				{
-					int16_t length = decodeLength(r, code);
-					int16_t distance;
-					if (distanceTree == nullptr)
-						distance = decodeDistance(r, r.read(5));
-					else
-						distance = decodeDistance(r, readCode(r, distanceTree));
-
-					res.resize(res.size() + length);
-					size_t copyLength = (length < distance) ? length : distance;
-					size_t num = length / copyLength;
-					const std::vector<uint8_t>::iterator copyStart = res.end() - length - distance;
-					std::vector<uint8_t>::iterator it = res.end() - length;
-					for (size_t i = 0; i < num; i++)
-					{
-						if (i != 0)
-							it += copyLength;
-						std::copy(copyStart, copyStart + copyLength, it);
-					}
-					if (length % copyLength != 0)
-						std::copy(copyStart, copyStart + length % copyLength, it + copyLength);
-				}
-			}
-			if (literalTree != staticTree)
-				delete literalTree;
-			if (distanceTree != nullptr)
-				delete distanceTree;
-		}
-
-	}
+		DeflateBitStream::State input;
+		uint8_t block = 0;
+		bool lastBlock = false;
+		bool streamEnded = false;
+		uint16_t storedRemaining = 0;
+		// code lengths of current dynamic block, literal ones first
+		std::vector<uint8_t> codeLengths;
+		uint16_t literalCodeCount = 0;
+		// inflated data back-references may need, its last unreadSize
+		// bytes weren't returned by read yet
+		std::vector<uint8_t> window;
+		uint32_t unreadSize = 0;
+	};
 
-	// zlib ADLER-32
-	uint8_t temp[4];
-	in.read(temp, 4);
+	// buffers an Inflater allocates as it goes. Inflaters given a
+	// workspace use its buffers and hand them back when destroyed, so
+	// one workspace saves reallocating them for each stream
+	struct Workspace
+	{
+		std::vector<uint8_t> window;
+		Huffman::Table literalTable;
+		Huffman::Table distanceTable;
+		Huffman::Table codeLengthTable;
+		std::vector<size_t> codeLengths;
+	};
 
-	return res;
-}
\ No newline at end of file
+	// Adler-32 of inflated data is checked against the zlib trailer
+	// unless pVerifyAdler32 is false
+	Inflater(PngChunkStream& pIn, bool pVerifyAdler32 = true, Workspace* pWorkspace = nullptr);
+	// continues inflating IDAT chunks of pIn from a checkpoint, Adler-32
+	// can't be checked
+	Inflater(PngChunkStream& pIn, const Checkpoint& checkpoint, Workspace* pWorkspace = nullptr);
+	// inflates zlib stream stored contiguously, e.g. concatenated IDAT data
+	Inflater(std::span<const uint8_t> zlibData, bool pVerifyAdler32 = true);
+	~Inflater();
+	Inflater(const Inflater&) = delete;
+	Inflater& operator=(const Inflater&) = delete;
+	// returns next len bytes of inflated data. Only the last 32 KiB of
+	// output are kept for back-references, so memory use doesn't depend
+	// on image size. Throws if the stream ends earlier
+	void read(uint8_t* dest, size_t len);
+	// inflates the whole stream straight to dest, use instead of read.
+	// Throws if inflated data is shorter than size
+	void readAll(uint8_t* dest, size_t size);
+	// checks that all inflated data was read and the zlib trailer
+	void finish();
+	// saves current state, only for streams reading IDAT chunks
+	Checkpoint checkpoint() const;
+	// adds counts of blocks and symbols inflated from now on to pStats,
+	// nullptr stops. The inflating loops are compiled separately for
+	// this, so they cost nothing otherwise
+	void collectStats(InflateStats* pStats);
+
+	// how far back-references may reach
+	static constexpr size_t historySize = 1 << 15;
+	static constexpr size_t maxMatchLength = 258;
+	// the window slides once this many bytes are inflated into it
+	static constexpr size_t windowBufferSize = 4 * historySize;
+	// bytes past the end of a match that copying it may overwrite
+	static constexpr size_t copySlack = 32;
+	// the last match may end past windowBufferSize, so the window and the
+	// window of a checkpoint can be up to this large
+	static constexpr size_t windowAllocationSize = windowBufferSize + maxMatchLength + copySlack;
+private:
+
+	DeflateBitStream r;
+	const bool verifyAdler32;
+	uint32_t adler = 1;
+
+	// Static is a block with fixed codes, it's inflated by its own loop
+	// with tables built at compile time
+	enum class Block { None, Stored, Huffman, Static };
+	Block block = Block::None;
+	bool lastBlock = false;
+	bool streamEnded = false;
+	uint16_t storedRemaining = 0;
+	const Huffman::Table* literalTable = nullptr;
+	const Huffman::Table* distanceTable = nullptr;
+	// reused by all dynamic blocks of the stream
+	Huffman::Table dynamicLiteralTable;
+	Huffman::Table dynamicDistanceTable;
+	Huffman::Table codeLengthTable;
+	std::vector<size_t> dynamicCodeLengths;
+	size_t literalCodeCount = 0;
+	Workspace* workspace = nullptr;
+	InflateStats* stats = nullptr;
+
+	std::vector<uint8_t> window;
+	// end of inflated data in window
+	size_t windowPos = 0;
+	// start of inflated data not yet returned by read
+	size_t readPos = 0;
+
+	// reads block header and prepares tables
+	void startBlock();
+	// inflates until out reaches outLimit or the stream ends, returns new
+	// end of output. Back-references may reach back to outStart, nothing is
+	// written past outEnd
+	uint8_t* inflate(uint8_t* outStart, uint8_t* out, uint8_t* outLimit, uint8_t* outEnd);
+	template<bool collectStats>
+	uint8_t* inflateBlocks(uint8_t* outStart, uint8_t* out, uint8_t* outLimit, uint8_t* outEnd);
+	// reads zlib header
+	void readHeader();
+	void borrowWorkspace(Workspace* pWorkspace);
+	// exchanges buffers with workspace
+	void swapWorkspace();
+	// inflates more data into window, sliding it if needed
+	void fillWindow();
+	// reads the rest of the stream, throws if it contains more data
+	void expectEnd();
+};
+
+// inflates the whole zlib stream stored in IDAT chunks into a buffer
+// allocated once. Throws unless inflated data has exactly expectedSize bytes.
+// Adler-32 of the result is checked against the zlib trailer unless
+// verifyAdler32 is false
+std::vector<uint8_t> FlateDecode(PngChunkStream& in, size_t expectedSize, bool verifyAdler32 = true);
+
+// the same as FlateDecode, but for zlib stream stored contiguously. Large
+// streams are split into parts inflated speculatively on pool threads, each
+// starting at the first dynamic block header found in its part with the
+// preceding 32 KiB unknown. Back-references into the unknown window are
+// resolved once the previous part is done, parts whose start turns out
+// wrong are inflated again sequentially
+std::vector<uint8_t> ParallelFlateDecode(std::span<const uint8_t> zlibData, size_t expectedSize,
+	ThreadPool& pool, bool verifyAdler32 = true);
\ No newline at end of file
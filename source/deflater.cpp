@@ -0,0 +1,756 @@
+#include "deflater.h"
+#include "deflate.h"
+#include "adler32.h"
+
+#include <algorithm>
+#include <cstring>
+#include <bit>
+#include <future>
+
+namespace
+{
+	constexpr size_t minMatch = 3;
+	constexpr size_t maxMatch = 258;
+	// matches of minimal length this far back cost more than the literals
+	constexpr size_t tooFar = 4096;
+	constexpr size_t maxCodeLength = 15;
+	constexpr size_t maxCodeLengthCodeLength = 7;
+	// positions relative to the window must fit int32_t
+	constexpr size_t maxWindowOffset = size_t(1) << 30;
+
+	using Deflate::lengthBase;
+	using Deflate::lengthExtraBits;
+	using Deflate::distanceBase;
+	using Deflate::distanceExtraBits;
+	using Deflate::codeLengthOrder;
+	using Deflate::reverseBits;
+
+	struct SymbolTables
+	{
+		// length code minus 257 of each match length
+		std::array<uint8_t, maxMatch + 1> lengthCodes;
+		// distance code of distances up to 256 at distance - 1, of longer
+		// ones at 256 + (distance - 1) / 128, like zlib does it
+		std::array<uint8_t, 512> distanceCodes;
+	};
+
+	constexpr SymbolTables computeSymbolTables()
+	{
+		SymbolTables tables{};
+		for (size_t code = 0; code < lengthBase.size(); code++)
+		{
+			size_t end = std::min<size_t>(lengthBase[code] + (1 << lengthExtraBits[code]), maxMatch + 1);
+			for (size_t length = lengthBase[code]; length < end; length++)
+				tables.lengthCodes[length] = static_cast<uint8_t>(code);
+		}
+		for (size_t code = 0; code < distanceBase.size(); code++)
+		{
+			size_t end = distanceBase[code] + (1 << distanceExtraBits[code]);
+			for (size_t distance = distanceBase[code]; distance < end; distance++)
+			{
+				if (distance <= 256)
+					tables.distanceCodes[distance - 1] = static_cast<uint8_t>(code);
+				else
+					tables.distanceCodes[256 + ((distance - 1) >> 7)] = static_cast<uint8_t>(code);
+			}
+		}
+		return tables;
+	}
+
+	constexpr SymbolTables symbolTables = computeSymbolTables();
+
+	size_t getDistanceCode(size_t distance)
+	{
+		if (distance <= 256)
+			return symbolTables.distanceCodes[distance - 1];
+		return symbolTables.distanceCodes[256 + ((distance - 1) >> 7)];
+	}
+
+	// how hard each level looks for matches, the same as in zlib
+	struct LevelConfig
+	{
+		uint16_t goodLength;
+		uint16_t lazyLength;
+		uint16_t niceLength;
+		uint16_t maxChain;
+		bool lazy;
+	};
+
+	constexpr std::array<LevelConfig, 10> levelConfigs = { {
+		{ 0, 0, 0, 0, false },
+		{ 4, 4, 8, 4, false }, { 4, 5, 16, 8, false }, { 4, 6, 32, 32, false },
+		{ 4, 4, 16, 16, true }, { 8, 16, 32, 32, true }, { 8, 16, 128, 128, true },
+		{ 8, 32, 128, 256, true }, { 32, 128, 258, 1024, true }, { 32, 258, 258, 4096, true } } };
+
+	// counts equal bytes at the start of a and b, up to maxLength
+	size_t matchLength(const uint8_t* a, const uint8_t* b, size_t maxLength)
+	{
+		size_t length = 0;
+		if constexpr (std::endian::native == std::endian::little)
+		{
+			for (; length + 8 <= maxLength; length += 8)
+			{
+				uint64_t x, y;
+				std::memcpy(&x, a + length, 8);
+				std::memcpy(&y, b + length, 8);
+				if (x != y)
+					return length + std::countr_zero(x ^ y) / 8;
+			}
+		}
+		while (length < maxLength && a[length] == b[length])
+			length++;
+		return length;
+	}
+
+	// computes lengths of a prefix code for the frequencies, optimal unless
+	// that needs codes longer than maxLength. The code is complete and has
+	// at least two symbols, unused ones get length 0 unless needed for that
+	void buildCodeLengths(const uint32_t* frequencies, size_t count, size_t maxLength, uint8_t* lengths)
+	{
+		constexpr size_t maxCount = 288;
+		// symbols with codes, rarest first
+		std::array<uint16_t, maxCount> sorted;
+		size_t n = 0;
+		for (size_t i = 0; i < count; i++)
+		{
+			lengths[i] = 0;
+			if (frequencies[i] != 0)
+				sorted[n++] = static_cast<uint16_t>(i);
+		}
+		for (size_t i = 0; n < 2; i++)
+		{
+			if (frequencies[i] == 0)
+				sorted[n++] = static_cast<uint16_t>(i);
+		}
+		std::sort(sorted.begin(), sorted.begin() + n, [&](uint16_t a, uint16_t b)
+		{
+			return frequencies[a] < frequencies[b] || (frequencies[a] == frequencies[b] && a < b);
+		});
+
+		// leaves in sorted order and the nodes made of them form two queues
+		// sorted by weight, the two lightest are joined each time
+		std::array<uint32_t, 2 * maxCount> weights;
+		std::array<uint16_t, 2 * maxCount> parents;
+		for (size_t i = 0; i < n; i++)
+			weights[i] = std::max<uint32_t>(frequencies[sorted[i]], 1);
+		size_t leaf = 0;
+		size_t node = n;
+		size_t nodeEnd = n;
+		auto takeLightest = [&]()
+		{
+			if (leaf < n && (node == nodeEnd || weights[leaf] <= weights[node]))
+				return leaf++;
+			return node++;
+		};
+		for (size_t i = 0; i + 1 < n; i++)
+		{
+			size_t a = takeLightest();
+			size_t b = takeLightest();
+			weights[nodeEnd] = weights[a] + weights[b];
+			parents[a] = parents[b] = static_cast<uint16_t>(nodeEnd);
+			nodeEnd++;
+		}
+		// the root is made last, every node after its children
+		std::array<uint16_t, 2 * maxCount> depths;
+		depths[nodeEnd - 1] = 0;
+		for (size_t i = nodeEnd - 1; i-- > 0;)
+			depths[i] = depths[parents[i]] + 1;
+
+		// too long codes are cut to maxLength, which over-subscribes the
+		// code. The longest codes shorter than that then get longer until
+		// it fits and the shortest ones that can get shorter fill up what
+		// is left, rarest symbols getting longer and most frequent getting
+		// shorter first
+		const uint32_t capacity = 1u << maxLength;
+		uint32_t used = 0;
+		for (size_t i = 0; i < n; i++)
+		{
+			depths[i] = std::min<uint16_t>(depths[i], static_cast<uint16_t>(maxLength));
+			used += capacity >> depths[i];
+		}
+		while (used > capacity)
+		{
+			size_t best = n;
+			for (size_t i = 0; i < n; i++)
+			{
+				if (depths[i] < maxLength && (best == n || depths[i] > depths[best]))
+					best = i;
+			}
+			used -= capacity >> (depths[best] + 1);
+			depths[best]++;
+		}
+		while (used < capacity)
+		{
+			size_t best = n;
+			for (size_t i = n; i-- > 0;)
+			{
+				if (depths[i] > 1 && (capacity >> depths[i]) <= capacity - used
+					&& (best == n || depths[i] > depths[best]))
+					best = i;
+			}
+			used += capacity >> depths[best];
+			depths[best]--;
+		}
+		for (size_t i = 0; i < n; i++)
+			lengths[sorted[i]] = static_cast<uint8_t>(depths[i]);
+	}
+
+	// assigns canonical codes to the lengths, bit-reversed since deflate
+	// stores codes starting from the most significant bit
+	void assignCodes(const uint8_t* lengths, size_t count, uint16_t* codes)
+	{
+		std::array<uint16_t, maxCodeLength + 1> lengthCounts{};
+		for (size_t i = 0; i < count; i++)
+			lengthCounts[lengths[i]]++;
+		lengthCounts[0] = 0;
+		std::array<uint16_t, maxCodeLength + 1> nextCode{};
+		uint16_t code = 0;
+		for (size_t bits = 1; bits <= maxCodeLength; bits++)
+		{
+			code = (code + lengthCounts[bits - 1]) << 1;
+			nextCode[bits] = code;
+		}
+		for (size_t i = 0; i < count; i++)
+		{
+			if (lengths[i] != 0)
+				codes[i] = reverseBits(nextCode[lengths[i]]++, lengths[i]);
+		}
+	}
+
+	struct Code
+	{
+		std::array<uint8_t, 288> literalLengths;
+		std::array<uint16_t, 288> literalCodes;
+		std::array<uint8_t, 30> distanceLengths;
+		std::array<uint16_t, 30> distanceCodes;
+	};
+
+	const Code& getStaticCode()
+	{
+		static const Code code = []()
+		{
+			Code res{};
+			std::fill(res.literalLengths.begin(), res.literalLengths.begin() + 144, 8);
+			std::fill(res.literalLengths.begin() + 144, res.literalLengths.begin() + 256, 9);
+			std::fill(res.literalLengths.begin() + 256, res.literalLengths.begin() + 280, 7);
+			std::fill(res.literalLengths.begin() + 280, res.literalLengths.end(), 8);
+			res.distanceLengths.fill(5);
+			assignCodes(res.literalLengths.data(), res.literalLengths.size(), res.literalCodes.data());
+			assignCodes(res.distanceLengths.data(), res.distanceLengths.size(), res.distanceCodes.data());
+			return res;
+		}();
+		return code;
+	}
+
+	// run-length encodes code lengths with code 16 (repeat the previous
+	// length 3-6 times), 17 (3-10 zeros) and 18 (11-138 zeros). Each run
+	// keeps its extra bits value from bit 8 on. Returns number of runs
+	size_t encodeCodeLengthRuns(const uint8_t* lengths, size_t count, uint16_t* runs, uint32_t* frequencies)
+	{
+		size_t n = 0;
+		for (size_t i = 0; i < count;)
+		{
+			uint8_t length = lengths[i];
+			size_t run = 1;
+			while (i + run < count && lengths[i + run] == length)
+				run++;
+			if (length != 0 && run >= 4)
+			{
+				runs[n++] = length;
+				frequencies[length]++;
+				i++;
+				run--;
+				for (; run >= 3; run -= std::min<size_t>(run, 6))
+				{
+					size_t repeat = std::min<size_t>(run, 6);
+					runs[n++] = static_cast<uint16_t>(16 | ((repeat - 3) << 8));
+					frequencies[16]++;
+					i += repeat;
+				}
+			}
+			else if (length == 0 && run >= 3)
+			{
+				for (; run >= 3; run -= std::min<size_t>(run, 138))
+				{
+					size_t repeat = std::min<size_t>(run, 138);
+					if (repeat >= 11)
+					{
+						runs[n++] = static_cast<uint16_t>(18 | ((repeat - 11) << 8));
+						frequencies[18]++;
+					}
+					else
+					{
+						runs[n++] = static_cast<uint16_t>(17 | ((repeat - 3) << 8));
+						frequencies[17]++;
+					}
+					i += repeat;
+				}
+			}
+			else
+			{
+				runs[n++] = length;
+				frequencies[length]++;
+				i++;
+			}
+		}
+		return n;
+	}
+
+	void writeZlibHeader(std::vector<uint8_t>& out, int level)
+	{
+		// deflate with 32 KiB window, FLEVEL tells how hard the compressor tried
+		constexpr uint8_t CMF = 0x78;
+		uint8_t FLG = static_cast<uint8_t>((level <= 1 ? 0 : level <= 5 ? 1 : level == 6 ? 2 : 3) << 6);
+		FLG |= 31 - (CMF * 256 + FLG) % 31;
+		out.push_back(CMF);
+		out.push_back(FLG);
+	}
+
+	void writeAdler32(std::vector<uint8_t>& out, uint32_t adler)
+	{
+		for (int shift = 24; shift >= 0; shift -= 8)
+			out.push_back(static_cast<uint8_t>(adler >> shift));
+	}
+}
+
+// writes bits starting from the least significant one, appending to out
+class Deflater::BitWriter
+{
+public:
+	BitWriter(std::vector<uint8_t>& pOut) : out(pOut), pos(pOut.size()) {}
+
+	// writes up to 32 bits
+	void write(uint32_t bits, size_t count)
+	{
+		buffer |= static_cast<uint64_t>(bits) << bitCount;
+		bitCount += count;
+		if (bitCount >= 32)
+		{
+			reserve(4);
+			for (size_t i = 0; i < 4; i++)
+				out[pos + i] = static_cast<uint8_t>(buffer >> (i * 8));
+			pos += 4;
+			buffer >>= 32;
+			bitCount -= 32;
+		}
+	}
+	// pads to a byte boundary with zero bits
+	void alignToByte()
+	{
+		reserve(8);
+		while (bitCount > 0)
+		{
+			out[pos++] = static_cast<uint8_t>(buffer);
+			buffer >>= 8;
+			bitCount = bitCount > 8 ? bitCount - 8 : 0;
+		}
+	}
+	// use only at a byte boundary
+	void writeBytes(const uint8_t* data, size_t len)
+	{
+		reserve(len);
+		std::memcpy(out.data() + pos, data, len);
+		pos += len;
+	}
+	size_t pendingBits() const
+	{
+		return bitCount;
+	}
+	// aligns and trims out to the written bytes
+	void finish()
+	{
+		alignToByte();
+		out.resize(pos);
+	}
+private:
+	std::vector<uint8_t>& out;
+	// out is grown ahead, bytes are written at pos
+	size_t pos;
+	uint64_t buffer = 0;
+	size_t bitCount = 0;
+
+	void reserve(size_t len)
+	{
+		if (out.size() - pos < len)
+			out.resize(std::max(out.size() * 2, pos + len + 4096));
+	}
+};
+
+Deflater::Deflater(int pLevel, bool pFixedCodes) : level(std::clamp(pLevel, 0, 9)), fixedCodes(pFixedCodes)
+{
+	const LevelConfig& c = levelConfigs[level];
+	config = { c.goodLength, c.lazyLength, c.niceLength, c.maxChain, c.lazy };
+}
+
+int32_t Deflater::insert(const uint8_t* window, int32_t pos)
+{
+	const uint8_t* p = window + pos;
+	uint32_t hash = ((p[0] | (p[1] << 8) | (p[2] << 16)) * 0x9E3779B1u) >> (32 - hashBits);
+	int32_t candidate = head[hash];
+	prev[pos & (windowSize - 1)] = candidate;
+	head[hash] = pos;
+	return candidate;
+}
+
+size_t Deflater::findMatch(const uint8_t* window, int32_t pos, int32_t candidate, size_t maxLength,
+	size_t prevLength, size_t& distance) const
+{
+	if (prevLength >= maxLength)
+		return 0;
+	size_t chain = config.maxChain;
+	if (prevLength >= config.goodLength)
+		chain >>= 2;
+	// the slot of the position a full window back is already reused
+	int32_t limit = pos - static_cast<int32_t>(windowSize);
+	const uint8_t* current = window + pos;
+	size_t best = prevLength;
+	size_t found = 0;
+	while (candidate > limit && candidate >= 0 && chain-- > 0)
+	{
+		const uint8_t* match = window + candidate;
+		// the byte that would make the match longer than the best is
+		// checked first
+		if (match[best] == current[best] && match[0] == current[0] && match[1] == current[1])
+		{
+			size_t length = matchLength(match, current, maxLength);
+			if (length > best)
+			{
+				best = found = length;
+				distance = pos - candidate;
+				if (length >= config.niceLength || length == maxLength)
+					break;
+			}
+		}
+		candidate = prev[candidate & (windowSize - 1)];
+	}
+	return found;
+}
+
+void Deflater::addLiteral(uint8_t literal)
+{
+	symbols.push_back(literal);
+	literalFrequencies[literal]++;
+}
+
+void Deflater::addMatch(size_t length, size_t distance)
+{
+	// flag, length - 3 and distance - 1
+	symbols.push_back((1u << 31) | static_cast<uint32_t>((length - minMatch) << 16) | static_cast<uint32_t>(distance - 1));
+	literalFrequencies[257 + symbolTables.lengthCodes[length]]++;
+	distanceFrequencies[getDistanceCode(distance)]++;
+}
+
+void Deflater::compress(std::span<const uint8_t> data, size_t start, bool last, std::vector<uint8_t>& out)
+{
+	BitWriter w(out);
+	if (level == 0)
+		writeStoredBlocks(w, data.subspan(start), last);
+	else
+	{
+		head.assign(size_t(1) << hashBits, -1);
+		prev.assign(windowSize, -1);
+		symbols.clear();
+		symbols.reserve(maxBlockSymbols + 1);
+		literalFrequencies.fill(0);
+		distanceFrequencies.fill(0);
+
+		const size_t end = data.size();
+		const uint8_t* bytes = data.data();
+		size_t windowStart = start - std::min(start, windowSize);
+		const uint8_t* window = bytes + windowStart;
+		auto relative = [&](size_t pos) { return static_cast<int32_t>(pos - windowStart); };
+		for (size_t pos = windowStart; pos < start && pos + minMatch <= end; pos++)
+			insert(window, relative(pos));
+
+		size_t blockStart = start;
+		// end of data covered by symbols
+		size_t covered = start;
+		// lazy matching keeps the match found at the previous position
+		// while checking whether the next one has a longer one
+		size_t prevLength = 0;
+		size_t prevDistance = 0;
+		bool literalPending = false;
+		size_t pos = start;
+		while (pos < end)
+		{
+			if (pos - windowStart >= maxWindowOffset)
+			{
+				// moves the window by a multiple of its size, so that
+				// positions keep their slots in prev
+				int32_t shift = static_cast<int32_t>((pos - windowStart - windowSize) & ~(windowSize - 1));
+				windowStart += shift;
+				window += shift;
+				for (int32_t& p : head)
+					p = p >= shift ? p - shift : -1;
+				for (int32_t& p : prev)
+					p = p >= shift ? p - shift : -1;
+			}
+			if (symbols.size() >= maxBlockSymbols)
+			{
+				writeBlock(w, data.subspan(blockStart, covered - blockStart), false);
+				blockStart = covered;
+			}
+
+			size_t maxLength = std::min(maxMatch, end - pos);
+			int32_t candidate = -1;
+			if (pos + minMatch <= end)
+				candidate = insert(window, relative(pos));
+			size_t length = 0;
+			size_t distance = 0;
+			if (config.lazy)
+			{
+				if (candidate >= 0 && prevLength < config.lazyLength)
+				{
+					length = findMatch(window, relative(pos), candidate, maxLength,
+						std::max(prevLength, minMatch - 1), distance);
+					if (length == minMatch && distance > tooFar)
+						length = 0;
+				}
+				if (prevLength >= minMatch && length <= prevLength)
+				{
+					// the match at the previous position wins
+					addMatch(prevLength, prevDistance);
+					size_t matchEnd = pos - 1 + prevLength;
+					for (size_t p = pos + 1; p < matchEnd && p + minMatch <= end; p++)
+						insert(window, relative(p));
+					pos = covered = matchEnd;
+					prevLength = 0;
+					literalPending = false;
+					continue;
+				}
+				if (literalPending)
+				{
+					addLiteral(bytes[pos - 1]);
+					covered = pos;
+				}
+				literalPending = true;
+				prevLength = length;
+				prevDistance = distance;
+				pos++;
+			}
+			else
+			{
+				if (candidate >= 0)
+				{
+					length = findMatch(window, relative(pos), candidate, maxLength, minMatch - 1, distance);
+					if (length == minMatch && distance > tooFar)
+						length = 0;
+				}
+				if (length >= minMatch)
+				{
+					addMatch(length, distance);
+					// long matches aren't inserted to save time
+					if (length <= config.lazyLength)
+					{
+						for (size_t p = pos + 1; p < pos + length && p + minMatch <= end; p++)
+							insert(window, relative(p));
+					}
+					pos += length;
+				}
+				else
+				{
+					addLiteral(bytes[pos]);
+					pos++;
+				}
+				covered = pos;
+			}
+		}
+		if (literalPending)
+			addLiteral(bytes[end - 1]);
+		writeBlock(w, data.subspan(blockStart, end - blockStart), last);
+	}
+
+	if (!last)
+	{
+		// empty stored block
+		w.write(0, 3);
+		w.alignToByte();
+		w.write(0xFFFF0000, 32);
+	}
+	w.finish();
+}
+
+void Deflater::writeBlock(BitWriter& w, std::span<const uint8_t> blockData, bool last)
+{
+	literalFrequencies[256] = 1; // end of block
+	Code code;
+	buildCodeLengths(literalFrequencies.data(), literalFrequencies.size(), maxCodeLength, code.literalLengths.data());
+	buildCodeLengths(distanceFrequencies.data(), distanceFrequencies.size(), maxCodeLength, code.distanceLengths.data());
+	size_t literalCount = literalFrequencies.size();
+	while (literalCount > 257 && code.literalLengths[literalCount - 1] == 0)
+		literalCount--;
+	size_t distanceCount = distanceFrequencies.size();
+	while (distanceCount > 1 && code.distanceLengths[distanceCount - 1] == 0)
+		distanceCount--;
+
+	// literal and distance code lengths form a single sequence
+	std::array<uint8_t, 286 + 30> lengths;
+	std::copy(code.literalLengths.begin(), code.literalLengths.begin() + literalCount, lengths.begin());
+	std::copy(code.distanceLengths.begin(), code.distanceLengths.begin() + distanceCount,
+		lengths.begin() + literalCount);
+	std::array<uint16_t, 286 + 30> runs;
+	std::array<uint32_t, 19> codeLengthFrequencies{};
+	size_t runCount = encodeCodeLengthRuns(lengths.data(), literalCount + distanceCount, runs.data(),
+		codeLengthFrequencies.data());
+	std::array<uint8_t, 19> codeLengthLengths;
+	std::array<uint16_t, 19> codeLengthCodes;
+	buildCodeLengths(codeLengthFrequencies.data(), codeLengthFrequencies.size(), maxCodeLengthCodeLength,
+		codeLengthLengths.data());
+	size_t codeLengthCount = codeLengthOrder.size();
+	while (codeLengthCount > 4 && codeLengthLengths[codeLengthOrder[codeLengthCount - 1]] == 0)
+		codeLengthCount--;
+
+	// sizes in bits of the block written each way
+	const Code& staticCode = getStaticCode();
+	uint64_t dynamicSize = 3 + 14 + 3 * codeLengthCount + codeLengthFrequencies[16] * 2
+		+ codeLengthFrequencies[17] * 3 + codeLengthFrequencies[18] * 7;
+	for (size_t i = 0; i < codeLengthFrequencies.size(); i++)
+		dynamicSize += static_cast<uint64_t>(codeLengthFrequencies[i]) * codeLengthLengths[i];
+	uint64_t staticSize = 3;
+	uint64_t extraBits = 0;
+	for (size_t i = 0; i < literalFrequencies.size(); i++)
+	{
+		dynamicSize += static_cast<uint64_t>(literalFrequencies[i]) * code.literalLengths[i];
+		staticSize += static_cast<uint64_t>(literalFrequencies[i]) * staticCode.literalLengths[i];
+		if (i >= 257)
+			extraBits += static_cast<uint64_t>(literalFrequencies[i]) * lengthExtraBits[i - 257];
+	}
+	for (size_t i = 0; i < distanceFrequencies.size(); i++)
+	{
+		dynamicSize += static_cast<uint64_t>(distanceFrequencies[i]) * code.distanceLengths[i];
+		staticSize += static_cast<uint64_t>(distanceFrequencies[i]) * staticCode.distanceLengths[i];
+		extraBits += static_cast<uint64_t>(distanceFrequencies[i]) * distanceExtraBits[i];
+	}
+	dynamicSize += extraBits;
+	staticSize += extraBits;
+	size_t storedBlockCount = std::max<size_t>((blockData.size() + 65534) / 65535, 1);
+	uint64_t storedSize = (w.pendingBits() + 3 + 7) / 8 * 8 - w.pendingBits()
+		+ 32 + (storedBlockCount - 1) * 40 + blockData.size() * 8;
+
+	if (fixedCodes)
+		dynamicSize = storedSize = UINT64_MAX;
+	if (storedSize <= std::min(staticSize, dynamicSize))
+		writeStoredBlocks(w, blockData, last);
+	else
+	{
+		w.write(last, 1);
+		const Code* used = &staticCode;
+		if (staticSize <= dynamicSize)
+			w.write(1, 2);
+		else
+		{
+			w.write(2, 2);
+			w.write(static_cast<uint32_t>(literalCount - 257), 5);
+			w.write(static_cast<uint32_t>(distanceCount - 1), 5);
+			w.write(static_cast<uint32_t>(codeLengthCount - 4), 4);
+			for (size_t i = 0; i < codeLengthCount; i++)
+				w.write(codeLengthLengths[codeLengthOrder[i]], 3);
+			assignCodes(codeLengthLengths.data(), codeLengthLengths.size(), codeLengthCodes.data());
+			for (size_t i = 0; i < runCount; i++)
+			{
+				uint16_t symbol = runs[i] & 0xFF;
+				w.write(codeLengthCodes[symbol], codeLengthLengths[symbol]);
+				if (symbol >= 16)
+					w.write(runs[i] >> 8, symbol == 16 ? 2 : symbol == 17 ? 3 : 7);
+			}
+			assignCodes(code.literalLengths.data(), literalFrequencies.size(), code.literalCodes.data());
+			assignCodes(code.distanceLengths.data(), distanceFrequencies.size(), code.distanceCodes.data());
+			used = &code;
+		}
+
+		for (uint32_t symbol : symbols)
+		{
+			if (symbol < 256)
+			{
+				w.write(used->literalCodes[symbol], used->literalLengths[symbol]);
+				continue;
+			}
+			size_t length = ((symbol >> 16) & 0xFF) + minMatch;
+			size_t distance = (symbol & 0xFFFF) + 1;
+			size_t lengthCode = symbolTables.lengthCodes[length];
+			w.write(used->literalCodes[257 + lengthCode], used->literalLengths[257 + lengthCode]);
+			w.write(static_cast<uint32_t>(length - lengthBase[lengthCode]), lengthExtraBits[lengthCode]);
+			size_t distanceCode = getDistanceCode(distance);
+			w.write(used->distanceCodes[distanceCode], used->distanceLengths[distanceCode]);
+			w.write(static_cast<uint32_t>(distance - distanceBase[distanceCode]), distanceExtraBits[distanceCode]);
+		}
+		w.write(used->literalCodes[256], used->literalLengths[256]);
+	}
+
+	symbols.clear();
+	literalFrequencies.fill(0);
+	distanceFrequencies.fill(0);
+}
+
+void Deflater::writeStoredBlocks(BitWriter& w, std::span<const uint8_t> blockData, bool last)
+{
+	size_t offset = 0;
+	do
+	{
+		size_t len = std::min<size_t>(blockData.size() - offset, 65535);
+		w.write(last && offset + len == blockData.size(), 1);
+		w.write(0, 2);
+		w.alignToByte();
+		w.write(static_cast<uint32_t>(len) | (static_cast<uint32_t>(~len & 0xFFFF) << 16), 32);
+		w.writeBytes(blockData.data() + offset, len);
+		offset += len;
+	} while (offset < blockData.size());
+}
+
+std::vector<uint8_t> FlateEncode(std::span<const uint8_t> data, int level, bool fixedCodes)
+{
+	std::vector<uint8_t> res;
+	writeZlibHeader(res, level);
+	Deflater deflater(level, fixedCodes);
+	deflater.compress(data, 0, true, res);
+	writeAdler32(res, Adler32::update(1, data.data(), data.size()));
+	return res;
+}
+
+std::vector<uint8_t> ParallelFlateEncode(std::span<const uint8_t> data, size_t partSize, int level,
+	ThreadPool& pool)
+{
+	partSize = std::max<size_t>(partSize, 1);
+	size_t partCount = (data.size() + partSize - 1) / partSize;
+	if (partCount <= 1)
+		return FlateEncode(data, level);
+
+	std::vector<std::vector<uint8_t>> parts(partCount);
+	std::vector<std::future<void>> compressed(partCount);
+	// tasks refer to parts and must finish before it's gone
+	struct Waiter
+	{
+		std::vector<std::future<void>>& compressed;
+		~Waiter()
+		{
+			for (std::future<void>& f : compressed)
+			{
+				if (f.valid())
+					f.wait();
+			}
+		}
+	} waiter{ compressed };
+
+	for (size_t i = 0; i < partCount; i++)
+	{
+		compressed[i] = pool.submit([&parts, data, partSize, partCount, level, i]()
+		{
+			size_t start = i * partSize;
+			size_t end = std::min(data.size(), start + partSize);
+			Deflater deflater(level);
+			deflater.compress(data.first(end), start, i + 1 == partCount, parts[i]);
+		});
+	}
+	uint32_t adler = Adler32::update(1, data.data(), data.size());
+
+	std::vector<uint8_t> res;
+	writeZlibHeader(res, level);
+	for (size_t i = 0; i < partCount; i++)
+	{
+		compressed[i].get();
+		res.insert(res.end(), parts[i].begin(), parts[i].end());
+		std::vector<uint8_t>().swap(parts[i]);
+	}
+	writeAdler32(res, adler);
+	return res;
+}
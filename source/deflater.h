@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <array>
+#include <span>
+
+#include "threadpool.h"
+
+// compresses data to deflate blocks using hash chains to find matches,
+// each block is written stored, with static codes or with dynamic codes,
+// whichever is the smallest
+class Deflater
+{
+public:
+	// level 0 only stores data, 1 to 9 trade speed for compression
+	// the same way as zlib levels. With pFixedCodes set all blocks use
+	// fixed codes, like zlib's Z_FIXED strategy
+	Deflater(int pLevel = 6, bool pFixedCodes = false);
+	// appends blocks compressing data from start to out. Matches may reach
+	// back into up to 32 KiB of data preceding start, which must precede it
+	// in the stream as well. Unless last is set, the blocks are followed by
+	// an empty stored block (a sync flush), so the output ends byte aligned
+	// and blocks compressed separately may follow
+	void compress(std::span<const uint8_t> data, size_t start, bool last, std::vector<uint8_t>& out);
+
+	static constexpr size_t windowSize = 1 << 15;
+private:
+	// how hard to look for matches, as in zlib
+	struct Config
+	{
+		// chains are shortened when a match this long is already found
+		uint16_t goodLength;
+		// lazy matching isn't tried after matches this long, greedy levels
+		// only insert matches up to this length into the hash chains
+		uint16_t lazyLength;
+		// search stops at a match this long
+		uint16_t niceLength;
+		uint16_t maxChain;
+		bool lazy;
+	};
+
+	class BitWriter;
+
+	static constexpr size_t hashBits = 15;
+	// symbols per block before the block is written out
+	static constexpr size_t maxBlockSymbols = 1 << 14;
+
+	int level;
+	bool fixedCodes;
+	Config config;
+	// most recent position of each hash and the previous one with the same
+	// hash of each position in the window, -1 if none. Positions are
+	// relative to the start of the window
+	std::vector<int32_t> head;
+	std::vector<int32_t> prev;
+	// literals and matches of the current block, see compress
+	std::vector<uint32_t> symbols;
+	std::array<uint32_t, 286> literalFrequencies;
+	std::array<uint32_t, 30> distanceFrequencies;
+
+	int32_t insert(const uint8_t* window, int32_t pos);
+	// length of the longest match at pos found in the chain starting at
+	// candidate, if longer than prevLength. Returns 0 otherwise
+	size_t findMatch(const uint8_t* window, int32_t pos, int32_t candidate, size_t maxLength,
+		size_t prevLength, size_t& distance) const;
+	void addLiteral(uint8_t literal);
+	void addMatch(size_t length, size_t distance);
+	// writes the symbols collected as a block covering blockData
+	void writeBlock(BitWriter& w, std::span<const uint8_t> blockData, bool last);
+	void writeStoredBlocks(BitWriter& w, std::span<const uint8_t> blockData, bool last);
+};
+
+// compresses data to a zlib stream
+std::vector<uint8_t> FlateEncode(std::span<const uint8_t> data, int level = 6, bool fixedCodes = false);
+
+// the same as FlateEncode, but parts of partSize bytes are compressed on
+// pool threads, each with the 32 KiB preceding it as dictionary, and joined
+// after sync flushes, the way pigz does it
+std::vector<uint8_t> ParallelFlateEncode(std::span<const uint8_t> data, size_t partSize, int level,
+	ThreadPool& pool);
@@ -0,0 +1,175 @@
+#include "encoder.h"
+#include "deflater.h"
+#include "filters.h"
+#include "streams.h"
+
+#include <algorithm>
+#include <cstring>
+#include <future>
+
+namespace
+{
+	// IDAT data is split into chunks of this length
+	constexpr size_t maxIDATLength = 1 << 20;
+	// filtered data compressed by a single task, rounded to whole rows
+	constexpr size_t bandSize = 256 << 10;
+
+	// converts a row of pixels to the sample layout of the png
+	void convertRow(const uint8_t* src, uint8_t* dest, uint32_t width, Pixels::Format format)
+	{
+		switch (format)
+		{
+		case Pixels::Format::Bgra8:
+			for (size_t x = 0; x < width; x++)
+			{
+				dest[x * 4] = src[x * 4 + 2];
+				dest[x * 4 + 1] = src[x * 4 + 1];
+				dest[x * 4 + 2] = src[x * 4];
+				dest[x * 4 + 3] = src[x * 4 + 3];
+			}
+			break;
+		case Pixels::Format::Rgba16:
+			// samples are stored with MSB first
+			for (size_t i = 0; i < static_cast<size_t>(width) * 4; i++)
+			{
+				uint16_t sample;
+				std::memcpy(&sample, src + i * 2, 2);
+				dest[i * 2] = static_cast<uint8_t>(sample >> 8);
+				dest[i * 2 + 1] = static_cast<uint8_t>(sample);
+			}
+			break;
+		default:
+			std::memcpy(dest, src, width * Pixels::getPixelSize(format));
+			break;
+		}
+	}
+
+	// converts and filters rows first to last - 1, each filtered row
+	// starting with its filter type
+	void filterRows(std::span<const uint8_t> pixels, size_t stride, uint32_t width, Pixels::Format format,
+		int filter, uint32_t first, uint32_t last, uint8_t* filtered)
+	{
+		size_t bytesPerPixel = Pixels::getPixelSize(format);
+		size_t rowSize = width * bytesPerPixel;
+		// the bytes in front of the rows stand for pixels left of the image
+		std::vector<uint8_t> line1(bytesPerPixel + rowSize, 0);
+		std::vector<uint8_t> line2(bytesPerPixel + rowSize, 0);
+		uint8_t* line = line1.data() + bytesPerPixel;
+		uint8_t* prevLine = line2.data() + bytesPerPixel;
+		if (first > 0)
+			convertRow(pixels.data() + (first - 1) * stride, prevLine, width, format);
+		for (uint32_t y = first; y < last; y++)
+		{
+			convertRow(pixels.data() + y * stride, line, width, format);
+			uint8_t type = filter >= 0 ? static_cast<uint8_t>(filter)
+				: Filters::chooseFilter(line, prevLine, rowSize, bytesPerPixel);
+			*(filtered++) = type;
+			Filters::filterLine(type, line, prevLine, filtered, rowSize, bytesPerPixel);
+			filtered += rowSize;
+			std::swap(line, prevLine);
+		}
+	}
+}
+
+std::vector<uint8_t> encodePng(std::span<const uint8_t> pixels, uint32_t width, uint32_t height,
+	Pixels::Format format, size_t stride, const EncodeOptions& options)
+{
+	if (width == 0 || height == 0 || width > 0x7FFFFFFF || height > 0x7FFFFFFF)
+		throwPngError(PngErrorCode::InvalidArgument, "invalid image size");
+	if (options.filter < -1 || options.filter > 4)
+		throwPngError(PngErrorCode::InvalidArgument, "invalid filter type");
+	size_t rowSize = width * Pixels::getPixelSize(format);
+	if (stride == 0)
+		stride = rowSize;
+	if (stride < rowSize || pixels.size() < rowSize || (pixels.size() - rowSize) / stride < height - 1)
+		throwPngError(PngErrorCode::InvalidArgument, "input buffer too small");
+
+	uint8_t bitDepth = 8;
+	uint8_t colourType;
+	switch (format)
+	{
+	case Pixels::Format::Rgba8:
+	case Pixels::Format::Bgra8:
+		colourType = 6;
+		break;
+	case Pixels::Format::Rgb8:
+		colourType = 2;
+		break;
+	case Pixels::Format::Grey8:
+		colourType = 0;
+		break;
+	case Pixels::Format::Rgba16:
+		colourType = 6;
+		bitDepth = 16;
+		break;
+	default:
+		colourType = 3;
+		if (options.palette.empty() || options.palette.size() > 256 * 3 || options.palette.size() % 3 != 0)
+			throwPngError(PngErrorCode::InvalidArgument, "invalid palette");
+		break;
+	}
+	int filter = options.filter;
+	if (colourType == 3 && filter < 0)
+		filter = 0;
+
+	std::vector<uint8_t> filteredImageData((rowSize + 1) * height);
+	std::vector<uint8_t> zlibData;
+	if (options.threadPool)
+	{
+		uint32_t bandRows = static_cast<uint32_t>(std::clamp<size_t>(bandSize / (rowSize + 1), 1, height));
+		size_t bandCount = (height + bandRows - 1) / bandRows;
+		std::vector<std::future<void>> filteredBands(bandCount);
+		// tasks write to filteredImageData and must finish before it's gone
+		struct Waiter
+		{
+			std::vector<std::future<void>>& filteredBands;
+			~Waiter()
+			{
+				for (std::future<void>& f : filteredBands)
+				{
+					if (f.valid())
+						f.wait();
+				}
+			}
+		} waiter{ filteredBands };
+		for (size_t i = 0; i < bandCount; i++)
+		{
+			uint32_t first = static_cast<uint32_t>(i * bandRows);
+			uint32_t last = std::min(first + bandRows, height);
+			filteredBands[i] = options.threadPool->submit([&, first, last]()
+			{
+				filterRows(pixels, stride, width, format, filter, first, last,
+					filteredImageData.data() + first * (rowSize + 1));
+			});
+		}
+		for (std::future<void>& f : filteredBands)
+			f.get();
+		zlibData = ParallelFlateEncode(filteredImageData, bandRows * (rowSize + 1), options.level,
+			*options.threadPool);
+	}
+	else
+	{
+		filterRows(pixels, stride, width, format, filter, 0, height, filteredImageData.data());
+		zlibData = FlateEncode(filteredImageData, options.level);
+	}
+
+	std::vector<uint8_t> res;
+	res.reserve(zlibData.size() + options.palette.size() + 64 + zlibData.size() / maxIDATLength * 12);
+	PngChunkWriter out(res);
+	out.writeSignature();
+	std::vector<uint8_t> header;
+	PngChunkWriter::writeU32(header, width);
+	PngChunkWriter::writeU32(header, height);
+	// compression, filter and interlace methods are 0
+	header.insert(header.end(), { bitDepth, colourType, 0, 0, 0 });
+	out.writeChunk("IHDR", header);
+	if (colourType == 3)
+		out.writeChunk("PLTE", options.palette);
+	for (size_t pos = 0; pos < zlibData.size(); pos += maxIDATLength)
+	{
+		out.writeChunk("IDAT", std::span<const uint8_t>(zlibData).subspan(pos,
+			std::min(maxIDATLength, zlibData.size() - pos)));
+	}
+	out.writeChunk("IEND", {});
+	return res;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <span>
+
+#include "pixels.h"
+#include "threadpool.h"
+
+struct EncodeOptions
+{
+	// deflate level, 0 only stores data, 9 compresses best
+	int level = 6;
+	// filter type used for every row, or -1 to pick one per row by the
+	// minimum sum of absolute differences. Palette images use filter type 0
+	// unless filter is set
+	int filter = -1;
+	// if set, bands of rows are filtered and compressed on threads of the pool
+	ThreadPool* threadPool = nullptr;
+	// RGB triples of up to 256 entries, needed for PaletteIndex pixels
+	std::vector<uint8_t> palette;
+};
+
+// encodes pixels of format as a png: Rgba8 and Bgra8 as 8-bit RGBA, Rgb8 as
+// RGB, Grey8 as greyscale, Rgba16 as 16-bit RGBA and PaletteIndex as palette
+// image. Row y starts at pixels + y * stride, stride 0 means rows follow
+// each other without gaps
+std::vector<uint8_t> encodePng(std::span<const uint8_t> pixels, uint32_t width, uint32_t height,
+	Pixels::Format format, size_t stride = 0, const EncodeOptions& options = EncodeOptions());
@@ -0,0 +1,59 @@
+#include "error.h"
+
+#include <new>
+
+const char* toString(PngErrorCode code)
+{
+	switch (code)
+	{
+	case PngErrorCode::Signature: return "signature";
+	case PngErrorCode::UnexpectedEnd: return "unexpected end";
+	case PngErrorCode::ChunkOrder: return "chunk order";
+	case PngErrorCode::Crc: return "crc";
+	case PngErrorCode::Header: return "header";
+	case PngErrorCode::Palette: return "palette";
+	case PngErrorCode::Filter: return "filter";
+	case PngErrorCode::Deflate: return "deflate";
+	case PngErrorCode::Adler32: return "adler-32";
+	case PngErrorCode::ImageDataSize: return "image data size";
+	case PngErrorCode::Limit: return "limit";
+	case PngErrorCode::InvalidArgument: return "invalid argument";
+	case PngErrorCode::Io: return "io";
+	case PngErrorCode::OutOfMemory: return "out of memory";
+	case PngErrorCode::Internal: return "internal";
+	}
+	return "unknown";
+}
+
+std::string toString(const PngError& error)
+{
+	std::string res = std::string(toString(error.code())) + ": " + error.what();
+	if (error.hasOffset())
+		res += " at offset " + std::to_string(error.offset());
+	return res;
+}
+
+void throwPngError(PngErrorCode code, const char* message, uint64_t offset)
+{
+	throw PngError(code, message, offset);
+}
+
+PngError toPngError(std::exception_ptr e) noexcept
+{
+	try
+	{
+		std::rethrow_exception(e);
+	}
+	catch (const PngError& error)
+	{
+		return error;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return PngError(PngErrorCode::OutOfMemory, "out of memory");
+	}
+	catch (...)
+	{
+		return PngError(PngErrorCode::Internal, "unexpected exception");
+	}
+}
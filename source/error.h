@@ -0,0 +1,140 @@
+#pragma once
+
+#include <cstdint>
+#include <exception>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+// kinds of errors reported by the decoder and the encoder
+enum class PngErrorCode : uint8_t
+{
+	// the file doesn't start with the png signature
+	Signature,
+	// input ends inside a chunk or before the image data is complete
+	UnexpectedEnd,
+	// chunks are missing, repeated or out of order
+	ChunkOrder,
+	Crc,
+	// a field of IHDR has an invalid value
+	Header,
+	Palette,
+	// a scanline has an unknown filter type
+	Filter,
+	// malformed zlib header or deflate stream
+	Deflate,
+	Adler32,
+	// image data inflates to more or fewer bytes than IHDR implies
+	ImageDataSize,
+	// the image exceeds a limit of the decoder
+	Limit,
+	// a buffer, option or index passed by the caller doesn't fit the image
+	InvalidArgument,
+	// a file couldn't be opened, read or written
+	Io,
+	OutOfMemory,
+	// anything else thrown while decoding, a bug of the decoder
+	Internal
+};
+
+// short name of the code, e.g. "crc"
+const char* toString(PngErrorCode code);
+
+// thrown by the decoder and the encoder. message is a string literal, so
+// that throwing doesn't allocate
+class PngError : public std::exception
+{
+public:
+	// offset of an error not tied to a position in the input
+	static constexpr uint64_t unknownOffset = ~static_cast<uint64_t>(0);
+
+	PngError(PngErrorCode pCode, const char* pMessage, uint64_t pOffset = unknownOffset)
+		: errorCode(pCode), errorMessage(pMessage), errorOffset(pOffset) {}
+
+	PngErrorCode code() const { return errorCode; }
+	const char* what() const noexcept override { return errorMessage; }
+	// offset from the start of the input where the error was detected, for
+	// errors in image data the end of the data consumed so far
+	uint64_t offset() const { return errorOffset; }
+	bool hasOffset() const { return errorOffset != unknownOffset; }
+	void setOffset(uint64_t offset) { errorOffset = offset; }
+private:
+	PngErrorCode errorCode;
+	const char* errorMessage;
+	uint64_t errorOffset;
+};
+
+// code, message and offset of error for messages, e.g.
+// "crc: crc mismatch at offset 1234"
+std::string toString(const PngError& error);
+
+// throws PngError. Kept out of line, so that checks in hot loops compile
+// to a compare and a rarely taken call
+[[noreturn]] void throwPngError(PngErrorCode code, const char* message,
+	uint64_t offset = PngError::unknownOffset);
+
+// either a value or the error that prevented computing it, returned by
+// the functions of the no-throw api
+template<typename T>
+class Result
+{
+public:
+	Result(T value) : state(std::in_place_index<0>, std::move(value)) {}
+	Result(const PngError& error) : state(std::in_place_index<1>, error) {}
+
+	bool ok() const { return state.index() == 0; }
+	explicit operator bool() const { return ok(); }
+	// only if ok
+	T& value() { return *std::get_if<0>(&state); }
+	const T& value() const { return *std::get_if<0>(&state); }
+	T& operator*() { return value(); }
+	const T& operator*() const { return value(); }
+	T* operator->() { return &value(); }
+	const T* operator->() const { return &value(); }
+	// only if not ok
+	const PngError& error() const { return *std::get_if<1>(&state); }
+private:
+	std::variant<T, PngError> state;
+};
+
+// result of an operation without a value
+template<>
+class Result<void>
+{
+public:
+	Result() = default;
+	Result(const PngError& pError) : failed(true), err(pError) {}
+
+	bool ok() const { return !failed; }
+	explicit operator bool() const { return ok(); }
+	// only if not ok
+	const PngError& error() const { return err; }
+private:
+	bool failed = false;
+	PngError err{ PngErrorCode::Internal, "" };
+};
+
+// the PngError of an exception, bad_alloc becomes OutOfMemory and
+// anything else Internal
+PngError toPngError(std::exception_ptr e) noexcept;
+
+// runs f, converting anything it throws into the error of a Result
+template<typename F>
+auto catchPngError(F&& f) noexcept -> Result<decltype(f())>
+{
+	try
+	{
+		if constexpr (std::is_void_v<decltype(f())>)
+		{
+			f();
+			return {};
+		}
+		else
+			return f();
+	}
+	catch (...)
+	{
+		return toPngError(std::current_exception());
+	}
+}
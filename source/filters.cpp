@@ -0,0 +1,411 @@
+#include "filters.h"
+#include "cpu.h"
+
+#include <cstring>
+
+#ifdef PNG_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+	int16_t abs(int16_t a)
+	{
+		if (a < 0)
+			return -a;
+		else
+			return a;
+	}
+
+	uint8_t paethPredictor(uint8_t a, uint8_t b, uint8_t c)
+	{
+		int16_t pa = abs(b - c);
+		int16_t pb = abs(a - c);
+		int16_t pc = abs(a + b - 2 * c);
+		if (pa <= pb && pa <= pc)
+			return a;
+		else if (pb <= pc)
+			return b;
+		else
+			return c;
+	}
+
+	void reconstructNone(const uint8_t* filtered, uint8_t* line, const uint8_t*, size_t len)
+	{
+		if (filtered != line)
+			std::memcpy(line, filtered, len);
+	}
+
+	template<size_t bpp>
+	void reconstructSubScalar(const uint8_t* filtered, uint8_t* line, const uint8_t*, size_t len)
+	{
+		size_t i = 0;
+		for (; i < bpp && i < len; i++)
+			line[i] = filtered[i];
+		for (; i < len; i++)
+			line[i] = filtered[i] + line[i - bpp];
+	}
+
+#ifndef PNG_SSE2
+	void reconstructUpScalar(const uint8_t* filtered, uint8_t* line, const uint8_t* prevLine, size_t len)
+	{
+		for (size_t i = 0; i < len; i++)
+			line[i] = filtered[i] + prevLine[i];
+	}
+#endif
+
+	template<size_t bpp>
+	void reconstructAverageScalar(const uint8_t* filtered, uint8_t* line, const uint8_t* prevLine, size_t len)
+	{
+		size_t i = 0;
+		for (; i < bpp && i < len; i++)
+			line[i] = filtered[i] + prevLine[i] / 2;
+		for (; i < len; i++)
+			line[i] = filtered[i] + (line[i - bpp] + prevLine[i]) / 2;
+	}
+
+	template<size_t bpp>
+	void reconstructPaethScalar(const uint8_t* filtered, uint8_t* line, const uint8_t* prevLine, size_t len)
+	{
+		size_t i = 0;
+		for (; i < bpp && i < len; i++)
+			line[i] = filtered[i] + prevLine[i];
+		for (; i < len; i++)
+			line[i] = filtered[i] + paethPredictor(line[i - bpp], prevLine[i], prevLine[i - bpp]);
+	}
+
+#ifdef PNG_SSE2
+	// pixels of 3 to 8 bytes are processed one at a time in the low bytes
+	// of a register, the same way libpng does it for 3 and 4 bytes
+	template<size_t bpp>
+	__m128i loadPixel(const uint8_t* p)
+	{
+		uint8_t temp[8] = {};
+		std::memcpy(temp, p, bpp);
+		return _mm_loadl_epi64(reinterpret_cast<const __m128i*>(temp));
+	}
+
+	template<size_t bpp>
+	void storePixel(uint8_t* p, __m128i v)
+	{
+		uint8_t temp[8];
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(temp), v);
+		std::memcpy(p, temp, bpp);
+	}
+
+	// copies last pixel of v to all pixels, bpp must divide 16
+	template<size_t bpp>
+	__m128i broadcastLastPixel(__m128i v)
+	{
+		if constexpr (bpp == 1)
+			v = _mm_unpackhi_epi8(v, v);
+		if constexpr (bpp <= 2)
+			v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(3, 3, 3, 3));
+		if constexpr (bpp <= 4)
+			return _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 3));
+		else
+			return _mm_unpackhi_epi64(v, v);
+	}
+
+	// prefix sums of 16 bytes with stride bpp, then adds the last
+	// pixel of the previous 16 bytes
+	template<size_t bpp>
+	void reconstructSubSse2(const uint8_t* filtered, uint8_t* line, const uint8_t*, size_t len)
+	{
+		__m128i carry = _mm_setzero_si128();
+		size_t i = 0;
+		for (; i + 16 <= len; i += 16)
+		{
+			__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(filtered + i));
+			x = _mm_add_epi8(x, _mm_slli_si128(x, bpp));
+			if constexpr (2 * bpp < 16)
+				x = _mm_add_epi8(x, _mm_slli_si128(x, 2 * bpp));
+			if constexpr (4 * bpp < 16)
+				x = _mm_add_epi8(x, _mm_slli_si128(x, 4 * bpp));
+			if constexpr (8 * bpp < 16)
+				x = _mm_add_epi8(x, _mm_slli_si128(x, 8 * bpp));
+			x = _mm_add_epi8(x, carry);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(line + i), x);
+			carry = broadcastLastPixel<bpp>(x);
+		}
+		if (i == 0)
+		{
+			reconstructSubScalar<bpp>(filtered, line, nullptr, len);
+			return;
+		}
+		for (; i < len; i++)
+			line[i] = filtered[i] + line[i - bpp];
+	}
+
+	// for pixel sizes that don't divide 16
+	template<size_t bpp>
+	void reconstructSubPixelSse2(const uint8_t* filtered, uint8_t* line, const uint8_t*, size_t len)
+	{
+		__m128i a = _mm_setzero_si128();
+		for (size_t i = 0; i + bpp <= len; i += bpp)
+		{
+			a = _mm_add_epi8(a, loadPixel<bpp>(filtered + i));
+			storePixel<bpp>(line + i, a);
+		}
+	}
+
+	void reconstructUpSse2(const uint8_t* filtered, uint8_t* line, const uint8_t* prevLine, size_t len)
+	{
+		size_t i = 0;
+		for (; i + 16 <= len; i += 16)
+		{
+			__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(filtered + i));
+			__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prevLine + i));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(line + i), _mm_add_epi8(x, b));
+		}
+		for (; i < len; i++)
+			line[i] = filtered[i] + prevLine[i];
+	}
+
+	template<size_t bpp>
+	void reconstructAverageSse2(const uint8_t* filtered, uint8_t* line, const uint8_t* prevLine, size_t len)
+	{
+		const __m128i one = _mm_set1_epi8(1);
+		__m128i a = _mm_setzero_si128();
+		for (size_t i = 0; i + bpp <= len; i += bpp)
+		{
+			__m128i b = loadPixel<bpp>(prevLine + i);
+			// _mm_avg_epu8 rounds up, average must be rounded down
+			__m128i avg = _mm_avg_epu8(a, b);
+			avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b), one));
+			a = _mm_add_epi8(loadPixel<bpp>(filtered + i), avg);
+			storePixel<bpp>(line + i, a);
+		}
+	}
+
+	__m128i abs16(__m128i x)
+	{
+		__m128i isNegative = _mm_cmplt_epi16(x, _mm_setzero_si128());
+		x = _mm_xor_si128(x, isNegative);
+		return _mm_add_epi16(x, _mm_srli_epi16(isNegative, 15));
+	}
+
+	__m128i ifThenElse(__m128i cond, __m128i t, __m128i e)
+	{
+		return _mm_or_si128(_mm_and_si128(cond, t), _mm_andnot_si128(cond, e));
+	}
+
+	// predictor is computed in 16-bit lanes, so 8-byte pixels still fit
+	template<size_t bpp>
+	void reconstructPaethSse2(const uint8_t* filtered, uint8_t* line, const uint8_t* prevLine, size_t len)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		__m128i a = zero;
+		__m128i c = zero;
+		__m128i d = zero;
+		for (size_t i = 0; i + bpp <= len; i += bpp)
+		{
+			__m128i b = _mm_unpacklo_epi8(loadPixel<bpp>(prevLine + i), zero);
+			__m128i x = loadPixel<bpp>(filtered + i);
+
+			// p = a + b - c, so p - a = b - c, p - b = a - c, p - c = pa + pb
+			__m128i pa = _mm_sub_epi16(b, c);
+			__m128i pb = _mm_sub_epi16(a, c);
+			__m128i pc = _mm_add_epi16(pa, pb);
+			pa = abs16(pa);
+			pb = abs16(pb);
+			pc = abs16(pc);
+			__m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+			// ties are broken in favour of a, then b
+			__m128i nearest = ifThenElse(_mm_cmpeq_epi16(smallest, pa), a,
+				ifThenElse(_mm_cmpeq_epi16(smallest, pb), b, c));
+
+			d = _mm_add_epi8(x, _mm_packus_epi16(nearest, nearest));
+			storePixel<bpp>(line + i, d);
+			a = _mm_unpacklo_epi8(d, zero);
+			c = b;
+		}
+	}
+#endif
+
+#ifndef PNG_SSE2
+	template<size_t bpp>
+	constexpr std::array<Filters::Kernel, 5> scalarKernels = {
+		reconstructNone, reconstructSubScalar<bpp>, reconstructUpScalar,
+		reconstructAverageScalar<bpp>, reconstructPaethScalar<bpp> };
+#else
+	// sub is vectorized across pixels for sizes dividing 16, average and
+	// paeth depend on the previous pixel and only gain for wider pixels
+	template<size_t bpp>
+	constexpr std::array<Filters::Kernel, 5> sse2Kernels = {
+		reconstructNone,
+		(16 % bpp == 0) ? reconstructSubSse2<(16 % bpp == 0) ? bpp : 1> : reconstructSubPixelSse2<bpp>,
+		reconstructUpSse2,
+		(bpp >= 3) ? reconstructAverageSse2<bpp> : reconstructAverageScalar<bpp>,
+		(bpp >= 3) ? reconstructPaethSse2<bpp> : reconstructPaethScalar<bpp> };
+#endif
+}
+
+namespace
+{
+	// predictions of the filter types for encoding, a is the byte of the
+	// previous pixel, b the one above, c the one above the previous pixel
+	uint8_t predict(uint8_t type, uint8_t a, uint8_t b, uint8_t c)
+	{
+		switch (type)
+		{
+		case 1:
+			return a;
+		case 2:
+			return b;
+		case 3:
+			return static_cast<uint8_t>((a + b) / 2);
+		case 4:
+			return paethPredictor(a, b, c);
+		default:
+			return 0;
+		}
+	}
+
+#ifdef PNG_SSE2
+	__m128i predictAverageSse2(__m128i a, __m128i b)
+	{
+		__m128i avg = _mm_avg_epu8(a, b);
+		return _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+	}
+
+	// 16 predictions at once, unlike reconstruction filtering has no
+	// dependency on the previous pixel's result
+	__m128i predictPaethSse2(__m128i a8, __m128i b8, __m128i c8)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		__m128i res[2];
+		for (int half = 0; half < 2; half++)
+		{
+			__m128i a = half ? _mm_unpackhi_epi8(a8, zero) : _mm_unpacklo_epi8(a8, zero);
+			__m128i b = half ? _mm_unpackhi_epi8(b8, zero) : _mm_unpacklo_epi8(b8, zero);
+			__m128i c = half ? _mm_unpackhi_epi8(c8, zero) : _mm_unpacklo_epi8(c8, zero);
+			__m128i pa = _mm_sub_epi16(b, c);
+			__m128i pb = _mm_sub_epi16(a, c);
+			__m128i pc = abs16(_mm_add_epi16(pa, pb));
+			pa = abs16(pa);
+			pb = abs16(pb);
+			__m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+			res[half] = ifThenElse(_mm_cmpeq_epi16(smallest, pa), a,
+				ifThenElse(_mm_cmpeq_epi16(smallest, pb), b, c));
+		}
+		return _mm_packus_epi16(res[0], res[1]);
+	}
+
+	__m128i predictSse2(uint8_t type, __m128i a, __m128i b, __m128i c)
+	{
+		switch (type)
+		{
+		case 1:
+			return a;
+		case 2:
+			return b;
+		case 3:
+			return predictAverageSse2(a, b);
+		case 4:
+			return predictPaethSse2(a, b, c);
+		default:
+			return _mm_setzero_si128();
+		}
+	}
+
+	// sums absolute values of signed bytes into the two 64-bit halves
+	__m128i sumAbsSse2(__m128i x)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		return _mm_sad_epu8(_mm_min_epu8(x, _mm_sub_epi8(zero, x)), zero);
+	}
+
+	__m128i loadu(const uint8_t* p)
+	{
+		return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+	}
+#endif
+}
+
+void Filters::filterLine(uint8_t type, const uint8_t* line, const uint8_t* prevLine, uint8_t* filtered,
+	size_t len, size_t bytesPerPixel)
+{
+	size_t i = 0;
+#ifdef PNG_SSE2
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i prediction = predictSse2(type, loadu(line + i - bytesPerPixel), loadu(prevLine + i),
+			loadu(prevLine + i - bytesPerPixel));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(filtered + i), _mm_sub_epi8(loadu(line + i), prediction));
+	}
+#endif
+	for (; i < len; i++)
+		filtered[i] = line[i] - predict(type, line[i - bytesPerPixel], prevLine[i], prevLine[i - bytesPerPixel]);
+}
+
+uint8_t Filters::chooseFilter(const uint8_t* line, const uint8_t* prevLine, size_t len, size_t bytesPerPixel)
+{
+	std::array<uint64_t, 5> sums{};
+	size_t i = 0;
+#ifdef PNG_SSE2
+	// all filter types in a single pass over the scanline
+	__m128i vectorSums[5];
+	for (__m128i& sum : vectorSums)
+		sum = _mm_setzero_si128();
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i x = loadu(line + i);
+		__m128i a = loadu(line + i - bytesPerPixel);
+		__m128i b = loadu(prevLine + i);
+		__m128i c = loadu(prevLine + i - bytesPerPixel);
+		vectorSums[0] = _mm_add_epi64(vectorSums[0], sumAbsSse2(x));
+		vectorSums[1] = _mm_add_epi64(vectorSums[1], sumAbsSse2(_mm_sub_epi8(x, a)));
+		vectorSums[2] = _mm_add_epi64(vectorSums[2], sumAbsSse2(_mm_sub_epi8(x, b)));
+		vectorSums[3] = _mm_add_epi64(vectorSums[3], sumAbsSse2(_mm_sub_epi8(x, predictAverageSse2(a, b))));
+		vectorSums[4] = _mm_add_epi64(vectorSums[4], sumAbsSse2(_mm_sub_epi8(x, predictPaethSse2(a, b, c))));
+	}
+	for (size_t type = 0; type < sums.size(); type++)
+	{
+		uint64_t halves[2];
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(halves), vectorSums[type]);
+		sums[type] = halves[0] + halves[1];
+	}
+#endif
+	for (; i < len; i++)
+	{
+		for (uint8_t type = 0; type < sums.size(); type++)
+		{
+			int8_t d = static_cast<int8_t>(line[i] - predict(type, line[i - bytesPerPixel], prevLine[i],
+				prevLine[i - bytesPerPixel]));
+			sums[type] += static_cast<uint64_t>(d < 0 ? -d : d);
+		}
+	}
+	uint8_t best = 0;
+	for (uint8_t type = 1; type < sums.size(); type++)
+	{
+		if (sums[type] < sums[best])
+			best = type;
+	}
+	return best;
+}
+
+const std::array<Filters::Kernel, 5>& Filters::getKernels(size_t bytesPerPixel)
+{
+#ifdef PNG_SSE2
+#define PNG_FILTER_KERNELS sse2Kernels
+#else
+#define PNG_FILTER_KERNELS scalarKernels
+#endif
+	switch (bytesPerPixel)
+	{
+	case 1:
+		return PNG_FILTER_KERNELS<1>;
+	case 2:
+		return PNG_FILTER_KERNELS<2>;
+	case 3:
+		return PNG_FILTER_KERNELS<3>;
+	case 4:
+		return PNG_FILTER_KERNELS<4>;
+	case 6:
+		return PNG_FILTER_KERNELS<6>;
+	default:
+		return PNG_FILTER_KERNELS<8>;
+	}
+#undef PNG_FILTER_KERNELS
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+
+// reconstruction of filtered scanlines and filtering them for encoding
+namespace Filters
+{
+	// reconstructs len bytes of a scanline from filtered bytes and the
+	// previous reconstructed scanline (all zeros for the first one).
+	// filtered may be the same as line to reconstruct in place
+	using Kernel = void (*)(const uint8_t* filtered, uint8_t* line, const uint8_t* prevLine, size_t len);
+
+	// returns kernels indexed by filter type, specialized for the distance
+	// between corresponding bytes of neighbouring pixels (1, 2, 3, 4, 6 or 8)
+	const std::array<Kernel, 5>& getKernels(size_t bytesPerPixel);
+
+	// applies filter type to len bytes of a scanline for encoding. line and
+	// prevLine must be preceded by bytesPerPixel readable zero bytes, which
+	// stand for the pixels left of the image
+	void filterLine(uint8_t type, const uint8_t* line, const uint8_t* prevLine, uint8_t* filtered,
+		size_t len, size_t bytesPerPixel);
+
+	// picks the filter type whose output has the minimum sum of absolute
+	// differences, taking filtered bytes as signed. Same requirements as
+	// filterLine
+	uint8_t chooseFilter(const uint8_t* line, const uint8_t* prevLine, size_t len, size_t bytesPerPixel);
+}
@@ -0,0 +1,76 @@
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <span>
+#include <vector>
+
+#include "decoder.h"
+
+// png_fuzz, a libFuzzer target: cmake -DPNG_FUZZ=ON -DCMAKE_CXX_COMPILER=clang++
+//
+// decodes every input the way a service taking untrusted uploads would,
+// with limits small enough that no input can take much memory or time.
+// The first byte picks the decode mode, output format, thumbnail scale and
+// colour adjustments, the rest is the png. Both the buffered and the
+// streaming decode must agree on the result, a thumbnail of a decodable
+// image must decode too, and a failed decode must leave the decoder usable
+
+namespace
+{
+	DecodeLimits fuzzLimits()
+	{
+		DecodeLimits limits;
+		limits.maxPixels = 1 << 20;
+		limits.maxInflatedBytes = 1 << 24;
+		limits.maxChunkCount = 1 << 12;
+		limits.maxAncillaryBytes = 1 << 20;
+		return limits;
+	}
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+	if (size == 0)
+		return 0;
+	const uint8_t mode = data[0];
+	std::span<const uint8_t> in(data + 1, size - 1);
+
+	// reused, like in a service decoding one upload after another
+	static PngDecoder decoder;
+	static std::vector<uint8_t> image;
+	static std::vector<uint8_t> streamedImage;
+	static std::vector<uint8_t> thumbnail;
+
+	DecodeOptions options;
+	options.limits = fuzzLimits();
+	options.skipAdler32 = (mode & 1) != 0;
+	options.format = static_cast<Pixels::Format>(((mode >> 2) & 15) % 6);
+	options.colour.significantBits = (mode & 64) != 0;
+	options.colour.screenGamma = (mode & 128) != 0 ? 2.2 : 0;
+
+	Result<PngInfo> info = tryProbePng(in, (mode & 2) != 0);
+
+	uint32_t width, height;
+	Result<void> buffered = decoder.tryDecode(in, image, width, height, options);
+	options.streaming = true;
+	uint32_t streamedWidth, streamedHeight;
+	Result<void> streamed = decoder.tryDecode(in, streamedImage, streamedWidth, streamedHeight, options);
+
+	if (buffered.ok() != streamed.ok())
+		std::abort();
+	if (buffered.ok() && (width != streamedWidth || height != streamedHeight || image != streamedImage))
+		std::abort();
+	// a decodable image always has a readable chunk table. Crc of skipped
+	// ancillary chunks isn't checked by decoding, so only without crc checks
+	if (buffered.ok() && (mode & 2) != 0 && !info.ok())
+		std::abort();
+
+	// reads less of the image data, so it can only fail where the full decode does
+	options.scale = 2u << (((mode >> 2) & 15) / 6);
+	uint32_t thumbnailWidth, thumbnailHeight;
+	Result<void> scaled = decoder.tryDecode(in, thumbnail, thumbnailWidth, thumbnailHeight, options);
+	if (buffered.ok() && (!scaled.ok() || thumbnailWidth != (width + options.scale - 1) / options.scale
+		|| thumbnailHeight != (height + options.scale - 1) / options.scale))
+		std::abort();
+	return 0;
+}
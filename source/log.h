@@ -0,0 +1,11 @@
+#pragma once
+
+// diagnostic messages of the decoder, compiled out unless PNG_LOGGING is
+// defined, so that they cost nothing by default. message may chain
+// several values with <<
+#ifdef PNG_LOGGING
+#include <iostream>
+#define PNG_LOG(message) (std::clog << message << std::endl)
+#else
+#define PNG_LOG(message) ((void)0)
+#endif
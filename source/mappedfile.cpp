@@ -0,0 +1,99 @@
+#include "mappedfile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string& filename)
+{
+	file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		file = nullptr;
+		return;
+	}
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize))
+		return;
+	size = static_cast<size_t>(fileSize.QuadPart);
+	opened = true;
+	// empty files can't be mapped
+	if (size == 0)
+		return;
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping == nullptr)
+	{
+		opened = false;
+		return;
+	}
+	ptr = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+	if (ptr == nullptr)
+		opened = false;
+}
+
+MappedFile::~MappedFile()
+{
+	if (ptr != nullptr)
+		UnmapViewOfFile(ptr);
+	if (mapping != nullptr)
+		CloseHandle(mapping);
+	if (file != nullptr)
+		CloseHandle(file);
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& filename)
+{
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd == -1)
+		return;
+	struct stat st;
+	if (fstat(fd, &st) == 0)
+	{
+		size = static_cast<size_t>(st.st_size);
+		opened = true;
+		// empty files can't be mapped
+		if (size != 0)
+		{
+			void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p == MAP_FAILED)
+				opened = false;
+			else
+			{
+				ptr = static_cast<const uint8_t*>(p);
+				madvise(p, size, MADV_SEQUENTIAL);
+			}
+		}
+	}
+	// the mapping stays valid after the descriptor is closed
+	close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+	if (ptr != nullptr)
+		munmap(const_cast<uint8_t*>(ptr), size);
+}
+
+#endif
+
+bool MappedFile::isOpen() const
+{
+	return opened;
+}
+
+std::span<const uint8_t> MappedFile::data() const
+{
+	return std::span<const uint8_t>(ptr, opened ? size : 0);
+}
@@ -0,0 +1,440 @@
+#include "pixels.h"
+#include "cpu.h"
+#include "error.h"
+
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <type_traits>
+
+#ifdef PNG_X86
+#include <immintrin.h>
+#endif
+
+namespace
+{
+	constexpr size_t getSamplesPerPixel(uint8_t colourType)
+	{
+		if (colourType == 0 || colourType == 3) // greyscale or palette
+			return 1;
+		else if (colourType == 4) // greyscale with alpha
+			return 2;
+		else if (colourType == 2) // truecolour
+			return 3;
+		else // truecolour with alpha
+			return 4;
+	}
+
+	// returns sample with given index as 8-bit value. Samples of less than
+	// 8 bits are packed starting from the most significant bit, 16-bit ones
+	// are stored MSB first and truncated
+	template<uint8_t bitDepth, bool scale>
+	uint8_t getSample(const uint8_t* byteLine, uint32_t index)
+	{
+		if constexpr (bitDepth == 8)
+			return byteLine[index];
+		else if constexpr (bitDepth == 16)
+			return byteLine[index * 2];
+		else
+		{
+			constexpr uint8_t mask = (1 << bitDepth) - 1;
+			uint32_t bitPos = index * bitDepth;
+			uint8_t sample = (byteLine[bitPos / 8] >> (8 - bitDepth - bitPos % 8)) & mask;
+			// replicating bits maps the full range of samples to 0-255
+			if constexpr (scale)
+				return sample * (255 / mask);
+			else
+				return sample;
+		}
+	}
+
+	// returns sample with given index scaled to the range of Sample
+	template<uint8_t bitDepth, typename Sample>
+	Sample getScaledSample(const uint8_t* byteLine, uint32_t index)
+	{
+		if constexpr (sizeof(Sample) == 1)
+			return getSample<bitDepth, true>(byteLine, index);
+		else if constexpr (bitDepth == 16)
+			return static_cast<Sample>((byteLine[index * 2] << 8) | byteLine[index * 2 + 1]);
+		else
+			return static_cast<Sample>(getSample<bitDepth, true>(byteLine, index) * 257);
+	}
+
+	// returns sample with given index as stored, e.g. to compare it with
+	// the colour key
+	template<uint8_t bitDepth>
+	uint16_t getRawSample(const uint8_t* byteLine, uint32_t index)
+	{
+		if constexpr (bitDepth == 16)
+			return static_cast<uint16_t>((byteLine[index * 2] << 8) | byteLine[index * 2 + 1]);
+		else
+			return getSample<bitDepth, false>(byteLine, index);
+	}
+
+	// alpha of a pixel without alpha channel, transparent if all samples
+	// match the colour key
+	template<uint8_t colourType, uint8_t bitDepth, bool colourKey, typename Sample>
+	Sample getKeyedAlpha(const uint8_t* byteLine, uint32_t s, const Pixels::Tables& tables)
+	{
+		constexpr Sample opaque = static_cast<Sample>(~Sample(0));
+		if constexpr (!colourKey)
+			return opaque;
+		else if constexpr (colourType == 0)
+			return getRawSample<bitDepth>(byteLine, s) == tables.colourKey[0] ? 0 : opaque;
+		else
+		{
+			// compared all at once, so that there is a single select
+			bool transparent = (getRawSample<bitDepth>(byteLine, s) == tables.colourKey[0])
+				& (getRawSample<bitDepth>(byteLine, s + 1) == tables.colourKey[1])
+				& (getRawSample<bitDepth>(byteLine, s + 2) == tables.colourKey[2]);
+			return transparent ? 0 : opaque;
+		}
+	}
+
+	template<uint8_t colourType, uint8_t bitDepth, bool colourKey, typename Sample>
+	void loadPixel(const uint8_t* byteLine, uint32_t index, const Pixels::Tables& tables,
+		Sample& r, Sample& g, Sample& b, Sample& a)
+	{
+		constexpr uint32_t samplesPerPixel = getSamplesPerPixel(colourType);
+		constexpr Sample scale = sizeof(Sample) == 1 ? 1 : 257;
+		uint32_t s = index * samplesPerPixel;
+		if constexpr (colourType == 3) // palette
+		{
+			const uint8_t* entry = &tables.palette[getSample<bitDepth, false>(byteLine, s) * 4];
+			r = entry[0] * scale; g = entry[1] * scale; b = entry[2] * scale;
+			a = entry[3] * scale;
+		}
+		else if constexpr (colourType == 0 || colourType == 4) // greyscale, with or without alpha
+		{
+			r = g = b = getScaledSample<bitDepth, Sample>(byteLine, s);
+			if constexpr (colourType == 4)
+				a = getScaledSample<bitDepth, Sample>(byteLine, s + 1);
+			else
+				a = getKeyedAlpha<colourType, bitDepth, colourKey, Sample>(byteLine, s, tables);
+		}
+		else // truecolour, with or without alpha
+		{
+			r = getScaledSample<bitDepth, Sample>(byteLine, s);
+			g = getScaledSample<bitDepth, Sample>(byteLine, s + 1);
+			b = getScaledSample<bitDepth, Sample>(byteLine, s + 2);
+			if constexpr (colourType == 6)
+				a = getScaledSample<bitDepth, Sample>(byteLine, s + 3);
+			else
+				a = getKeyedAlpha<colourType, bitDepth, colourKey, Sample>(byteLine, s, tables);
+		}
+	}
+
+	template<Pixels::Format format, typename Sample>
+	void storePixel(uint8_t* dest, Sample r, Sample g, Sample b, Sample a)
+	{
+		if constexpr (format == Pixels::Format::Rgba8)
+		{
+			dest[0] = r; dest[1] = g; dest[2] = b; dest[3] = a;
+		}
+		else if constexpr (format == Pixels::Format::Bgra8)
+		{
+			dest[0] = b; dest[1] = g; dest[2] = r; dest[3] = a;
+		}
+		else if constexpr (format == Pixels::Format::Rgb8)
+		{
+			dest[0] = r; dest[1] = g; dest[2] = b;
+		}
+		else if constexpr (format == Pixels::Format::Grey8)
+			dest[0] = static_cast<uint8_t>((r * 77 + g * 150 + b * 29 + 128) >> 8);
+		else // Rgba16
+		{
+			uint16_t pixel[4] = { r, g, b, a };
+			std::memcpy(dest, pixel, sizeof(pixel));
+		}
+	}
+
+	// colourKey makes pixels matching tables.colourKey transparent,
+	// mapSamples looks up every sample in the sample maps of tables
+	template<uint8_t colourType, uint8_t bitDepth, Pixels::Format format = Pixels::Format::Rgba8,
+		bool colourKey = false, bool mapSamples = false>
+	void convertLine(const uint8_t* byteLine, uint8_t* dest, uint32_t width, const Pixels::Tables& tables)
+	{
+		using Sample = std::conditional_t<format == Pixels::Format::Rgba16, uint16_t, uint8_t>;
+		constexpr size_t pixelSize = Pixels::getPixelSize(format);
+		constexpr size_t mapSize = static_cast<size_t>(1) << (sizeof(Sample) * 8);
+		const Sample* map = nullptr;
+		if constexpr (mapSamples)
+		{
+			if constexpr (sizeof(Sample) == 1)
+				map = tables.samples8.data();
+			else
+				map = tables.samples16.data();
+		}
+		for (uint32_t i = 0; i < width; i++)
+		{
+			if constexpr (format == Pixels::Format::PaletteIndex)
+				dest[0] = getSample<bitDepth, false>(byteLine, i);
+			else
+			{
+				Sample r, g, b, a;
+				loadPixel<colourType, bitDepth, colourKey>(byteLine, i, tables, r, g, b, a);
+				if constexpr (mapSamples)
+				{
+					r = map[r];
+					g = map[mapSize + g];
+					b = map[2 * mapSize + b];
+					a = map[3 * mapSize + a];
+				}
+				storePixel<format>(dest, r, g, b, a);
+			}
+			dest += pixelSize;
+		}
+	}
+
+	// for scanlines already in the output format
+	template<size_t pixelSize>
+	void copyLine(const uint8_t* byteLine, uint8_t* dest, uint32_t width, const Pixels::Tables&)
+	{
+		std::memcpy(dest, byteLine, static_cast<size_t>(width) * pixelSize);
+	}
+
+#ifdef PNG_SSE2
+	void convertGrey8Sse2(const uint8_t* byteLine, uint8_t* dest, uint32_t width, const Pixels::Tables& tables)
+	{
+		const __m128i opaque = _mm_set1_epi8(-1);
+		uint32_t i = 0;
+		for (; i + 16 <= width; i += 16)
+		{
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(byteLine + i));
+			// grey, grey pairs and grey, alpha pairs interleave to grey, grey, grey, alpha
+			__m128i greyGreyLo = _mm_unpacklo_epi8(v, v);
+			__m128i greyGreyHi = _mm_unpackhi_epi8(v, v);
+			__m128i greyAlphaLo = _mm_unpacklo_epi8(v, opaque);
+			__m128i greyAlphaHi = _mm_unpackhi_epi8(v, opaque);
+			__m128i* out = reinterpret_cast<__m128i*>(dest + i * 4);
+			_mm_storeu_si128(out, _mm_unpacklo_epi16(greyGreyLo, greyAlphaLo));
+			_mm_storeu_si128(out + 1, _mm_unpackhi_epi16(greyGreyLo, greyAlphaLo));
+			_mm_storeu_si128(out + 2, _mm_unpacklo_epi16(greyGreyHi, greyAlphaHi));
+			_mm_storeu_si128(out + 3, _mm_unpackhi_epi16(greyGreyHi, greyAlphaHi));
+		}
+		convertLine<0, 8>(byteLine + i, dest + i * 4, width - i, tables);
+	}
+#endif
+
+#ifdef PNG_X86
+	template<Pixels::Format format>
+	PNG_TARGET("ssse3")
+	void convertRgb8Ssse3(const uint8_t* byteLine, uint8_t* dest, uint32_t width, const Pixels::Tables& tables)
+	{
+		// spreads 4 pixels of 3 bytes to 4 bytes each, alpha bytes
+		// are zeroed and then set with or
+		const __m128i shuffle = format == Pixels::Format::Bgra8
+			? _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1)
+			: _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+		const __m128i alpha = _mm_set1_epi32(static_cast<int>(0xFF000000));
+		uint32_t i = 0;
+		// 16 bytes are loaded for 12 used, so the last pixels go to the scalar loop
+		for (; i + 6 <= width; i += 4)
+		{
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(byteLine + i * 3));
+			v = _mm_or_si128(_mm_shuffle_epi8(v, shuffle), alpha);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i * 4), v);
+		}
+		convertLine<2, 8, format>(byteLine + i * 3, dest + i * 4, width - i, tables);
+	}
+
+	PNG_TARGET("ssse3")
+	void convertRgba8ToBgra8Ssse3(const uint8_t* byteLine, uint8_t* dest, uint32_t width, const Pixels::Tables& tables)
+	{
+		const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+		uint32_t i = 0;
+		for (; i + 4 <= width; i += 4)
+		{
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(byteLine + i * 4));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i * 4), _mm_shuffle_epi8(v, shuffle));
+		}
+		convertLine<6, 8, Pixels::Format::Bgra8>(byteLine + i * 4, dest + i * 4, width - i, tables);
+	}
+
+	PNG_TARGET("avx2")
+	void convertPalette8Avx2(const uint8_t* byteLine, uint8_t* dest, uint32_t width, const Pixels::Tables& tables)
+	{
+		const int* lut = reinterpret_cast<const int*>(tables.palette.data());
+		uint32_t i = 0;
+		for (; i + 8 <= width; i += 8)
+		{
+			__m256i indices = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(byteLine + i)));
+			__m256i pixels = _mm256_i32gather_epi32(lut, indices, 4);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + i * 4), pixels);
+		}
+		convertLine<3, 8>(byteLine + i, dest + i * 4, width - i, tables);
+	}
+#endif
+
+	struct ConverterEntry
+	{
+		uint8_t colourType;
+		uint8_t bitDepth;
+		Pixels::Converter converter;
+	};
+
+	template<Pixels::Format format, bool colourKey, bool mapSamples>
+	constexpr std::array<ConverterEntry, 15> converters = { {
+		{ 0, 1, convertLine<0, 1, format, colourKey, mapSamples> },
+		{ 0, 2, convertLine<0, 2, format, colourKey, mapSamples> },
+		{ 0, 4, convertLine<0, 4, format, colourKey, mapSamples> },
+		{ 0, 8, convertLine<0, 8, format, colourKey, mapSamples> },
+		{ 0, 16, convertLine<0, 16, format, colourKey, mapSamples> },
+		{ 2, 8, convertLine<2, 8, format, colourKey, mapSamples> },
+		{ 2, 16, convertLine<2, 16, format, colourKey, mapSamples> },
+		// palette entries already have everything applied
+		{ 3, 1, convertLine<3, 1, format> }, { 3, 2, convertLine<3, 2, format> }, { 3, 4, convertLine<3, 4, format> },
+		{ 3, 8, convertLine<3, 8, format> },
+		{ 4, 8, convertLine<4, 8, format, false, mapSamples> }, { 4, 16, convertLine<4, 16, format, false, mapSamples> },
+		{ 6, 8, convertLine<6, 8, format, false, mapSamples> }, { 6, 16, convertLine<6, 16, format, false, mapSamples> } } };
+
+	template<Pixels::Format format>
+	const std::array<ConverterEntry, 15>& getConverters(bool colourKey, bool mapSamples)
+	{
+		if (colourKey)
+			return mapSamples ? converters<format, true, true> : converters<format, true, false>;
+		return mapSamples ? converters<format, false, true> : converters<format, false, false>;
+	}
+
+	const std::array<ConverterEntry, 15>& getConverters(Pixels::Format format, bool colourKey, bool mapSamples)
+	{
+		switch (format)
+		{
+		case Pixels::Format::Rgba8:
+			return getConverters<Pixels::Format::Rgba8>(colourKey, mapSamples);
+		case Pixels::Format::Bgra8:
+			return getConverters<Pixels::Format::Bgra8>(colourKey, mapSamples);
+		case Pixels::Format::Rgb8:
+			return getConverters<Pixels::Format::Rgb8>(false, mapSamples);
+		case Pixels::Format::Grey8:
+			return getConverters<Pixels::Format::Grey8>(false, mapSamples);
+		case Pixels::Format::Rgba16:
+			return getConverters<Pixels::Format::Rgba16>(colourKey, mapSamples);
+		case Pixels::Format::PaletteIndex:
+			return converters<Pixels::Format::PaletteIndex, false, false>;
+		}
+		throwPngError(PngErrorCode::InvalidArgument, "invalid pixel format");
+	}
+
+	// fills map with what each bits-bit output sample becomes: if it has
+	// fewer significant bits than both the bit depth and bits, the top
+	// significantBits of it are rescaled to the full range, then if
+	// exponent is positive, gamma correction is applied
+	template<typename Sample>
+	void fillSampleMap(Sample* map, uint32_t bits, uint8_t bitDepth, uint8_t significantBits, double exponent)
+	{
+		const uint32_t max = (1u << bits) - 1;
+		bool rescale = significantBits != 0 && significantBits < std::min<uint32_t>(bitDepth, bits);
+		for (uint32_t v = 0; v <= max; v++)
+		{
+			uint32_t value = v;
+			if (rescale)
+				value = static_cast<uint32_t>(static_cast<uint64_t>(v >> (bits - significantBits)) * max
+					/ ((1u << significantBits) - 1));
+			if (exponent > 0)
+				value = static_cast<uint32_t>(std::lround(max * std::pow(value / static_cast<double>(max), exponent)));
+			map[v] = static_cast<Sample>(value);
+		}
+	}
+}
+
+void Pixels::buildTables(const ColourInfo& info, uint8_t colourType, uint8_t bitDepth, Format format,
+	const ColourOptions& options, Tables& tables)
+{
+	double exponent = 0;
+	if (options.screenGamma > 0 && info.gamma != 0)
+		exponent = 100000.0 / (info.gamma * options.screenGamma);
+	std::array<uint8_t, 4> significantBits{};
+	if (options.significantBits)
+		significantBits = info.significantBits;
+
+	for (size_t i = 0; i < tables.palette.size() / 4; i++)
+	{
+		if (i * 3 + 2 < info.palette.size())
+			std::memcpy(&tables.palette[i * 4], &info.palette[i * 3], 3);
+		else
+			std::memset(&tables.palette[i * 4], 0, 3);
+		tables.palette[i * 4 + 3] = i < info.paletteAlpha.size() ? info.paletteAlpha[i] : 255;
+	}
+	tables.hasColourKey = info.hasColourKey;
+	tables.colourKey = info.colourKey;
+	tables.samples8.clear();
+	tables.samples16.clear();
+
+	const bool sixteenBit = format == Format::Rgba16;
+	const uint32_t bits = sixteenBit ? 16 : 8;
+	bool mapSamples = exponent > 0;
+	for (uint8_t channelBits : significantBits)
+		mapSamples |= channelBits != 0 && channelBits < std::min<uint32_t>(bitDepth, bits);
+	if (!mapSamples || format == Format::PaletteIndex)
+		return;
+
+	if (colourType == 3)
+	{
+		// palette entries are 8-bit whatever the bit depth
+		std::array<uint8_t, 256> map;
+		for (size_t c = 0; c < 3; c++)
+		{
+			fillSampleMap(map.data(), 8, 8, significantBits[c], exponent);
+			for (size_t i = 0; i < tables.palette.size() / 4; i++)
+				tables.palette[i * 4 + c] = map[tables.palette[i * 4 + c]];
+		}
+		return;
+	}
+	// alpha isn't gamma corrected
+	const size_t mapSize = static_cast<size_t>(1) << bits;
+	if (sixteenBit)
+	{
+		tables.samples16.resize(4 * mapSize);
+		for (size_t c = 0; c < 4; c++)
+			fillSampleMap(&tables.samples16[c * mapSize], bits, bitDepth, significantBits[c], c < 3 ? exponent : 0);
+	}
+	else
+	{
+		tables.samples8.resize(4 * mapSize);
+		for (size_t c = 0; c < 4; c++)
+			fillSampleMap(&tables.samples8[c * mapSize], bits, bitDepth, significantBits[c], c < 3 ? exponent : 0);
+	}
+}
+
+Pixels::Converter Pixels::getConverter(uint8_t colourType, uint8_t bitDepth, Format format, const Tables& tables)
+{
+	if (format == Format::PaletteIndex && colourType != 3)
+		throwPngError(PngErrorCode::InvalidArgument, "palette indices need palette image");
+	const bool colourKey = tables.hasColourKey && (colourType == 0 || colourType == 2)
+		&& (format == Format::Rgba8 || format == Format::Bgra8 || format == Format::Rgba16);
+	const bool mapSamples = colourType != 3
+		&& !(format == Format::Rgba16 ? tables.samples16.empty() : tables.samples8.empty());
+	// the fast paths convert plain samples only
+	if (!colourKey && !mapSamples)
+	{
+		// scanlines already in the output format
+		if (bitDepth == 8)
+		{
+			if ((colourType == 6 && format == Format::Rgba8) || (colourType == 2 && format == Format::Rgb8))
+				return format == Format::Rgba8 ? copyLine<4> : copyLine<3>;
+			if ((colourType == 0 && format == Format::Grey8) || (colourType == 3 && format == Format::PaletteIndex))
+				return copyLine<1>;
+		}
+#ifdef PNG_SSE2
+		if (colourType == 0 && bitDepth == 8 && format == Format::Rgba8)
+			return convertGrey8Sse2;
+#endif
+#ifdef PNG_X86
+		if (colourType == 2 && bitDepth == 8 && format == Format::Rgba8 && Cpu::hasSsse3())
+			return convertRgb8Ssse3<Format::Rgba8>;
+		if (colourType == 2 && bitDepth == 8 && format == Format::Bgra8 && Cpu::hasSsse3())
+			return convertRgb8Ssse3<Format::Bgra8>;
+		if (colourType == 6 && bitDepth == 8 && format == Format::Bgra8 && Cpu::hasSsse3())
+			return convertRgba8ToBgra8Ssse3;
+		if (colourType == 3 && bitDepth == 8 && format == Format::Rgba8 && Cpu::hasAvx2())
+			return convertPalette8Avx2;
+#endif
+	}
+	for (const ConverterEntry& entry : getConverters(format, colourKey, mapSamples))
+	{
+		if (entry.colourType == colourType && entry.bitDepth == bitDepth)
+			return entry.converter;
+	}
+	throwPngError(PngErrorCode::InvalidArgument, "invalid bit depth");
+}
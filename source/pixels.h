@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <array>
+
+// conversion of reconstructed scanlines to output pixels
+namespace Pixels
+{
+	// layouts of output pixels. Samples of lower bit depths are scaled to
+	// the full range of the format, 16-bit ones are truncated unless the
+	// format is Rgba16. Formats without alpha drop it, Grey8 of colour
+	// images is luma with Rec. 601 weights
+	enum class Format : uint8_t
+	{
+		Rgba8,
+		Bgra8,
+		Rgb8,
+		Grey8,
+		// 16-bit samples in native byte order
+		Rgba16,
+		// a byte per pixel, only for palette images
+		PaletteIndex
+	};
+
+	constexpr size_t getPixelSize(Format format)
+	{
+		switch (format)
+		{
+		case Format::Rgba8:
+		case Format::Bgra8:
+			return 4;
+		case Format::Rgb8:
+			return 3;
+		case Format::Rgba16:
+			return 8;
+		default:
+			return 1;
+		}
+	}
+
+	// RGBA of every possible palette index, indices missing from
+	// the palette are opaque black
+	using PaletteLut = std::array<uint8_t, 256 * 4>;
+
+	// what PLTE and the ancillary chunks say about colours of an image
+	struct ColourInfo
+	{
+		// PLTE entries as RGB triples
+		std::vector<uint8_t> palette;
+		// alpha of palette entries from tRNS, entries past its end are opaque
+		std::vector<uint8_t> paletteAlpha;
+		// tRNS of greyscale (in the first sample) and truecolour images,
+		// samples at the image bit depth. Pixels equal to it are transparent
+		bool hasColourKey = false;
+		std::array<uint16_t, 3> colourKey{};
+		// gAMA, file gamma times 100000, 0 if absent
+		uint32_t gamma = 0;
+		// sBIT of red, green, blue and alpha, grey is in all three colours.
+		// 0 if absent
+		std::array<uint8_t, 4> significantBits{};
+	};
+
+	// how samples are adjusted besides scaling to the output format
+	struct ColourOptions
+	{
+		// if positive and the image has gAMA, colours are corrected for a
+		// display with this exponent, usually 2.2
+		double screenGamma = 0;
+		// rescales samples with fewer significant bits than the bit depth
+		// by sBIT to the full range
+		bool significantBits = false;
+	};
+
+	// everything converters look up besides scanlines, built once per image
+	struct Tables
+	{
+		// tRNS alpha, gamma and sBIT are already applied to palette entries
+		PaletteLut palette;
+		bool hasColourKey = false;
+		std::array<uint16_t, 3> colourKey;
+		// maps of red, green, blue and alpha output samples one after
+		// another, 256 entries each for 8-bit formats and 65536 for Rgba16.
+		// Empty if samples are used as they are
+		std::vector<uint8_t> samples8;
+		std::vector<uint16_t> samples16;
+	};
+
+	// fills tables, reusing their memory
+	void buildTables(const ColourInfo& info, uint8_t colourType, uint8_t bitDepth, Format format,
+		const ColourOptions& options, Tables& tables);
+
+	// converts width pixels of a reconstructed scanline to pixels of
+	// some format
+	using Converter = void (*)(const uint8_t* byteLine, uint8_t* dest, uint32_t width, const Tables& tables);
+
+	// returns converter to format specialized for one of the colour type
+	// and bit depth combinations allowed by IHDR and for the parts of
+	// tables in use, so that pixels are converted without checking them
+	Converter getConverter(uint8_t colourType, uint8_t bitDepth, Format format, const Tables& tables);
+}
@@ -0,0 +1,133 @@
+#include "rowindex.h"
+#include "error.h"
+
+#include <fstream>
+#include <algorithm>
+
+namespace
+{
+	// ends with the format version, 2 since fixed code blocks are stored as
+	// a block kind of their own
+	constexpr char magic[8] = { 'P', 'N', 'G', 'R', 'I', 'D', 'X', '2' };
+
+	void writeUInt(std::ostream& out, uint64_t val, size_t bytes)
+	{
+		for (size_t i = bytes; i > 0; i--)
+			out.put(static_cast<char>((val >> ((i - 1) * 8)) & 0xFF));
+	}
+
+	uint64_t readUInt(std::istream& in, size_t bytes)
+	{
+		uint64_t val = 0;
+		for (size_t i = 0; i < bytes; i++)
+		{
+			int c = in.get();
+			if (c == EOF)
+				throwPngError(PngErrorCode::InvalidArgument, "unexpected end of row index");
+			val = (val << 8) | static_cast<uint8_t>(c);
+		}
+		return val;
+	}
+
+	void writeBytes(std::ostream& out, const std::vector<uint8_t>& bytes)
+	{
+		writeUInt(out, bytes.size(), 4);
+		out.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+	}
+
+	void readBytes(std::istream& in, std::vector<uint8_t>& bytes, size_t maxSize)
+	{
+		size_t size = readUInt(in, 4);
+		if (size > maxSize)
+			throwPngError(PngErrorCode::InvalidArgument, "invalid row index");
+		bytes.resize(size);
+		in.read(reinterpret_cast<char*>(bytes.data()), size);
+		if (static_cast<size_t>(in.gcount()) != size)
+			throwPngError(PngErrorCode::InvalidArgument, "unexpected end of row index");
+	}
+}
+
+const RowIndex::Checkpoint& RowIndex::findCheckpoint(uint32_t row) const
+{
+	auto it = std::upper_bound(checkpoints.begin(), checkpoints.end(), row,
+		[](uint32_t row, const Checkpoint& checkpoint) { return row < checkpoint.row; });
+	if (it == checkpoints.begin())
+		throwPngError(PngErrorCode::InvalidArgument, "no checkpoint before row");
+	return *(it - 1);
+}
+
+void RowIndex::save(const std::string& filename) const
+{
+	std::ofstream out(filename, std::ios_base::binary);
+	if (!out)
+		throwPngError(PngErrorCode::Io, "can't create row index file");
+	out.write(magic, sizeof(magic));
+	writeUInt(out, width, 4);
+	writeUInt(out, height, 4);
+	writeUInt(out, bitDepth, 1);
+	writeUInt(out, colourType, 1);
+	writeUInt(out, rowInterval, 4);
+	writeUInt(out, checkpoints.size(), 4);
+	for (const Checkpoint& checkpoint : checkpoints)
+	{
+		const Inflater::Checkpoint& inflater = checkpoint.inflater;
+		writeUInt(out, checkpoint.row, 4);
+		writeUInt(out, inflater.input.offset, 8);
+		writeUInt(out, inflater.input.chunkEnd, 8);
+		writeUInt(out, inflater.input.bitBuffer, 8);
+		writeUInt(out, inflater.input.bitCount, 1);
+		writeUInt(out, inflater.block, 1);
+		writeUInt(out, inflater.lastBlock, 1);
+		writeUInt(out, inflater.streamEnded, 1);
+		writeUInt(out, inflater.storedRemaining, 2);
+		writeBytes(out, inflater.codeLengths);
+		writeUInt(out, inflater.literalCodeCount, 2);
+		writeBytes(out, inflater.window);
+		writeUInt(out, inflater.unreadSize, 4);
+		writeBytes(out, checkpoint.prevByteLine);
+	}
+	if (!out)
+		throwPngError(PngErrorCode::Io, "can't write row index file");
+}
+
+void RowIndex::load(const std::string& filename)
+{
+	std::ifstream in(filename, std::ios_base::binary);
+	if (!in)
+		throwPngError(PngErrorCode::Io, "row index file not found");
+	char fileMagic[sizeof(magic)];
+	in.read(fileMagic, sizeof(fileMagic));
+	if (in.gcount() != sizeof(magic) || !std::equal(magic, magic + sizeof(magic), fileMagic))
+		throwPngError(PngErrorCode::InvalidArgument, "invalid row index");
+	width = static_cast<uint32_t>(readUInt(in, 4));
+	height = static_cast<uint32_t>(readUInt(in, 4));
+	bitDepth = static_cast<uint8_t>(readUInt(in, 1));
+	colourType = static_cast<uint8_t>(readUInt(in, 1));
+	rowInterval = static_cast<uint32_t>(readUInt(in, 4));
+	size_t count = readUInt(in, 4);
+	if (count > height)
+		throwPngError(PngErrorCode::InvalidArgument, "invalid row index");
+	checkpoints.resize(count);
+	for (Checkpoint& checkpoint : checkpoints)
+	{
+		Inflater::Checkpoint& inflater = checkpoint.inflater;
+		checkpoint.row = static_cast<uint32_t>(readUInt(in, 4));
+		inflater.input.offset = readUInt(in, 8);
+		inflater.input.chunkEnd = readUInt(in, 8);
+		inflater.input.bitBuffer = readUInt(in, 8);
+		inflater.input.bitCount = static_cast<uint8_t>(readUInt(in, 1));
+		if (inflater.input.bitCount > 63)
+			throwPngError(PngErrorCode::InvalidArgument, "invalid row index");
+		inflater.block = static_cast<uint8_t>(readUInt(in, 1));
+		inflater.lastBlock = readUInt(in, 1) != 0;
+		inflater.streamEnded = readUInt(in, 1) != 0;
+		inflater.storedRemaining = static_cast<uint16_t>(readUInt(in, 2));
+		// at most 288 literal and 32 distance code lengths
+		readBytes(in, inflater.codeLengths, 288 + 32);
+		inflater.literalCodeCount = static_cast<uint16_t>(readUInt(in, 2));
+		readBytes(in, inflater.window, Inflater::windowAllocationSize);
+		inflater.unreadSize = static_cast<uint32_t>(readUInt(in, 4));
+		// up to 8 bytes per pixel
+		readBytes(in, checkpoint.prevByteLine, static_cast<size_t>(width) * 8);
+	}
+}
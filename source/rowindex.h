@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <string>
+
+#include "deflate.h"
+
+// checkpoints for decoding rows of a non-interlaced image without
+// inflating and reconstructing all rows before them
+struct RowIndex
+{
+	struct Checkpoint
+	{
+		uint32_t row = 0;
+		// state of inflater just before the filter type byte of row
+		Inflater::Checkpoint inflater;
+		// reconstructed scanline preceding row, zeros for the first one
+		std::vector<uint8_t> prevByteLine;
+	};
+
+	// image the index was built for
+	uint32_t width = 0;
+	uint32_t height = 0;
+	uint8_t bitDepth = 0;
+	uint8_t colourType = 0;
+	// a checkpoint is stored before every rowInterval-th row
+	uint32_t rowInterval = 64;
+	std::vector<Checkpoint> checkpoints;
+
+	// returns the last checkpoint at or before row
+	const Checkpoint& findCheckpoint(uint32_t row) const;
+	// stores the index in a sidecar file, integers are stored with MSB
+	// first like in png
+	void save(const std::string& filename) const;
+	void load(const std::string& filename);
+};
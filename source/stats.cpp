@@ -0,0 +1,59 @@
+#include "stats.h"
+
+#include <sstream>
+
+namespace
+{
+	template<size_t n>
+	void writeArray(std::ostringstream& out, const std::array<uint64_t, n>& values)
+	{
+		out << "[";
+		for (size_t i = 0; i < n; i++)
+			out << (i ? ", " : "") << values[i];
+		out << "]";
+	}
+
+	// bucket i covers base[i] to base[i + 1] - 1, the last one ends at last
+	template<size_t n>
+	void writeHistogram(std::ostringstream& out, const std::array<uint64_t, n>& counts,
+		const std::array<uint16_t, n>& base, uint32_t last)
+	{
+		out << "[";
+		for (size_t i = 0; i < n; i++)
+		{
+			uint32_t max = i + 1 < n ? base[i + 1] - 1 : last;
+			out << (i ? ", " : "") << "{\"min\": " << base[i] << ", \"max\": " << max
+				<< ", \"count\": " << counts[i] << "}";
+		}
+		out << "]";
+	}
+}
+
+std::string DecodeStats::toJson() const
+{
+	std::ostringstream out;
+	out << "{\n";
+	out << "  \"seconds\": {\"header\": " << headerSeconds << ", \"inflate\": " << inflateSeconds
+		<< ", \"unfilter\": " << unfilterSeconds << ", \"convert\": " << convertSeconds
+		<< ", \"total\": " << totalSeconds << "},\n";
+	out << "  \"idatChunks\": {\"count\": " << idatChunkLengths.size() << ", \"lengths\": [";
+	for (size_t i = 0; i < idatChunkLengths.size(); i++)
+		out << (i ? ", " : "") << idatChunkLengths[i];
+	out << "]},\n";
+	out << "  \"filterTypes\": ";
+	writeArray(out, filterTypes);
+	out << ",\n";
+	out << "  \"parallelInflate\": " << (parallelInflate ? "true" : "false") << ",\n";
+	out << "  \"blocks\": {\"stored\": " << inflate.storedBlocks << ", \"static\": " << inflate.staticBlocks
+		<< ", \"dynamic\": " << inflate.dynamicBlocks << "},\n";
+	out << "  \"storedBytes\": " << inflate.storedBytes << ",\n";
+	out << "  \"literals\": " << inflate.literals << ",\n";
+	out << "  \"matches\": " << inflate.matches << ",\n";
+	out << "  \"matchLengths\": ";
+	writeHistogram(out, inflate.lengthCodes, Deflate::lengthBase, 258);
+	out << ",\n";
+	out << "  \"matchDistances\": ";
+	writeHistogram(out, inflate.distanceCodes, Deflate::distanceBase, 32768);
+	out << "\n}";
+	return out.str();
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <array>
+#include <string>
+
+#include "deflate.h"
+
+// where a decode spent its time and what its data looked like, filled in
+// by PngDecoder when DecodeOptions::stats is set
+struct DecodeStats
+{
+	// signature, IHDR and chunks up to the first IDAT
+	double headerSeconds = 0;
+	// reading IDAT chunks with their crc and inflating them
+	double inflateSeconds = 0;
+	// removing filters from scanlines
+	double unfilterSeconds = 0;
+	// converting scanlines to the output format, including scattering
+	// pixels of Adam7 passes
+	double convertSeconds = 0;
+	double totalSeconds = 0;
+
+	std::vector<uint32_t> idatChunkLengths;
+	// set if IDAT data was inflated in parallel, inflate counts are not
+	// collected then
+	bool parallelInflate = false;
+	InflateStats inflate;
+	// scanlines by filter type, of all passes for interlaced images
+	std::array<uint64_t, 5> filterTypes{};
+
+	// the stats as a json object, histograms of length and distance codes
+	// as arrays of { "min", "max", "count" } entries
+	std::string toJson() const;
+};
@@ -1,24 +1,23 @@
 #include "streams.h"
+#include "log.h"
 
-PngChunkStream::PngChunkStream(std::istream& pIn) : in(pIn)
-{
-	computeCrcTable();
-}
+#include <algorithm>
+#include <cstring>
+
+PngChunkStream::PngChunkStream(std::span<const uint8_t> pData, size_t pPos)
+	: data(pData), pos(pPos) {};
 
 uint32_t PngChunkStream::_readU32()
 {
-	uint32_t a = in.get() << 24;
-	a = a | ((in.get() & 0xFF) << 16);
-	a = a | ((in.get() & 0xFF) << 8);
-	a = a | (in.get() & 0xFF);
+	checkAvailable(4);
+	uint32_t a = data[pos] << 24;
+	a = a | (data[pos + 1] << 16);
+	a = a | (data[pos + 2] << 8);
+	a = a | data[pos + 3];
+	pos += 4;
 	return a;
 }
 
-uint8_t PngChunkStream::_readU8()
-{
-	return static_cast<uint8_t>(in.get());
-}
-
 uint32_t PngChunkStream::readU32()
 {
 	uint32_t a = getWithCrc() << 24;
@@ -36,24 +35,39 @@ uint8_t PngChunkStream::readU8()
 void PngChunkStream::readChunkHeader(uint32_t& length, std::string& type)
 {
 	if (insideChunk)
-		throw "tried to read next chunk while inside another chunk";
+		throwPngError(PngErrorCode::ChunkOrder, "tried to read next chunk while inside another chunk", pos);
+	if (++chunkCount > chunkCountLimit)
+		throwPngError(PngErrorCode::Limit, "too many chunks", pos);
 	length = _readU32();
-	type.resize(4);
-	in.read(type.data(), 4);
-	updateCrc(reinterpret_cast<uint8_t*>(type.data()), 4);
+	checkAvailable(4);
+	type.assign(reinterpret_cast<const char*>(data.data() + pos), 4);
+	updateCrc(data.data() + pos, 4);
+	pos += 4;
 	this->length = length;
 	this->type = type;
+	bytesRead = 0;
 	insideChunk = true;
 }
 
 void PngChunkStream::readNextCriticalChunkHeader(uint32_t& length, std::string& type)
+{
+	readNextChunkHeader(length, type, {});
+}
+
+void PngChunkStream::readNextChunkHeader(uint32_t& length, std::string& type, std::span<const char* const> keptTypes)
 {
 	readChunkHeader(length, type);
 	// if chunk is ancillary
 	while (GET_BIT(type[0], 5) == 1)
 	{
-		std::clog << "Skipped ancillary chunk: " << type << std::endl;
-		in.seekg(length + 4, std::ios_base::cur); // skip chunk data and crc
+		ancillaryBytes += length;
+		if (ancillaryBytes > ancillaryBytesLimit)
+			throwPngError(PngErrorCode::Limit, "too much ancillary data", pos);
+		if (std::any_of(keptTypes.begin(), keptTypes.end(), [&](const char* kept) { return type == kept; }))
+			return;
+		PNG_LOG("Skipped ancillary chunk: " << type);
+		checkAvailable(static_cast<size_t>(length) + 4);
+		pos += static_cast<size_t>(length) + 4; // skip chunk data and crc
 		restartCrc();
 		insideChunk = false;
 		readChunkHeader(length, type);
@@ -67,63 +81,83 @@ void PngChunkStream::skipToNextIDATChunk()
 		finishCrcAndChunk();
 		readChunkHeader(length, type);
 		if (type != "IDAT")
-			throw "unexpected end of image data";
+			throwPngError(PngErrorCode::UnexpectedEnd, "unexpected end of image data", pos);
 	} while (length == 0);
 }
 
-void PngChunkStream::get(uint8_t& c)
+void PngChunkStream::read(uint8_t* dest, uint16_t len)
 {
-	if (!insideChunk)
-		throw "tried to read byte outside of chunk";
-	if (bytesRead == length)
+	while (len > 0)
 	{
-		skipToNextIDATChunk();
-		bytesRead = 0;
+		if (bytesRead == length)
+			skipToNextIDATChunk();
+		uint32_t n = std::min<uint32_t>(len, length - bytesRead);
+		checkAvailable(n);
+		std::copy(data.data() + pos, data.data() + pos + n, dest);
+		updateCrc(dest, n);
+		pos += n;
+		bytesRead += n;
+		dest += n;
+		len -= n;
 	}
-	bytesRead++;
-	c = in.get();
-	updateCrc(c);
 }
 
-void PngChunkStream::read(uint8_t* dest, uint16_t len)
+void PngChunkStream::nextIDATData(const uint8_t*& begin, const uint8_t*& end)
 {
+	if (!insideChunk)
+		throwPngError(PngErrorCode::ChunkOrder, "tried to read byte outside of chunk", pos);
 	if (bytesRead == length)
-	{
 		skipToNextIDATChunk();
-		bytesRead = 0;
-	}
-	while (len > length - bytesRead)
-	{
-		in.read(reinterpret_cast<char*>(dest), length - bytesRead);
-		updateCrc(dest, length - bytesRead);
-		dest += length - bytesRead;
-		len -= length - bytesRead;
-		skipToNextIDATChunk();
-		bytesRead = 0;
-	}
-	if (len != 0)
-	{
-		in.read(reinterpret_cast<char*>(dest), len);
-		updateCrc(dest, len);
-	}
+	uint32_t len = length - bytesRead;
+	checkAvailable(len);
+	begin = data.data() + pos;
+	end = begin + len;
+	updateCrc(begin, len);
+	pos += len;
+	bytesRead += len;
 }
 
-void PngChunkStream::computeCrcTable()
+void PngChunkStream::readAllIDATData(std::vector<uint8_t>& dest)
 {
-	for (uint32_t i = 0; i < 256; i++)
+	while (true)
 	{
-		uint32_t c = i;
-		for (uint32_t k = 0; k < 8; k++)
+		if (bytesRead < length)
 		{
-			if (c & 1)
-				c = 0xEDB88320 ^ (c >> 1);
-			else
-				c = c >> 1;
+			const uint8_t* begin;
+			const uint8_t* end;
+			nextIDATData(begin, end);
+			dest.insert(dest.end(), begin, end);
 		}
-		crcTable[i] = c;
+		// type of the chunk after crc of current one
+		if (data.size() - pos < 12 || std::memcmp(data.data() + pos + 8, "IDAT", 4) != 0)
+			return;
+		finishCrcAndChunk();
+		readChunkHeader(length, type);
 	}
 }
 
+size_t PngChunkStream::offsetOf(const uint8_t* p) const
+{
+	return p - data.data();
+}
+
+void PngChunkStream::resumeIDATData(size_t offset, size_t chunkEnd, const uint8_t*& begin, const uint8_t*& end)
+{
+	if (insideChunk)
+		throwPngError(PngErrorCode::ChunkOrder, "tried to read next chunk while inside another chunk", pos);
+	if (offset > chunkEnd || chunkEnd > data.size())
+		throwPngError(PngErrorCode::UnexpectedEnd, "unexpected end of file", pos);
+	begin = data.data() + offset;
+	end = data.data() + chunkEnd;
+	pos = chunkEnd;
+	// the chunk is treated as read up to its end
+	length = static_cast<uint32_t>(chunkEnd - offset);
+	bytesRead = length;
+	type = "IDAT";
+	insideChunk = true;
+	crcKnown = false;
+}
+
 void PngChunkStream::restartCrc()
 {
 	crc = 0xFFFFFFFF;
@@ -131,122 +165,157 @@ void PngChunkStream::restartCrc()
 
 void PngChunkStream::finishCrcAndChunk()
 {
-	if (~crc != _readU32())
-		throw "crc mismatch";
-
-	std::clog << type << " chunk: crc good" << std::endl;
+	uint32_t remaining = length - bytesRead;
+	checkAvailable(remaining);
+	updateCrc(data.data() + pos, remaining);
+	pos += remaining;
+	bytesRead = length;
+	uint32_t expectedCrc = _readU32();
+	if (crcKnown)
+	{
+		if (~crc != expectedCrc)
+			throwPngError(PngErrorCode::Crc, "crc mismatch", pos - 4);
+		PNG_LOG(type << " chunk: crc good");
+	}
 
 	crc = 0xFFFFFFFF;
+	crcKnown = true;
 
 	insideChunk = false;
 }
 
+void PngChunkStream::skipChunk()
+{
+	size_t remaining = static_cast<size_t>(length - bytesRead) + 4;
+	checkAvailable(remaining);
+	pos += remaining;
+	bytesRead = length;
+	restartCrc();
+	crcKnown = true;
+	insideChunk = false;
+}
 
-DeflateBitStream::DeflateBitStream(PngChunkStream& pIn) : in(pIn) {};
-
-int16_t DeflateBitStream::read(size_t numOfBits)
+void PngChunkStream::finishIDATChunks()
 {
-	if (remainingBits == 0)
+	finishCrcAndChunk();
+	// type of the next chunk follows its length
+	while (data.size() - pos >= 8 && std::memcmp(data.data() + pos + 4, "IDAT", 4) == 0)
 	{
-		in.get(tempByte);
-		remainingBits = 8;
-	}
-	int16_t res;
-	if (numOfBits <= remainingBits)
-	{
-		res = ((uint8_t)(tempByte << (remainingBits - numOfBits))) >> (8 - numOfBits);
-		remainingBits -= numOfBits;
-	}
-	else
-	{
-		res = ((uint8_t)tempByte) >> (8 - remainingBits);
-		in.get(tempByte);
-		if (numOfBits - remainingBits <= 8)
-		{
-			res += ((int16_t)(uint8_t)(tempByte << (8 - (numOfBits - remainingBits))))
-				>> (8 - (numOfBits - remainingBits)) << remainingBits;
-			remainingBits = 8 - (numOfBits - remainingBits);
-		}
-		else
-		{
-			res += ((int16_t)(uint8_t)tempByte) << remainingBits;
-			in.get(tempByte);
-			res += ((int16_t)(uint8_t)(tempByte << (8 - (numOfBits - remainingBits - 8))))
-				>> (8 - (numOfBits - remainingBits - 8)) << (remainingBits + 8);
-			remainingBits = 8 - (numOfBits - remainingBits - 8);
-		}
+		readChunkHeader(length, type);
+		finishCrcAndChunk();
 	}
-	return res;
 }
 
-void DeflateBitStream::finishByte()
+size_t PngChunkStream::position() const
 {
-	remainingBits = 0;
+	return pos;
 }
 
-bool DeflateBitStream::readBit()
+void PngChunkStream::setLimits(uint32_t maxChunkCount, uint64_t maxAncillaryBytes)
 {
-	if (remainingBits == 0)
-	{
-		in.get(tempByte);
-		remainingBits = 8;
-	}
-	return (tempByte >> (8 - remainingBits--)) & 1;
+	chunkCountLimit = maxChunkCount;
+	ancillaryBytesLimit = maxAncillaryBytes;
 }
 
+PngChunkWriter::PngChunkWriter(std::vector<uint8_t>& pOut) : out(pOut) {};
 
-PngBitStream::PngBitStream(std::vector<uint8_t>::const_iterator& pIn, uint8_t pBitDepth, bool pUseScaling)
-	: in(pIn), bitDepth(pBitDepth), useScaling(pUseScaling) {};
+void PngChunkWriter::writeU32(std::vector<uint8_t>& dest, uint32_t val)
+{
+	dest.push_back(static_cast<uint8_t>(val >> 24));
+	dest.push_back(static_cast<uint8_t>(val >> 16));
+	dest.push_back(static_cast<uint8_t>(val >> 8));
+	dest.push_back(static_cast<uint8_t>(val));
+}
 
-uint8_t PngBitStream::get()
+void PngChunkWriter::writeSignature()
 {
-	if (bitDepth == 8)
-		return *(in++);
-	else if (bitDepth == 16)
-	{
-		uint8_t res = *(in++);
-		in++;
-		return res;
-	}
-	
-	if (remainingSamples == 0)
-	{
-		tempByte = *(in++);
-		remainingSamples = 8 / bitDepth;
-	}
-	remainingSamples--;
+	static constexpr std::array<uint8_t, 8> signature = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	out.insert(out.end(), signature.begin(), signature.end());
+}
+
+void PngChunkWriter::writeChunk(const char* type, std::span<const uint8_t> chunkData)
+{
+	if (chunkData.size() > 0x7FFFFFFF)
+		throwPngError(PngErrorCode::InvalidArgument, "chunk too long");
+	writeU32(out, static_cast<uint32_t>(chunkData.size()));
+	size_t typePos = out.size();
+	out.insert(out.end(), type, type + 4);
+	out.insert(out.end(), chunkData.begin(), chunkData.end());
+	// crc covers type and data
+	uint32_t crc = Crc32::update(0xFFFFFFFF, out.data() + typePos, out.size() - typePos);
+	writeU32(out, ~crc);
+}
+
+DeflateBitStream::DeflateBitStream(PngChunkStream& pIn) : in(&pIn) {};
 
-	uint8_t res;
-	if (useScaling)
+DeflateBitStream::DeflateBitStream(std::span<const uint8_t> pData, size_t bitOffset)
+	: begin(pData.data()), next(pData.data()), end(pData.data() + pData.size())
+{
+	if (bitOffset / 8 > pData.size())
+		throwPngError(PngErrorCode::UnexpectedEnd, "unexpected end of image data");
+	next += bitOffset / 8;
+	read(bitOffset % 8);
+}
+
+DeflateBitStream::DeflateBitStream(PngChunkStream& pIn, const State& state)
+	: in(&pIn), bitBuffer(state.bitBuffer), bitCount(state.bitCount)
+{
+	in->resumeIDATData(state.offset, state.chunkEnd, next, end);
+}
+
+DeflateBitStream::State DeflateBitStream::getState() const
+{
+	// bits above bitCount may hold copies of bytes at next
+	uint64_t mask = (static_cast<uint64_t>(1) << bitCount) - 1;
+	return State{ in->offsetOf(next), in->offsetOf(end), bitBuffer & mask, static_cast<uint8_t>(bitCount) };
+}
+
+void DeflateBitStream::nextData()
+{
+	if (in == nullptr)
+		throwPngError(PngErrorCode::UnexpectedEnd, "unexpected end of image data");
+	in->nextIDATData(next, end);
+}
+
+void DeflateBitStream::slowRefill(size_t numOfBits)
+{
+	while (bitCount < numOfBits)
 	{
-		if (bitDepth == 4)
-		{
-			res = tempByte & 0b11110000;
-			if (res >= 128)
-				res |= 0b1111;
-		}
-		else if (bitDepth == 2)
-		{
-			res = tempByte & 0b11000000;
-			if (res >= 128)
-				res |= 0b111111;
-		}
-		else
+		if (next == end)
+			nextData();
+		while (bitCount <= 56 && next != end)
 		{
-			res = tempByte & 0b10000000;
-			if (res >= 128)
-				res |= 0b1111111;
+			bitBuffer |= static_cast<uint64_t>(*(next++)) << bitCount;
+			bitCount += 8;
 		}
 	}
-	else
+}
+
+void DeflateBitStream::finishByte()
+{
+	consume(bitCount % 8);
+}
+
+void DeflateBitStream::readBytes(uint8_t* dest, uint16_t len)
+{
+	// bytes already pulled into the bit buffer come first
+	while (len > 0 && bitCount > 0)
 	{
-		if (bitDepth == 4)
-			res = (tempByte >> 4) & 0b1111;
-		else if (bitDepth == 2)
-			res = (tempByte >> 6) & 0b11;
-		else
-			res = (tempByte >> 7) & 1;
+		*(dest++) = static_cast<uint8_t>(read(8));
+		len--;
 	}
-	tempByte <<= bitDepth;
-	return res;
-}
\ No newline at end of file
+	// refills may leave copies of the bytes at next above bitCount,
+	// they must not be merged with later refills once next moves on
+	if (len > 0)
+		bitBuffer = 0;
+	while (len > 0)
+	{
+		if (next == end)
+			nextData();
+		size_t n = std::min<size_t>(len, end - next);
+		std::copy(next, next + n, dest);
+		next += n;
+		dest += n;
+		len -= n;
+	}
+}
@@ -4,16 +4,23 @@
 #include <cstdint>
 #include <vector>
 #include <array>
+#include <span>
+#include <string>
+
+#include "crc.h"
+#include "error.h"
 
 #ifndef GET_BIT
 #define GET_BIT(VAL, IDX) (((VAL) >> (IDX)) & 1)
 #endif // !GET_BIT
 
 
+// reads chunks directly from memory, e.g. a memory-mapped file
 class PngChunkStream
 {
 public:
-	PngChunkStream(std::istream& pIn);
+	// starts reading chunks at position pPos of pData
+	PngChunkStream(std::span<const uint8_t> pData, size_t pPos = 0);
 	// reads unsigned 32-bit integer, stored with MSB first
 	uint32_t readU32();
 	// reads unsigned 8-bit integer
@@ -23,79 +30,191 @@ public:
 	// reads length and type of next critical chunk, skipping
 	// ancillary chunks
 	void readNextCriticalChunkHeader(uint32_t& length, std::string& type);
+	// the same, but also stops at ancillary chunks of given types
+	void readNextChunkHeader(uint32_t& length, std::string& type, std::span<const char* const> keptTypes);
 	// use only inside IDAT chunk
-	void get(uint8_t& c);
 	void read(uint8_t* dest, uint16_t len);
+	// returns the unread part of current IDAT chunk, moving to the next
+	// IDAT chunk when current one is exhausted. Returned bytes point into
+	// the input and are already used in crc
+	void nextIDATData(const uint8_t*& begin, const uint8_t*& end);
+	// appends unread data of current IDAT chunk and all IDAT chunks
+	// following it to dest, stops inside the last one
+	void readAllIDATData(std::vector<uint8_t>& dest);
+	// offset from the start of input of a byte returned by nextIDATData
+	size_t offsetOf(const uint8_t* p) const;
+	// continues reading IDAT data at given offset of the input, inside
+	// a chunk whose data ends at chunkEnd. Returns the rest of the chunk
+	// like nextIDATData, its crc isn't checked
+	void resumeIDATData(size_t offset, size_t chunkEnd, const uint8_t*& begin, const uint8_t*& end);
+	// skips unread chunk data and checks crc
 	void finishCrcAndChunk();
+	// skips unread chunk data and crc without checking it
+	void skipChunk();
+	// checks crc of the rest of current IDAT chunk and of the IDAT chunks
+	// following it without returning their data
+	void finishIDATChunks();
+	// offset of the next byte to read from the start of input
+	size_t position() const;
+	// makes reading chunk headers throw once more than maxChunkCount chunks
+	// were read or more than maxAncillaryBytes of ancillary chunks skipped
+	void setLimits(uint32_t maxChunkCount, uint64_t maxAncillaryBytes);
 private:
-	std::istream& in;
+	std::span<const uint8_t> data;
+	size_t pos;
 	bool insideChunk = false;
 	uint32_t length;
 	std::string type;
 	uint32_t bytesRead = 0;
 
-	std::array<uint32_t, 256> crcTable;
 	uint32_t crc = 0xFFFFFFFF;
+	// false while in a chunk not read from its start
+	bool crcKnown = true;
+
+	uint32_t chunkCount = 0;
+	uint64_t ancillaryBytes = 0;
+	uint32_t chunkCountLimit = UINT32_MAX;
+	uint64_t ancillaryBytesLimit = UINT64_MAX;
 
-	// the same as readU32 and readU8, but don't use byte in crc
+	// the same as readU32, but doesn't use bytes in crc
 	uint32_t _readU32();
-	uint8_t _readU8();
 
 	// gets byte and uses in in crc
 	uint8_t getWithCrc();
+	// throws if less than len bytes are left
+	void checkAvailable(size_t len) const;
 
-	void computeCrcTable();
 	void updateCrc(uint8_t val);
-	void updateCrc(uint8_t* buf, uint32_t len);
+	void updateCrc(const uint8_t* buf, uint32_t len);
 	void restartCrc();
 
 	void skipToNextIDATChunk();
 };
 
+inline void PngChunkStream::checkAvailable(size_t len) const
+{
+	if (data.size() - pos < len)
+		throwPngError(PngErrorCode::UnexpectedEnd, "unexpected end of file", pos);
+}
+
 inline uint8_t PngChunkStream::getWithCrc()
 {
-	uint8_t c = in.get();
+	checkAvailable(1);
+	uint8_t c = data[pos++];
 	updateCrc(c);
+	bytesRead++;
 	return c;
 }
 
 inline void PngChunkStream::updateCrc(uint8_t val)
 {
-	crc = crcTable[(crc ^ val) & 0xFF] ^ (crc >> 8);
+	crc = Crc32::update(crc, val);
 }
 
-inline void PngChunkStream::updateCrc(uint8_t* buf, uint32_t len)
+inline void PngChunkStream::updateCrc(const uint8_t* buf, uint32_t len)
 {
-	for (uint32_t i = 0; i < len; i++)
-	{
-		crc = crcTable[(crc ^ buf[i]) & 0xFF] ^ (crc >> 8);
-	}
+	crc = Crc32::update(crc, buf, len);
 }
 
+// writes chunks into memory, computing their crc
+class PngChunkWriter
+{
+public:
+	// appends chunks to pOut
+	PngChunkWriter(std::vector<uint8_t>& pOut);
+	void writeSignature();
+	// writes a whole chunk, type must have 4 characters
+	void writeChunk(const char* type, std::span<const uint8_t> chunkData);
+	// writes unsigned 32-bit integer with MSB first, outside of chunks
+	static void writeU32(std::vector<uint8_t>& dest, uint32_t val);
+private:
+	std::vector<uint8_t>& out;
+};
+
 
 class DeflateBitStream
 {
 public:
+	// reading position within IDAT chunks, with bits already taken from
+	// them but not consumed
+	struct State
+	{
+		uint64_t offset;
+		uint64_t chunkEnd;
+		uint64_t bitBuffer;
+		uint8_t bitCount;
+	};
+
 	DeflateBitStream(PngChunkStream& pIn);
-	int16_t read(size_t numOfBits);
+	// continues reading IDAT chunks of pIn from a saved state
+	DeflateBitStream(PngChunkStream& pIn, const State& state);
+	// reads deflate data stored contiguously, starting at given bit
+	DeflateBitStream(std::span<const uint8_t> pData, size_t bitOffset = 0);
+	// reads up to 32 bits, first bit read is the least significant
+	uint32_t read(size_t numOfBits);
+	// returns next numOfBits bits (up to 32) without consuming them
+	uint32_t peek(size_t numOfBits);
+	void consume(size_t numOfBits);
+	// skips remaining bits of current byte
 	void finishByte();
-	bool readBit();
+	// reads whole bytes, use only after finishByte
+	void readBytes(uint8_t* dest, uint16_t len);
+	// number of bits consumed since the start of data, only for streams
+	// reading contiguous data
+	size_t bitPosition() const;
+	// only for streams reading IDAT chunks
+	State getState() const;
 private:
-	PngChunkStream& in;
-	uint8_t tempByte = 0;
-	size_t remainingBits = 0;
+	// null when reading contiguous data
+	PngChunkStream* in = nullptr;
+	const uint8_t* begin = nullptr;
+	// buffered IDAT data not yet moved to bitBuffer
+	const uint8_t* next = nullptr;
+	const uint8_t* end = nullptr;
+	// bits are consumed from the least significant end
+	uint64_t bitBuffer = 0;
+	size_t bitCount = 0;
+
+	// tops up bitBuffer a byte at a time, fetching more IDAT data if needed
+	void slowRefill(size_t numOfBits);
+	// moves to the next part of data, throws if there is none
+	void nextData();
 };
 
+inline uint32_t DeflateBitStream::peek(size_t numOfBits)
+{
+	if (bitCount < numOfBits)
+	{
+		if (end - next >= 8)
+		{
+			// load 8 bytes at once and keep as many as fit
+			uint64_t word = 0;
+			for (size_t i = 0; i < 8; i++)
+				word |= static_cast<uint64_t>(next[i]) << (i * 8);
+			bitBuffer |= word << bitCount;
+			next += (63 - bitCount) >> 3;
+			bitCount |= 56;
+		}
+		else
+			slowRefill(numOfBits);
+	}
+	return static_cast<uint32_t>(bitBuffer & ((static_cast<uint64_t>(1) << numOfBits) - 1));
+}
 
-class PngBitStream
+inline void DeflateBitStream::consume(size_t numOfBits)
 {
-public:
-	PngBitStream(std::vector<uint8_t>::const_iterator& pIn, uint8_t pBitDepth, bool pUseScaling);
-	uint8_t get();
-private:
-	std::vector<uint8_t>::const_iterator& in;
-	const uint8_t bitDepth;
-	const bool useScaling;
-	uint8_t tempByte = 0;
-	size_t remainingSamples = 0;
-};
\ No newline at end of file
+	bitBuffer >>= numOfBits;
+	bitCount -= numOfBits;
+}
+
+inline uint32_t DeflateBitStream::read(size_t numOfBits)
+{
+	uint32_t res = peek(numOfBits);
+	consume(numOfBits);
+	return res;
+}
+
+inline size_t DeflateBitStream::bitPosition() const
+{
+	return static_cast<size_t>(next - begin) * 8 - bitCount;
+}
@@ -0,0 +1,867 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <filesystem>
+#include <atomic>
+#include <new>
+#include <cstdlib>
+
+#include "decoder.h"
+#include "encoder.h"
+#include "deflater.h"
+#include "crc.h"
+
+// png_test [testdata directory]
+//
+// decodes the fixtures of testdata in each decode mode and compares the
+// result against a reference decode. testdata/reference.txt holds crc-32
+// of the pixels libpng decodes for each fixture, make_reference.cpp there
+// regenerates it. Prints every mismatch, returns 1 if there was any
+
+// counts allocations, so that reuse of decoder buffers can be checked
+std::atomic<size_t> allocationCount = 0;
+
+// gcc inlines the replacements and then warns that memory from operator new
+// is passed to free, which is what they are written to do
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t size)
+{
+	allocationCount++;
+	if (void* p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	std::free(p);
+}
+
+namespace
+{
+	struct Fixture
+	{
+		std::string name;
+		uint32_t width;
+		uint32_t height;
+		// crc-32 of 8-bit RGBA and of 16-bit RGBA with samples MSB first
+		uint32_t rgba8Crc;
+		uint32_t rgba16Crc;
+		// crc-32 of palette indices, only for palette images
+		bool hasIndices = false;
+		uint32_t indicesCrc = 0;
+		std::vector<uint8_t> file;
+	};
+
+	size_t failures = 0;
+
+	void check(bool ok, const std::string& what)
+	{
+		if (ok)
+			return;
+		failures++;
+		std::cout << "FAILED: " << what << std::endl;
+	}
+
+	std::vector<uint8_t> readFile(const std::string& filename)
+	{
+		std::ifstream in(filename, std::ios_base::binary);
+		if (!in)
+			throwPngError(PngErrorCode::Io, "cannot open fixture");
+		return std::vector<uint8_t>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	}
+
+	uint32_t computeCrc(const uint8_t* data, size_t size)
+	{
+		return Crc32::update(0xFFFFFFFF, data, size) ^ 0xFFFFFFFF;
+	}
+
+	// crc of Rgba16 pixels with samples in png byte order
+	uint32_t computeRgba16Crc(const std::vector<uint8_t>& image)
+	{
+		std::vector<uint8_t> bytes(image.size());
+		for (size_t i = 0; i < image.size(); i += 2)
+		{
+			uint16_t sample;
+			std::memcpy(&sample, &image[i], 2);
+			bytes[i] = static_cast<uint8_t>(sample >> 8);
+			bytes[i + 1] = static_cast<uint8_t>(sample);
+		}
+		return computeCrc(bytes.data(), bytes.size());
+	}
+
+	// reads reference.txt, lines are "name width height rgba8Crc rgba16Crc
+	// [indicesCrc]" with crc in hex, lines starting with # are comments
+	std::vector<Fixture> loadFixtures(const std::string& dir)
+	{
+		std::ifstream in(dir + "/reference.txt");
+		if (!in)
+			throwPngError(PngErrorCode::Io, "cannot open reference.txt");
+		std::vector<Fixture> fixtures;
+		std::string line;
+		while (std::getline(in, line))
+		{
+			if (line.empty() || line[0] == '#')
+				continue;
+			std::istringstream fields(line);
+			Fixture fixture;
+			fields >> fixture.name >> fixture.width >> fixture.height >> std::hex >> fixture.rgba8Crc
+				>> fixture.rgba16Crc;
+			if (fields >> fixture.indicesCrc)
+				fixture.hasIndices = true;
+			fixture.file = readFile(dir + "/" + fixture.name);
+			fixtures.push_back(std::move(fixture));
+		}
+		return fixtures;
+	}
+
+	// decodes with options, returns an empty image if decoding failed
+	std::vector<uint8_t> decode(std::span<const uint8_t> file, uint32_t& width, uint32_t& height,
+		const DecodeOptions& options, const std::string& what)
+	{
+		std::vector<uint8_t> image;
+		Result<void> result = PngDecoder().tryDecode(file, image, width, height, options);
+		check(result.ok(), what + ": " + (result.ok() ? "" : toString(result.error())));
+		if (!result.ok())
+			image.clear();
+		return image;
+	}
+
+	// the plain decode that the other modes are compared against
+	std::vector<uint8_t> decodeReference(const Fixture& fixture, Pixels::Format format)
+	{
+		uint32_t width, height;
+		DecodeOptions options;
+		options.format = format;
+		return decode(fixture.file, width, height, options, fixture.name + " reference decode");
+	}
+
+	// noisy gradients of 8-bit RGBA, compressing to about half their size
+	std::vector<uint8_t> generatePixels(uint32_t width, uint32_t height)
+	{
+		std::vector<uint8_t> pixels(static_cast<size_t>(width) * height * 4);
+		uint32_t noise = 1;
+		for (uint32_t y = 0; y < height; y++)
+		{
+			for (uint32_t x = 0; x < width; x++)
+			{
+				uint8_t* p = &pixels[(static_cast<size_t>(y) * width + x) * 4];
+				for (uint32_t c = 0; c < 4; c++)
+				{
+					noise = noise * 1103515245 + 12345;
+					p[c] = static_cast<uint8_t>((x * (c + 1) + y * (4 - c)) / 8 + (noise >> 27));
+				}
+			}
+		}
+		return pixels;
+	}
+
+	// a png of 8-bit RGBA pixels whose IDAT uses only fixed code blocks,
+	// which encodePng doesn't produce
+	std::vector<uint8_t> encodeWithFixedCodes(const std::vector<uint8_t>& pixels, uint32_t width, uint32_t height)
+	{
+		const size_t rowSize = static_cast<size_t>(width) * 4;
+		std::vector<uint8_t> filtered;
+		for (uint32_t y = 0; y < height; y++)
+		{
+			filtered.push_back(0);
+			filtered.insert(filtered.end(), pixels.begin() + y * rowSize, pixels.begin() + (y + 1) * rowSize);
+		}
+		std::vector<uint8_t> header;
+		PngChunkWriter::writeU32(header, width);
+		PngChunkWriter::writeU32(header, height);
+		header.insert(header.end(), { 8, 6, 0, 0, 0 });
+		std::vector<uint8_t> res;
+		PngChunkWriter out(res);
+		out.writeSignature();
+		out.writeChunk("IHDR", header);
+		out.writeChunk("IDAT", FlateEncode(filtered, 6, true));
+		out.writeChunk("IEND", {});
+		return res;
+	}
+
+	// a png of unfiltered rows of samples at bitDepth, with ancillary
+	// chunks of type and data before IDAT
+	std::vector<uint8_t> encodeRaw(const std::vector<uint8_t>& rows, uint32_t width, uint32_t height,
+		uint8_t bitDepth, uint8_t colourType, const std::vector<std::pair<const char*, std::vector<uint8_t>>>& chunks)
+	{
+		const size_t rowSize = rows.size() / height;
+		std::vector<uint8_t> filtered;
+		for (uint32_t y = 0; y < height; y++)
+		{
+			filtered.push_back(0);
+			filtered.insert(filtered.end(), rows.begin() + y * rowSize, rows.begin() + (y + 1) * rowSize);
+		}
+		std::vector<uint8_t> header;
+		PngChunkWriter::writeU32(header, width);
+		PngChunkWriter::writeU32(header, height);
+		header.insert(header.end(), { bitDepth, colourType, 0, 0, 0 });
+		std::vector<uint8_t> res;
+		PngChunkWriter out(res);
+		out.writeSignature();
+		out.writeChunk("IHDR", header);
+		for (const auto& [type, data] : chunks)
+			out.writeChunk(type, data);
+		out.writeChunk("IDAT", FlateEncode(filtered));
+		out.writeChunk("IEND", {});
+		return res;
+	}
+
+	void testReference(const Fixture& fixture)
+	{
+		for (bool streaming : { false, true })
+		{
+			std::string what = fixture.name + (streaming ? " streaming" : "");
+			uint32_t width = 0, height = 0;
+			DecodeOptions options;
+			options.streaming = streaming;
+			std::vector<uint8_t> rgba8 = decode(fixture.file, width, height, options, what);
+			check(width == fixture.width && height == fixture.height, what + ": size");
+			check(computeCrc(rgba8.data(), rgba8.size()) == fixture.rgba8Crc, what + ": Rgba8 pixels");
+			options.format = Pixels::Format::Rgba16;
+			std::vector<uint8_t> rgba16 = decode(fixture.file, width, height, options, what);
+			check(computeRgba16Crc(rgba16) == fixture.rgba16Crc, what + ": Rgba16 pixels");
+		}
+	}
+
+	// small fixtures are inflated by a single part, so a large image with
+	// several dynamic blocks is generated as well
+	void testParallelInflate(const std::vector<Fixture>& fixtures)
+	{
+		ThreadPool threadPool(4);
+		DecodeOptions options;
+		options.threadPool = &threadPool;
+		for (const Fixture& fixture : fixtures)
+		{
+			uint32_t width, height;
+			std::vector<uint8_t> image = decode(fixture.file, width, height, options, fixture.name + " parallel");
+			check(image == decodeReference(fixture, Pixels::Format::Rgba8), fixture.name + " parallel: pixels");
+		}
+
+		// compresses to a few MiB, enough for several parts
+		const uint32_t width = 1536, height = 1024;
+		std::vector<uint8_t> pixels = generatePixels(width, height);
+		EncodeOptions encodeOptions;
+		encodeOptions.threadPool = &threadPool;
+		std::vector<uint8_t> file = encodePng(pixels, width, height, Pixels::Format::Rgba8, 0, encodeOptions);
+		for (bool parallel : { false, true })
+		{
+			std::string what = std::string("generated image") + (parallel ? " parallel" : "");
+			options.threadPool = parallel ? &threadPool : nullptr;
+			uint32_t decodedWidth = 0, decodedHeight = 0;
+			std::vector<uint8_t> image = decode(file, decodedWidth, decodedHeight, options, what);
+			check(decodedWidth == width && decodedHeight == height && image == pixels, what + ": pixels");
+		}
+	}
+
+	// pixels of format computed from 8-bit RGBA the way the decoder
+	// converts them
+	std::vector<uint8_t> convertRgba8(const std::vector<uint8_t>& rgba8, Pixels::Format format)
+	{
+		std::vector<uint8_t> res;
+		for (size_t i = 0; i < rgba8.size(); i += 4)
+		{
+			const uint8_t* p = &rgba8[i];
+			switch (format)
+			{
+			case Pixels::Format::Bgra8:
+				res.insert(res.end(), { p[2], p[1], p[0], p[3] });
+				break;
+			case Pixels::Format::Rgb8:
+				res.insert(res.end(), { p[0], p[1], p[2] });
+				break;
+			case Pixels::Format::Grey8:
+				res.push_back(static_cast<uint8_t>((p[0] * 77 + p[1] * 150 + p[2] * 29 + 128) >> 8));
+				break;
+			default:
+				res.insert(res.end(), p, p + 4);
+				break;
+			}
+		}
+		return res;
+	}
+
+	// decodes in every format, into vectors and into a buffer whose rows
+	// are apart by more than their size, which must stay untouched between rows
+	void testFormats(const Fixture& fixture)
+	{
+		const std::vector<uint8_t> rgba8 = decodeReference(fixture, Pixels::Format::Rgba8);
+		std::vector<Pixels::Format> formats = { Pixels::Format::Rgba8, Pixels::Format::Bgra8,
+			Pixels::Format::Rgb8, Pixels::Format::Grey8, Pixels::Format::Rgba16 };
+		if (fixture.hasIndices)
+			formats.push_back(Pixels::Format::PaletteIndex);
+		for (Pixels::Format format : formats)
+		{
+			const std::string name = fixture.name + " format " + std::to_string(static_cast<int>(format));
+			for (bool streaming : { false, true })
+			{
+				std::string what = name + (streaming ? " streaming" : "");
+				DecodeOptions options;
+				options.format = format;
+				options.streaming = streaming;
+				uint32_t width, height;
+				std::vector<uint8_t> image = decode(fixture.file, width, height, options, what);
+				if (format == Pixels::Format::Rgba16)
+					check(computeRgba16Crc(image) == fixture.rgba16Crc, what + ": pixels");
+				else if (format == Pixels::Format::PaletteIndex)
+					check(computeCrc(image.data(), image.size()) == fixture.indicesCrc, what + ": pixels");
+				else
+					check(image == convertRgba8(rgba8, format), what + ": pixels");
+
+				const size_t rowSize = static_cast<size_t>(width) * Pixels::getPixelSize(format);
+				const size_t stride = rowSize + 13;
+				std::vector<uint8_t> buffer((height - 1) * stride + rowSize, 0xA5);
+				Result<void> result = PngDecoder().tryDecode(fixture.file, buffer, stride, width, height, options);
+				check(result.ok(), what + " strided: " + (result.ok() ? "" : toString(result.error())));
+				bool rowsMatch = true;
+				bool gapsKept = true;
+				for (uint32_t y = 0; y < height && result.ok() && !image.empty(); y++)
+				{
+					const uint8_t* row = &buffer[y * stride];
+					rowsMatch &= std::equal(row, row + rowSize, image.begin() + y * rowSize);
+					if (y + 1 < height)
+						gapsKept &= std::all_of(row + rowSize, row + stride, [](uint8_t b) { return b == 0xA5; });
+				}
+				check(rowsMatch, what + " strided: pixels");
+				check(gapsKept, what + " strided: gaps between rows");
+
+				buffer.pop_back();
+				result = PngDecoder().tryDecode(fixture.file, buffer, stride, width, height, options);
+				check(!result.ok() && result.error().code() == PngErrorCode::InvalidArgument,
+					what + " strided: too small buffer accepted");
+			}
+		}
+	}
+
+	// builds an index while decoding a non-interlaced image, saves and
+	// loads it and decodes ranges of rows from its checkpoints
+	void testRowIndex(const std::string& name, std::span<const uint8_t> file, const std::vector<uint8_t>& reference,
+		uint32_t rowInterval)
+	{
+		RowIndex builtIndex;
+		builtIndex.rowInterval = rowInterval;
+		DecodeOptions options;
+		options.rowIndex = &builtIndex;
+		uint32_t width, height;
+		std::vector<uint8_t> image = decode(file, width, height, options, name + " row index");
+		check(image == reference, name + " row index: pixels");
+		check(builtIndex.checkpoints.size() == (height + rowInterval - 1) / rowInterval,
+			name + " row index: checkpoints");
+
+		std::string indexFilename = (std::filesystem::temp_directory_path() / "png_test.idx").string();
+		RowIndex index;
+		Result<void> loaded = catchPngError([&]()
+		{
+			builtIndex.save(indexFilename);
+			index.load(indexFilename);
+		});
+		std::filesystem::remove(indexFilename);
+		check(loaded.ok(), name + " row index save and load: " + (loaded.ok() ? "" : toString(loaded.error())));
+		if (!loaded.ok())
+			return;
+
+		const size_t rowSize = static_cast<size_t>(width) * 4;
+		// starting at checkpoints and between them, ranges past the end of
+		// short images are skipped
+		const uint32_t ranges[][2] = { { 0, 1 }, { rowInterval - 1, 2 }, { rowInterval + 2, rowInterval * 2 },
+			{ height - std::min(height, 3u), 3 }, { 0, height } };
+		for (const auto& [first, count] : ranges)
+		{
+			if (first >= height || count > height - first)
+				continue;
+			std::string what = name + " rows " + std::to_string(first) + "+" + std::to_string(count);
+			std::vector<uint8_t> rows;
+			Result<void> result = catchPngError([&]() { PngDecoder().decodeRows(file, index, first, count, rows); });
+			check(result.ok(), what + ": " + (result.ok() ? "" : toString(result.error())));
+			check(rows.size() == count * rowSize && std::equal(rows.begin(), rows.end(),
+				reference.begin() + first * rowSize), what + ": pixels");
+		}
+
+		// a checkpoint inside a dynamic block that lost its code lengths
+		for (RowIndex::Checkpoint& checkpoint : index.checkpoints)
+		{
+			if (checkpoint.inflater.codeLengths.empty())
+				continue;
+			checkpoint.inflater.codeLengths.resize(checkpoint.inflater.literalCodeCount);
+			std::vector<uint8_t> rows;
+			Result<void> result = catchPngError([&]() { PngDecoder().decodeRows(file, index, checkpoint.row, 1, rows); });
+			check(!result.ok() && result.error().code() == PngErrorCode::InvalidArgument,
+				name + ": corrupt checkpoint accepted");
+			break;
+		}
+	}
+
+	// small fixtures are inflated whole before the first checkpoint, so
+	// images large enough for checkpoints inside stored, fixed code and
+	// dynamic blocks are generated
+	void testRowIndex(const std::vector<Fixture>& fixtures)
+	{
+		for (const Fixture& fixture : fixtures)
+		{
+			if (readPngHeader(fixture.file).interlaceMethod == 0)
+				testRowIndex(fixture.name, fixture.file, decodeReference(fixture, Pixels::Format::Rgba8), 5);
+		}
+
+		const uint32_t width = 512, height = 256;
+		std::vector<uint8_t> pixels = generatePixels(width, height);
+		EncodeOptions options;
+		options.level = 0;
+		testRowIndex("generated stored image", encodePng(pixels, width, height, Pixels::Format::Rgba8, 0, options),
+			pixels, 16);
+		testRowIndex("generated fixed code image", encodeWithFixedCodes(pixels, width, height), pixels, 16);
+		options.level = 6;
+		testRowIndex("generated dynamic image", encodePng(pixels, width, height, Pixels::Format::Rgba8, 0, options),
+			pixels, 16);
+
+		// rows of a narrow flat image inflate far ahead of reading them, so
+		// checkpoints hold windows filled past windowBufferSize
+		const uint32_t narrowHeight = 70000;
+		std::vector<uint8_t> grey(narrowHeight, 100);
+		std::vector<uint8_t> narrowPixels;
+		for (uint8_t g : grey)
+			narrowPixels.insert(narrowPixels.end(), { g, g, g, 255 });
+		testRowIndex("generated narrow image", encodePng(grey, 1, narrowHeight, Pixels::Format::Grey8, 0, options),
+			narrowPixels, RowIndex().rowInterval);
+	}
+
+	// once a decoder has decoded all fixtures, decoding them again with it
+	// into the same vector mustn't allocate
+	void testBufferReuse(const std::vector<Fixture>& fixtures)
+	{
+		for (bool streaming : { false, true })
+		{
+			PngDecoder decoder;
+			std::vector<uint8_t> image;
+			DecodeOptions options;
+			options.streaming = streaming;
+			size_t allocations = 0;
+			for (int pass = 0; pass < 2; pass++)
+			{
+				size_t before = allocationCount;
+				for (const Fixture& fixture : fixtures)
+				{
+					uint32_t width, height;
+					decoder.decode(fixture.file, image, width, height, options);
+				}
+				allocations = allocationCount - before;
+			}
+			check(allocations == 0, std::string("reused decoder") + (streaming ? " streaming" : "") + ": "
+				+ std::to_string(allocations) + " allocations");
+		}
+	}
+
+	// what a decode at 1/scale should give, from the full size image:
+	// averages of blocks, or their top left pixels for interlaced images
+	// and palette indices
+	template<typename Sample>
+	std::vector<uint8_t> reduce(const std::vector<uint8_t>& image, uint32_t width, uint32_t height,
+		size_t channels, uint32_t scale, bool topLeft)
+	{
+		const uint32_t outWidth = (width + scale - 1) / scale;
+		const uint32_t outHeight = (height + scale - 1) / scale;
+		std::vector<uint8_t> res(static_cast<size_t>(outWidth) * outHeight * channels * sizeof(Sample));
+		auto getSample = [&](uint32_t x, uint32_t y, size_t c)
+		{
+			Sample sample;
+			std::memcpy(&sample, &image[((static_cast<size_t>(y) * width + x) * channels + c) * sizeof(Sample)],
+				sizeof(Sample));
+			return sample;
+		};
+		for (uint32_t y = 0; y < outHeight; y++)
+		{
+			for (uint32_t x = 0; x < outWidth; x++)
+			{
+				for (size_t c = 0; c < channels; c++)
+				{
+					uint32_t sum = 0, count = 0;
+					for (uint32_t by = y * scale; by < std::min(height, (y + 1) * scale) && (!topLeft || count == 0); by++)
+					{
+						for (uint32_t bx = x * scale; bx < std::min(width, (x + 1) * scale) && (!topLeft || count == 0); bx++)
+						{
+							sum += getSample(bx, by, c);
+							count++;
+						}
+					}
+					Sample average = static_cast<Sample>((sum + count / 2) / count);
+					std::memcpy(&res[((static_cast<size_t>(y) * outWidth + x) * channels + c) * sizeof(Sample)],
+						&average, sizeof(Sample));
+				}
+			}
+		}
+		return res;
+	}
+
+	void testScaledDecode(const Fixture& fixture)
+	{
+		const bool interlaced = readPngHeader(fixture.file).interlaceMethod != 0;
+		std::vector<Pixels::Format> formats = { Pixels::Format::Rgba8, Pixels::Format::Rgba16 };
+		if (fixture.hasIndices)
+			formats.push_back(Pixels::Format::PaletteIndex);
+		for (Pixels::Format format : formats)
+		{
+			const std::vector<uint8_t> reference = decodeReference(fixture, format);
+			for (uint32_t scale : { 2u, 4u, 8u })
+			{
+				std::string what = fixture.name + " format " + std::to_string(static_cast<int>(format))
+					+ " 1/" + std::to_string(scale);
+				DecodeOptions options;
+				options.format = format;
+				options.scale = scale;
+				uint32_t width = 0, height = 0;
+				std::vector<uint8_t> image = decode(fixture.file, width, height, options, what);
+				check(width == (fixture.width + scale - 1) / scale && height == (fixture.height + scale - 1) / scale,
+					what + ": size");
+				std::vector<uint8_t> expected;
+				if (format == Pixels::Format::Rgba16)
+					expected = reduce<uint16_t>(reference, fixture.width, fixture.height, 4, scale, interlaced);
+				else if (format == Pixels::Format::PaletteIndex)
+					expected = reduce<uint8_t>(reference, fixture.width, fixture.height, 1, scale, true);
+				else
+					expected = reduce<uint8_t>(reference, fixture.width, fixture.height, 4, scale, interlaced);
+				check(image == expected, what + ": pixels");
+			}
+		}
+
+		DecodeOptions options;
+		options.scale = 3;
+		std::vector<uint8_t> image;
+		uint32_t width, height;
+		Result<void> result = PngDecoder().tryDecode(fixture.file, image, width, height, options);
+		check(!result.ok() && result.error().code() == PngErrorCode::InvalidArgument,
+			fixture.name + ": scale 3 accepted");
+		RowIndex index;
+		options.scale = 2;
+		options.rowIndex = &index;
+		result = PngDecoder().tryDecode(fixture.file, image, width, height, options);
+		check(!result.ok() && result.error().code() == PngErrorCode::InvalidArgument,
+			fixture.name + ": scale with row index accepted");
+	}
+
+	// samples of image in format, widened to 16 bits
+	std::vector<uint16_t> getSamples(const std::vector<uint8_t>& image, Pixels::Format format)
+	{
+		if (format != Pixels::Format::Rgba16)
+			return std::vector<uint16_t>(image.begin(), image.end());
+		std::vector<uint16_t> samples(image.size() / 2);
+		std::memcpy(samples.data(), image.data(), samples.size() * 2);
+		return samples;
+	}
+
+	// tRNS colour keys, gAMA and sBIT, with expected samples worked out
+	// from the png specification
+	void testColourOptions()
+	{
+		// 8-bit grey keyed on 7, file gamma 1.0 and 5 significant bits
+		std::vector<uint8_t> grey = encodeRaw({ 7, 0x40, 0x80, 0xF8 }, 4, 1, 8, 0,
+			{ { "tRNS", { 0, 7 } }, { "gAMA", { 0, 1, 0x86, 0xA0 } }, { "sBIT", { 5 } } });
+		// 16-bit RGB keyed on the first pixel, the second one differs in
+		// the lowest bit of blue. 4, 6 and 10 significant bits
+		std::vector<uint8_t> rgb = encodeRaw({ 0x12, 0x34, 0x56, 0x78, 0x9A, 0xBC, 0x12, 0x34, 0x56, 0x78, 0x9A, 0xBD },
+			2, 1, 16, 2, { { "tRNS", { 0x12, 0x34, 0x56, 0x78, 0x9A, 0xBC } }, { "sBIT", { 4, 6, 10 } } });
+
+		struct Case
+		{
+			std::string what;
+			const std::vector<uint8_t>& file;
+			Pixels::Format format;
+			double screenGamma;
+			bool significantBits;
+			std::vector<uint16_t> expected;
+		};
+		using Format = Pixels::Format;
+		const Case cases[] = {
+			{ "grey Grey8", grey, Format::Grey8, 0, false, { 7, 64, 128, 248 } },
+			{ "grey Rgb8", grey, Format::Rgb8, 0, false, { 7, 7, 7, 64, 64, 64, 128, 128, 128, 248, 248, 248 } },
+			{ "grey Rgba16", grey, Format::Rgba16, 0, false,
+				{ 1799, 1799, 1799, 0, 16448, 16448, 16448, 65535, 32896, 32896, 32896, 65535,
+				63736, 63736, 63736, 65535 } },
+			{ "grey Grey8 sBIT", grey, Format::Grey8, 0, true, { 0, 65, 131, 255 } },
+			{ "grey Rgb8 sBIT", grey, Format::Rgb8, 0, true, { 0, 0, 0, 65, 65, 65, 131, 131, 131, 255, 255, 255 } },
+			{ "grey Rgba16 sBIT", grey, Format::Rgba16, 0, true,
+				{ 0, 0, 0, 0, 16912, 16912, 16912, 65535, 33824, 33824, 33824, 65535, 65535, 65535, 65535, 65535 } },
+			{ "grey Grey8 gAMA", grey, Format::Grey8, 2.2, false, { 50, 136, 186, 252 } },
+			{ "grey Rgb8 gAMA", grey, Format::Rgb8, 2.2, false, { 50, 50, 50, 136, 136, 136, 186, 186, 186, 252, 252, 252 } },
+			{ "grey Rgba16 gAMA", grey, Format::Rgba16, 2.2, false,
+				{ 12786, 12786, 12786, 0, 34961, 34961, 34961, 65535, 47909, 47909, 47909, 65535,
+				64711, 64711, 64711, 65535 } },
+			{ "grey Grey8 sBIT and gAMA", grey, Format::Grey8, 2.2, true, { 0, 137, 188, 255 } },
+			{ "grey Rgba16 sBIT and gAMA", grey, Format::Rgba16, 2.2, true,
+				{ 0, 0, 0, 0, 35406, 35406, 35406, 65535, 48518, 48518, 48518, 65535, 65535, 65535, 65535, 65535 } },
+			{ "rgb Rgb8", rgb, Format::Rgb8, 0, false, { 0x12, 0x56, 0x9A, 0x12, 0x56, 0x9A } },
+			{ "rgb Rgba16", rgb, Format::Rgba16, 0, false, { 0x1234, 0x5678, 0x9ABC, 0, 0x1234, 0x5678, 0x9ABD, 65535 } },
+			{ "rgb Rgb8 sBIT", rgb, Format::Rgb8, 0, true, { 17, 85, 0x9A, 17, 85, 0x9A } },
+			{ "rgb Rgba16 sBIT", rgb, Format::Rgba16, 0, true, { 4369, 21845, 39590, 0, 4369, 21845, 39590, 65535 } },
+		};
+		for (const Case& c : cases)
+		{
+			DecodeOptions options;
+			options.format = c.format;
+			options.colour.screenGamma = c.screenGamma;
+			options.colour.significantBits = c.significantBits;
+			uint32_t width, height;
+			std::vector<uint8_t> image = decode(c.file, width, height, options, c.what);
+			check(getSamples(image, c.format) == c.expected, c.what + ": samples");
+		}
+	}
+
+	// decodes file, which must fail with code at offset
+	void checkError(std::span<const uint8_t> file, const DecodeOptions& options, PngErrorCode code, uint64_t offset,
+		const std::string& what)
+	{
+		std::vector<uint8_t> image;
+		uint32_t width, height;
+		Result<void> result = PngDecoder().tryDecode(file, image, width, height, options);
+		check(!result.ok() && result.error().code() == code && result.error().offset() == offset,
+			what + ": " + (result.ok() ? "decoded" : toString(result.error())));
+	}
+
+	// rewrites the crc of chunk after its data was changed
+	void updateCrc(std::vector<uint8_t>& file, const ChunkInfo& chunk)
+	{
+		uint32_t crc = computeCrc(&file[chunk.offset - 4], chunk.length + 4);
+		std::vector<uint8_t> bytes;
+		PngChunkWriter::writeU32(bytes, crc);
+		std::copy(bytes.begin(), bytes.end(), file.begin() + chunk.offset + chunk.length);
+	}
+
+	// corrupted and truncated files fail with the code and the offset of
+	// the damage
+	void testErrors(const Fixture& fixture)
+	{
+		const PngInfo info = probePng(fixture.file);
+		std::vector<ChunkInfo> idats;
+		for (const ChunkInfo& chunk : info.chunks)
+			if (std::string(chunk.type.data(), 4) == "IDAT")
+				idats.push_back(chunk);
+		const ChunkInfo& lastIdat = idats.back();
+
+		for (bool streaming : { false, true })
+		{
+			std::string what = fixture.name + (streaming ? " streaming" : "");
+			DecodeOptions options;
+			options.streaming = streaming;
+
+			// crc of IHDR follows its 13 bytes of data at offset 16
+			std::vector<uint8_t> file = fixture.file;
+			file[29] ^= 1;
+			checkError(file, options, PngErrorCode::Crc, 29, what + " IHDR crc");
+			file = fixture.file;
+			file[lastIdat.offset + lastIdat.length] ^= 1;
+			checkError(file, options, PngErrorCode::Crc, lastIdat.offset + lastIdat.length, what + " IDAT crc");
+
+			// Adler-32 is the last 4 bytes of the zlib stream, reported once
+			// it's read
+			if (lastIdat.length >= 4)
+			{
+				file = fixture.file;
+				file[lastIdat.offset + lastIdat.length - 1] ^= 1;
+				updateCrc(file, lastIdat);
+				checkError(file, options, PngErrorCode::Adler32, lastIdat.offset + lastIdat.length,
+					what + " Adler-32");
+			}
+
+			// the file ends inside the first IDAT, whose data is reported
+			file.assign(fixture.file.begin(), fixture.file.begin() + idats[0].offset + idats[0].length / 2);
+			checkError(file, options, PngErrorCode::UnexpectedEnd, idats[0].offset, what + " truncated file");
+
+			// a complete IDAT chunk holding half of the zlib stream, the
+			// missing data is noticed at the IEND that follows
+			std::vector<uint8_t> zlibData;
+			for (const ChunkInfo& idat : idats)
+				zlibData.insert(zlibData.end(), fixture.file.begin() + idat.offset,
+					fixture.file.begin() + idat.offset + idat.length);
+			zlibData.resize(zlibData.size() / 2);
+			file.assign(fixture.file.begin(), fixture.file.begin() + idats[0].offset - 8);
+			PngChunkWriter out(file);
+			out.writeChunk("IDAT", zlibData);
+			out.writeChunk("IEND", {});
+			checkError(file, options, PngErrorCode::UnexpectedEnd, file.size() - 4, what + " truncated IDAT");
+		}
+	}
+
+	// images over DecodeLimits fail right after IHDR, which ends at offset 33,
+	// and images at the limits decode
+	void testLimits(const Fixture& fixture)
+	{
+		const PngHeader header = readPngHeader(fixture.file);
+		uint32_t byteLineLength, distBetweenCorrBytes;
+		getScanlineLayout(header.width, header.bitDepth, header.colourType, byteLineLength, distBetweenCorrBytes);
+		for (bool streaming : { false, true })
+		{
+			std::string what = fixture.name + (streaming ? " streaming" : "");
+			DecodeOptions options;
+			options.streaming = streaming;
+			options.limits.maxPixels = static_cast<uint64_t>(header.width) * header.height;
+			uint32_t width, height;
+			decode(fixture.file, width, height, options, what + " at pixel limit");
+			options.limits.maxPixels--;
+			checkError(fixture.file, options, PngErrorCode::Limit, 33, what + " pixel limit");
+
+			options = DecodeOptions();
+			options.streaming = streaming;
+			// interlaced images inflate to the scanlines of all passes, so they
+			// are only checked against a limit below any image
+			if (header.interlaceMethod == 0)
+			{
+				options.limits.maxInflatedBytes = static_cast<uint64_t>(byteLineLength + 1) * header.height;
+				decode(fixture.file, width, height, options, what + " at inflated size limit");
+				options.limits.maxInflatedBytes--;
+			}
+			else
+				options.limits.maxInflatedBytes = header.height;
+			checkError(fixture.file, options, PngErrorCode::Limit, 33, what + " inflated size limit");
+		}
+	}
+
+	// the chunk table of probePng covers the file from IHDR to IEND, and
+	// damaged image data doesn't matter to it as it doesn't inflate
+	void testProbe(const Fixture& fixture)
+	{
+		Result<PngInfo> probed = tryProbePng(fixture.file);
+		check(probed.ok(), fixture.name + " probe: " + (probed.ok() ? "" : toString(probed.error())));
+		if (!probed.ok())
+			return;
+		const PngInfo& info = probed.value();
+		check(info.header.width == fixture.width && info.header.height == fixture.height, fixture.name + " probe: size");
+		const std::vector<ChunkInfo>& chunks = info.chunks;
+		check(chunks.size() >= 3 && std::string(chunks.front().type.data(), 4) == "IHDR"
+			&& chunks.front().length == 13 && chunks.front().offset == 16
+			&& std::string(chunks.back().type.data(), 4) == "IEND" && chunks.back().length == 0
+			&& chunks.back().offset == fixture.file.size() - 4, fixture.name + " probe: IHDR and IEND");
+		// chunks follow each other, with 12 bytes of length, type and crc
+		bool contiguous = true;
+		for (size_t i = 1; i < chunks.size(); i++)
+			contiguous &= chunks[i].offset == chunks[i - 1].offset + chunks[i - 1].length + 12;
+		check(contiguous, fixture.name + " probe: chunk offsets");
+
+		// a zlib header with an invalid compression method under a valid crc
+		const ChunkInfo* idat = nullptr;
+		for (const ChunkInfo& chunk : chunks)
+			if (!idat && std::string(chunk.type.data(), 4) == "IDAT")
+				idat = &chunk;
+		std::vector<uint8_t> file = fixture.file;
+		file[idat->offset] = 0x7F;
+		updateCrc(file, *idat);
+		Result<PngInfo> damaged = tryProbePng(file);
+		check(damaged.ok() && damaged.value().chunks.size() == chunks.size(), fixture.name + " probe: inflated");
+		// the first IDAT is read whole before inflating starts
+		checkError(file, DecodeOptions(), PngErrorCode::Deflate, idat->offset + idat->length,
+			fixture.name + " damaged zlib header");
+
+		// crc of chunks after IHDR is checked unless skipped
+		file = fixture.file;
+		file[idat->offset + idat->length] ^= 1;
+		Result<PngInfo> badCrc = tryProbePng(file);
+		check(!badCrc.ok() && badCrc.error().code() == PngErrorCode::Crc
+			&& badCrc.error().offset() == idat->offset + idat->length, fixture.name + " probe: crc");
+		check(tryProbePng(file, true).ok(), fixture.name + " probe: skipped crc");
+	}
+
+	// DecodeStats agree with the chunk table and with stored or static
+	// blocks named by the fixture, and toJson writes them
+	void testStats(const Fixture& fixture)
+	{
+		std::vector<uint32_t> idatLengths;
+		for (const ChunkInfo& chunk : probePng(fixture.file).chunks)
+			if (std::string(chunk.type.data(), 4) == "IDAT")
+				idatLengths.push_back(chunk.length);
+		const bool interlaced = readPngHeader(fixture.file).interlaceMethod != 0;
+
+		for (bool streaming : { false, true })
+		{
+			std::string what = fixture.name + (streaming ? " streaming" : "") + " stats";
+			DecodeStats stats;
+			DecodeOptions options;
+			options.streaming = streaming;
+			options.stats = &stats;
+			uint32_t width, height;
+			decode(fixture.file, width, height, options, what);
+			check(stats.idatChunkLengths == idatLengths, what + ": IDAT lengths");
+			uint64_t scanlines = 0;
+			for (uint64_t count : stats.filterTypes)
+				scanlines += count;
+			check(interlaced ? scanlines > height : scanlines == height, what + ": filter types");
+			const InflateStats& inflate = stats.inflate;
+			uint64_t lengthCount = 0, distanceCount = 0;
+			for (uint64_t count : inflate.lengthCodes)
+				lengthCount += count;
+			for (uint64_t count : inflate.distanceCodes)
+				distanceCount += count;
+			check(lengthCount == inflate.matches && distanceCount == inflate.matches, what + ": match histograms");
+			if (fixture.name.find("stored") != std::string::npos)
+				check(inflate.storedBlocks > 0 && inflate.staticBlocks == 0 && inflate.dynamicBlocks == 0
+					&& inflate.storedBytes > 0, what + ": stored blocks");
+			if (fixture.name.find("static") != std::string::npos)
+				check(inflate.staticBlocks > 0 && inflate.storedBlocks == 0 && inflate.dynamicBlocks == 0,
+					what + ": static blocks");
+			// small images asked for dynamic blocks may get static ones
+			check(inflate.storedBlocks + inflate.staticBlocks + inflate.dynamicBlocks > 0, what + ": blocks");
+			check(stats.totalSeconds > 0 && stats.totalSeconds >= stats.inflateSeconds, what + ": seconds");
+
+			std::ostringstream idatChunks, filterTypes, blocks;
+			idatChunks << "\"idatChunks\": {\"count\": " << idatLengths.size() << ", \"lengths\": [";
+			for (size_t i = 0; i < idatLengths.size(); i++)
+				idatChunks << (i ? ", " : "") << idatLengths[i];
+			idatChunks << "]}";
+			filterTypes << "\"filterTypes\": [" << stats.filterTypes[0] << ", " << stats.filterTypes[1] << ", "
+				<< stats.filterTypes[2] << ", " << stats.filterTypes[3] << ", " << stats.filterTypes[4] << "]";
+			blocks << "\"blocks\": {\"stored\": " << inflate.storedBlocks << ", \"static\": " << inflate.staticBlocks
+				<< ", \"dynamic\": " << inflate.dynamicBlocks << "}";
+			std::string json = stats.toJson();
+			check(json.front() == '{' && json.back() == '}' && json.find("\"seconds\": {\"header\": ") != std::string::npos
+				&& json.find(idatChunks.str()) != std::string::npos && json.find(filterTypes.str()) != std::string::npos
+				&& json.find(blocks.str()) != std::string::npos
+				&& json.find("\"matches\": " + std::to_string(inflate.matches) + ",") != std::string::npos
+				&& json.find("{\"min\": 3, \"max\": 3, \"count\": " + std::to_string(inflate.lengthCodes[0]) + "}")
+				!= std::string::npos, what + ": json");
+		}
+	}
+}
+
+int main(int argc, char** argv)
+{
+	std::string dir = argc > 1 ? argv[1] : "testdata";
+	try
+	{
+		std::vector<Fixture> fixtures = loadFixtures(dir);
+		for (const Fixture& fixture : fixtures)
+			testReference(fixture);
+		testBufferReuse(fixtures);
+		testParallelInflate(fixtures);
+		testRowIndex(fixtures);
+		for (const Fixture& fixture : fixtures)
+			testFormats(fixture);
+		for (const Fixture& fixture : fixtures)
+			testScaledDecode(fixture);
+		testColourOptions();
+		for (const Fixture& fixture : fixtures)
+			testErrors(fixture);
+		for (const Fixture& fixture : fixtures)
+			testLimits(fixture);
+		for (const Fixture& fixture : fixtures)
+			testProbe(fixture);
+		for (const Fixture& fixture : fixtures)
+			testStats(fixture);
+		std::cout << fixtures.size() << " fixtures, " << failures << " failures" << std::endl;
+	}
+	catch (const PngError& e)
+	{
+		std::cout << toString(e) << std::endl;
+		return 1;
+	}
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,83 @@
+#include <png.h>
+#include <zlib.h>
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <vector>
+
+// writes a line of reference.txt for each png given, decoded with libpng:
+//   g++ make_reference.cpp -lpng -lz -o make_reference
+//   ./make_reference *.png > reference.txt
+
+namespace
+{
+	// decodes to 16-bit RGBA, samples MSB first, or to one palette index
+	// per byte if indices is set
+	std::vector<uint8_t> decode(const char* filename, bool indices, uint32_t& width, uint32_t& height,
+		int& colourType)
+	{
+		FILE* file = std::fopen(filename, "rb");
+		if (!file)
+			return {};
+		png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+		png_infop info = png_create_info_struct(png);
+		std::vector<uint8_t> image;
+		if (setjmp(png_jmpbuf(png)))
+		{
+			png_destroy_read_struct(&png, &info, nullptr);
+			std::fclose(file);
+			return {};
+		}
+		png_init_io(png, file);
+		png_read_info(png, info);
+		width = png_get_image_width(png, info);
+		height = png_get_image_height(png, info);
+		colourType = png_get_color_type(png, info);
+		if (indices)
+			png_set_packing(png);
+		else
+		{
+			png_set_expand(png);
+			png_set_expand_16(png);
+			png_set_gray_to_rgb(png);
+			png_set_add_alpha(png, 0xFFFF, PNG_FILLER_AFTER);
+		}
+		png_set_interlace_handling(png);
+		png_read_update_info(png, info);
+		size_t rowSize = png_get_rowbytes(png, info);
+		image.resize(rowSize * height);
+		std::vector<png_bytep> rows(height);
+		for (uint32_t y = 0; y < height; y++)
+			rows[y] = image.data() + y * rowSize;
+		png_read_image(png, rows.data());
+		png_destroy_read_struct(&png, &info, nullptr);
+		std::fclose(file);
+		return image;
+	}
+
+	uint32_t crc(const std::vector<uint8_t>& data)
+	{
+		return static_cast<uint32_t>(crc32(0, data.data(), static_cast<uInt>(data.size())));
+	}
+}
+
+int main(int argc, char** argv)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		uint32_t width, height;
+		int colourType;
+		std::vector<uint8_t> rgba16 = decode(argv[i], false, width, height, colourType);
+		// 8-bit samples are the high bytes
+		std::vector<uint8_t> rgba8(rgba16.size() / 2);
+		for (size_t j = 0; j < rgba8.size(); j++)
+			rgba8[j] = rgba16[j * 2];
+		const char* name = std::strrchr(argv[i], '/') ? std::strrchr(argv[i], '/') + 1 : argv[i];
+		std::printf("%s %u %u %08x %08x", name, width, height, crc(rgba8), crc(rgba16));
+		if (colourType == PNG_COLOR_TYPE_PALETTE)
+			std::printf(" %08x", crc(decode(argv[i], true, width, height, colourType)));
+		std::printf("\n");
+	}
+	return 0;
+}
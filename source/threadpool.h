@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <type_traits>
+
+// fixed set of worker threads running submitted tasks in submission order
+class ThreadPool
+{
+public:
+	ThreadPool(size_t threadCount = std::thread::hardware_concurrency());
+	~ThreadPool();
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	size_t size() const;
+	// runs task on one of the threads, exceptions thrown by the task
+	// are rethrown from get of the returned future
+	template<typename Task>
+	std::future<std::invoke_result_t<Task>> submit(Task task);
+private:
+	std::vector<std::thread> threads;
+	std::deque<std::function<void()>> tasks;
+	std::mutex mutex;
+	std::condition_variable condition;
+	bool stopping = false;
+
+	void work();
+};
+
+template<typename Task>
+std::future<std::invoke_result_t<Task>> ThreadPool::submit(Task task)
+{
+	// std::function needs a copyable target
+	auto packaged = std::make_shared<std::packaged_task<std::invoke_result_t<Task>()>>(std::move(task));
+	std::future<std::invoke_result_t<Task>> res = packaged->get_future();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		tasks.emplace_back([packaged]() { (*packaged)(); });
+	}
+	condition.notify_one();
+	return res;
+}
@@ -0,0 +1,336 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <mutex>
+#include <condition_variable>
+
+#include "decoder.h"
+#include "encoder.h"
+#include "mappedfile.h"
+
+// png_tool, command line modes that don't need a window:
+//   png_tool --batch [--threads n] [--memory MiB] (file | directory | @list)...
+//   png_tool --encode [--level n] [--threads n] input output
+//   png_tool --stats [--streaming] file
+
+// limits the total estimated memory of images decoded at the same time.
+// An image larger than the whole budget waits until it can be decoded alone
+class MemoryBudget
+{
+public:
+	MemoryBudget(size_t limit) : limit(std::max<size_t>(limit, 1)) {}
+
+	// blocks until bytes fit into the budget, returns the amount to release
+	size_t acquire(size_t bytes)
+	{
+		bytes = std::min(bytes, limit);
+		std::unique_lock<std::mutex> lock(mutex);
+		condition.wait(lock, [&]() { return used + bytes <= limit; });
+		used += bytes;
+		return bytes;
+	}
+	void release(size_t bytes)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			used -= bytes;
+		}
+		condition.notify_all();
+	}
+private:
+	size_t limit;
+	size_t used = 0;
+	std::mutex mutex;
+	std::condition_variable condition;
+};
+
+// reads only the header to estimate peak memory of a streaming decode
+size_t estimateDecodeMemory(std::span<const uint8_t> in)
+{
+	PngHeader header = readPngHeader(in);
+	uint32_t byteLineLength, distBetweenCorrBytes;
+	getScanlineLayout(header.width, header.bitDepth, header.colourType, byteLineLength, distBetweenCorrBytes);
+	size_t buffers = 2 * static_cast<size_t>(byteLineLength) + Inflater::windowAllocationSize;
+	// dimensions near 2^31 would wrap, saturating makes the budget clamp them
+	uint64_t pixels = static_cast<uint64_t>(header.width) * header.height;
+	if (pixels > (SIZE_MAX - buffers) / 4)
+		return SIZE_MAX;
+	return static_cast<size_t>(pixels) * 4 + buffers;
+}
+
+// expands directories (recursively, .png files only) and @list files
+// with one path per line into a sorted list of files
+std::vector<std::string> gatherBatchFiles(const std::vector<std::string>& args)
+{
+	namespace fs = std::filesystem;
+	std::vector<std::string> files;
+	for (const std::string& arg : args)
+	{
+		if (arg.size() > 1 && arg[0] == '@')
+		{
+			std::ifstream list(arg.substr(1));
+			if (!list)
+				throwPngError(PngErrorCode::Io, "cannot open file list");
+			std::string line;
+			while (std::getline(list, line))
+			{
+				if (!line.empty() && line.back() == '\r')
+					line.pop_back();
+				if (!line.empty())
+					files.push_back(line);
+			}
+		}
+		else if (fs::is_directory(arg))
+		{
+			std::vector<std::string> dirFiles;
+			for (const fs::directory_entry& entry : fs::recursive_directory_iterator(arg))
+				if (entry.is_regular_file() && entry.path().extension() == ".png")
+					dirFiles.push_back(entry.path().string());
+			std::sort(dirFiles.begin(), dirFiles.end());
+			files.insert(files.end(), dirFiles.begin(), dirFiles.end());
+		}
+		else
+			files.push_back(arg);
+	}
+	return files;
+}
+
+// decodes all files on threadCount threads with at most memoryLimit bytes
+// of estimated decoder memory allocated at a time, prints a status line per file and
+// totals at the end. Returns the number of failed files
+size_t decodeBatch(const std::vector<std::string>& files, size_t threadCount, size_t memoryLimit)
+{
+	MemoryBudget budget(memoryLimit);
+	std::mutex outMutex;
+	std::atomic<size_t> nextFile = 0;
+	std::atomic<size_t> failed = 0;
+	std::atomic<uint64_t> inputBytes = 0;
+	std::atomic<uint64_t> outputBytes = 0;
+
+	// every idle thread takes the next file, so one slow image doesn't
+	// hold up the files behind it
+	auto worker = [&]()
+	{
+		// buffers keep the size of the largest image decoded with them, so
+		// their reservation is kept as long as they are. They are reused
+		// for images with the same estimate and dropped before reserving
+		// for any other, so that retained buffers never exceed the budget
+		PngDecoder decoder;
+		std::vector<uint8_t> image;
+		size_t reservedEstimate = 0;
+		size_t reserved = 0;
+		for (size_t i = nextFile++; i < files.size(); i = nextFile++)
+		{
+			auto start = std::chrono::steady_clock::now();
+			std::string status;
+			try
+			{
+				MappedFile in(files[i]);
+				if (!in.isOpen())
+					throwPngError(PngErrorCode::Io, "file not found");
+				size_t estimate = estimateDecodeMemory(in.data());
+				if (estimate != reservedEstimate)
+				{
+					image = {};
+					decoder = PngDecoder();
+					budget.release(reserved);
+					reserved = budget.acquire(estimate);
+					reservedEstimate = estimate;
+				}
+				uint32_t width, height;
+				DecodeOptions options;
+				options.streaming = true;
+				decoder.decode(in.data(), image, width, height, options);
+				inputBytes += in.data().size();
+				outputBytes += image.size();
+				status = "ok    " + std::to_string(width) + "x" + std::to_string(height);
+			}
+			catch (const PngError& e)
+			{
+				failed++;
+				status = "error " + toString(e);
+			}
+			catch (const std::exception& e)
+			{
+				failed++;
+				status = std::string("error ") + e.what();
+			}
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			std::lock_guard<std::mutex> lock(outMutex);
+			std::cout << files[i] << ": " << status << " (" << ms << " ms)\n";
+		}
+		budget.release(reserved);
+	};
+
+	auto start = std::chrono::steady_clock::now();
+	{
+		ThreadPool threadPool(threadCount);
+		std::vector<std::future<void>> workers;
+		for (size_t i = 0; i < threadPool.size(); i++)
+			workers.push_back(threadPool.submit(worker));
+		for (std::future<void>& w : workers)
+			w.get();
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	std::cout << files.size() - failed << " of " << files.size() << " images decoded in "
+		<< seconds << " s: " << files.size() / seconds << " images/s, "
+		<< inputBytes / seconds / 1e6 << " MB/s in, "
+		<< outputBytes / seconds / 1e6 << " MB/s out" << std::endl;
+	return failed;
+}
+
+// decodes a png and encodes it again, e.g. to recompress it
+void reencodeFile(const std::string& inName, const std::string& outName, const EncodeOptions& options)
+{
+	MappedFile in(inName);
+	if (!in.isOpen())
+		throwPngError(PngErrorCode::Io, "file not found");
+	uint32_t width, height;
+	DecodeOptions decodeOptions;
+	decodeOptions.threadPool = options.threadPool;
+	std::vector<uint8_t> image = decodePng(in.data(), width, height, decodeOptions);
+	auto start = std::chrono::steady_clock::now();
+	std::vector<uint8_t> png = encodePng(image, width, height, Pixels::Format::Rgba8, 0, options);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::ofstream out(outName, std::ios_base::binary);
+	out.write(reinterpret_cast<const char*>(png.data()), png.size());
+	if (!out)
+		throwPngError(PngErrorCode::Io, "cannot write output file");
+	std::cout << width << "x" << height << ": " << in.data().size() << " -> " << png.size() << " bytes in "
+		<< seconds << " s, " << image.size() / seconds / 1e6 << " MB/s" << std::endl;
+}
+
+// decodes a png once and prints its DecodeStats
+void printDecodeStats(const std::string& filename, bool streaming)
+{
+	MappedFile in(filename);
+	if (!in.isOpen())
+		throwPngError(PngErrorCode::Io, "file not found");
+	uint32_t width, height;
+	DecodeStats stats;
+	DecodeOptions options;
+	options.streaming = streaming;
+	options.stats = &stats;
+	decodePng(in.data(), width, height, options);
+	std::cout << stats.toJson() << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+	// png_tool --batch [--threads n] [--memory MiB] (file | directory | @list)...
+	if (argc > 1 && std::string(argv[1]) == "--batch")
+	{
+		size_t threadCount = std::thread::hardware_concurrency();
+		size_t memoryLimit = size_t(1) << 30;
+		std::vector<std::string> args;
+		for (int i = 2; i < argc; i++)
+		{
+			std::string arg = argv[i];
+			if (arg == "--threads" && i + 1 < argc)
+				threadCount = std::stoul(argv[++i]);
+			else if (arg == "--memory" && i + 1 < argc)
+				memoryLimit = std::stoull(argv[++i]) << 20;
+			else
+				args.push_back(arg);
+		}
+		try
+		{
+			return decodeBatch(gatherBatchFiles(args), threadCount, memoryLimit) == 0 ? 0 : 1;
+		}
+		catch (const PngError& e)
+		{
+			std::clog << toString(e) << std::endl;
+			return 1;
+		}
+		catch (const std::exception& e)
+		{
+			std::clog << e.what() << std::endl;
+			return 1;
+		}
+	}
+
+	// png_tool --encode [--level n] [--threads n] input output
+	if (argc > 1 && std::string(argv[1]) == "--encode")
+	{
+		EncodeOptions options;
+		size_t threadCount = std::thread::hardware_concurrency();
+		std::vector<std::string> args;
+		for (int i = 2; i < argc; i++)
+		{
+			std::string arg = argv[i];
+			if (arg == "--level" && i + 1 < argc)
+				options.level = std::stoi(argv[++i]);
+			else if (arg == "--threads" && i + 1 < argc)
+				threadCount = std::stoul(argv[++i]);
+			else
+				args.push_back(arg);
+		}
+		if (args.size() != 2)
+		{
+			std::clog << "usage: png_tool --encode [--level n] [--threads n] input output" << std::endl;
+			return 1;
+		}
+		try
+		{
+			ThreadPool threadPool(threadCount);
+			options.threadPool = &threadPool;
+			reencodeFile(args[0], args[1], options);
+			return 0;
+		}
+		catch (const PngError& e)
+		{
+			std::clog << toString(e) << std::endl;
+			return 1;
+		}
+		catch (const std::exception& e)
+		{
+			std::clog << e.what() << std::endl;
+			return 1;
+		}
+	}
+
+	// png_tool --stats [--streaming] file
+	if (argc > 1 && std::string(argv[1]) == "--stats")
+	{
+		bool streaming = false;
+		std::vector<std::string> args;
+		for (int i = 2; i < argc; i++)
+		{
+			std::string arg = argv[i];
+			if (arg == "--streaming")
+				streaming = true;
+			else
+				args.push_back(arg);
+		}
+		if (args.size() != 1)
+		{
+			std::clog << "usage: png_tool --stats [--streaming] file" << std::endl;
+			return 1;
+		}
+		try
+		{
+			printDecodeStats(args[0], streaming);
+			return 0;
+		}
+		catch (const PngError& e)
+		{
+			std::clog << toString(e) << std::endl;
+			return 1;
+		}
+		catch (const std::exception& e)
+		{
+			std::clog << e.what() << std::endl;
+			return 1;
+		}
+	}
+
+	std::clog << "usage: png_tool (--batch | --encode | --stats) ..." << std::endl;
+	return 1;
+}